@@ -0,0 +1,360 @@
+/*
+    Benchmarks of the BFAST, G3D and VIM headers on synthetic data
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+
+    Built with the compiler settings of the Release configuration of Vim.G3d.CppCLR, without /clr, since the threads and SIMD paths
+    being measured are disabled under /clr:
+        cl /std:c++17 /O2 /EHsc /DNDEBUG /I..\include bench.cpp
+        g++ -std=c++17 -O2 -DNDEBUG -pthread -I../include bench.cpp -o bench
+
+    Usage: bench [name] [scale]
+    Runs every benchmark, or the one with the given name. The scale multiplies the size of the data (1 by default).
+    The files are written to the current directory and read back while they are in the file cache.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "g3d.h"
+#include "vim.h"
+#include "convert.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <unistd.h>
+#endif
+
+namespace bench
+{
+    using namespace std;
+
+    /// Returns the resident set size of the process in bytes
+    inline size_t resident_bytes()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.WorkingSetSize : 0;
+#else
+        size_t pages = 0, resident = 0;
+        auto f = fopen("/proc/self/statm", "r");
+        if (f == nullptr)
+            return 0;
+        if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+        return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    }
+
+    /// Returns the shortest time of several runs of f, in milliseconds
+    inline double best_ms(const function<void()>& f, int runs = 5)
+    {
+        auto best = 1e300;
+        for (int r = 0; r < runs; ++r) {
+            auto start = chrono::steady_clock::now();
+            f();
+            best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+
+    /// Results are added to this so that the compiler keeps the work being measured
+    static volatile double sink = 0;
+
+    /// Returns the throughput in MB/s of processing the given number of bytes in the given time
+    inline double mb_per_s(size_t bytes, double ms)
+    {
+        return ms > 0 ? bytes / (ms * 1000.0) : 0;
+    }
+
+    /// The attributes of a G3d of meshes that are each a square grid of vertices with two triangles per cell
+    struct Grid
+    {
+        vector<float> positions;
+        vector<int> indices;
+        vector<int> mesh_vertex_offsets;
+        vector<int> mesh_submesh_offsets;
+        vector<int> submesh_index_offsets;
+
+        Grid(size_t num_meshes, int side)
+        {
+            for (size_t m = 0; m < num_meshes; ++m) {
+                auto first = (int)(positions.size() / 3);
+                mesh_vertex_offsets.push_back(first);
+                mesh_submesh_offsets.push_back((int)submesh_index_offsets.size());
+                submesh_index_offsets.push_back((int)indices.size());
+                for (int y = 0; y < side; ++y)
+                    for (int x = 0; x < side; ++x) {
+                        positions.push_back(m * 100.0f + x * 0.25f);
+                        positions.push_back(y * 0.25f);
+                        positions.push_back(0.01f * ((x * 7 + y * 13) % 17));
+                    }
+                for (int y = 0; y + 1 < side; ++y)
+                    for (int x = 0; x + 1 < side; ++x) {
+                        auto v = first + y * side + x;
+                        int quad[] = { v, v + 1, v + side, v + side, v + 1, v + side + 1 };
+                        indices.insert(indices.end(), quad, quad + 6);
+                    }
+            }
+        }
+
+        g3d::G3d g3d()
+        {
+            g3d::G3d r;
+            r.add_attribute(g3d::descriptors::Position, positions.data(), positions.size() * sizeof(float));
+            r.add_attribute(g3d::descriptors::Index, indices.data(), indices.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::MeshVertexOffset, mesh_vertex_offsets.data(), mesh_vertex_offsets.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::MeshSubmeshOffset, mesh_submesh_offsets.data(), mesh_submesh_offsets.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::SubmeshIndexOffset, submesh_index_offsets.data(), submesh_index_offsets.size() * sizeof(int));
+            return r;
+        }
+    };
+
+    /// Time to first attribute and resident memory of G3d::read_file, reading the whole file or mapping it
+    inline void mmap_load(double scale)
+    {
+        Grid grid((size_t)(64 * scale), 256);
+        grid.g3d().write_file("bench_mmap.g3d");
+        auto file_size = grid.positions.size() * sizeof(float) + grid.indices.size() * sizeof(int);
+        grid = Grid(0, 0);
+        printf("mmap_load: %.1f MB file\n", file_size / 1e6);
+
+        for (auto mapped : { false, true }) {
+            auto ms = best_ms([&]() {
+                g3d::G3d g;
+                g.read_file("bench_mmap.g3d", mapped, 1);
+                sink = sink + g.view<float, 3>(g3d::descriptors::Position)[0][0];
+            });
+            auto before = resident_bytes();
+            g3d::G3d g;
+            g.read_file("bench_mmap.g3d", mapped, 1);
+            sink = sink + g.view<float, 3>(g3d::descriptors::Position)[0][0];
+            auto after = resident_bytes();
+            printf("  %-8s time to first attribute %8.2f ms, resident memory added %8.1f MB\n", mapped ? "mapped" : "read",
+                ms, (after > before ? after - before : 0) / 1e6);
+        }
+        remove("bench_mmap.g3d");
+    }
+
+    /// The descriptor parser that AttributeDescriptor::from_string replaced: it splits with a stringstream, copies the name maps on each
+    /// lookup and converts the numbers with stoi. Kept here as the reference of descriptor_parse.
+    inline g3d::AttributeDescriptor previous_from_string(const string& s)
+    {
+        vector<string> tokens;
+        stringstream ss(s);
+        string item;
+        while (getline(ss, item, ':'))
+            tokens.push_back(item);
+        if (tokens.size() != 6 || tokens[0] != "g3d")
+            throw runtime_error("Invalid descriptor");
+        auto associations = g3d::AttributeDescriptor::associations_from_strings();
+        auto data_types = g3d::AttributeDescriptor::data_types_from_strings();
+        g3d::AttributeDescriptor desc;
+        desc.association = associations.at(tokens[1]);
+        desc.semantic = tokens[2];
+        desc.index = stoi(tokens[3]);
+        desc.data_type = data_types.at(tokens[4]);
+        desc.data_arity = stoi(tokens[5]);
+        return desc;
+    }
+
+    /// Time per descriptor of the previous parser, of AttributeDescriptor::from_string and of DescriptorView::parse
+    inline void descriptor_parse(double scale)
+    {
+        const vector<string> names = {
+            g3d::descriptors::Position, g3d::descriptors::Index, g3d::descriptors::ObjectFaceSize, g3d::descriptors::SubmeshIndexOffset,
+            g3d::descriptors::SubmeshMaterial, g3d::descriptors::MeshSubmeshOffset, g3d::descriptors::InstanceTransform,
+            g3d::descriptors::InstanceParent, g3d::descriptors::InstanceMesh, g3d::descriptors::MaterialColor,
+            g3d::descriptors::VertexUv, g3d::descriptors::VertexNormal, "g3d:corner:index:3:int32:1", "g3d:face:group:0:int16:1",
+        };
+        auto iterations = (size_t)(20000 * scale);
+        auto count = iterations * names.size();
+        printf("descriptor_parse: %zu descriptors\n", count);
+        auto report = [&](const char* label, const function<void(const string&)>& parse) {
+            auto ms = best_ms([&]() {
+                for (size_t i = 0; i < iterations; ++i)
+                    for (const auto& name : names)
+                        parse(name);
+            });
+            printf("  %-32s %8.1f ns per descriptor\n", label, ms * 1e6 / count);
+        };
+        report("previous parser", [](const string& name) { sink = sink + previous_from_string(name).data_arity; });
+        report("AttributeDescriptor::from_string", [](const string& name) { sink = sink + g3d::AttributeDescriptor::from_string(name).data_arity; });
+        report("DescriptorView::parse", [](const string& name) { sink = sink + g3d::DescriptorView::parse(name).data_arity; });
+    }
+
+    /// Returns the size of a file in bytes
+    inline size_t file_size(const char* path)
+    {
+        ifstream f(path, ios_base::binary | ios_base::ate);
+        return f ? (size_t)f.tellg() : 0;
+    }
+
+    /// Size and throughput of G3d::write_file and read_file with the shuffle and delta filters and with quantized positions,
+    /// and throughput of PositionQuantizer alone. Throughputs are of the uncompressed attribute bytes.
+    inline void geometry_filters(double scale)
+    {
+        Grid grid((size_t)(64 * scale), 256);
+        auto g3d = grid.g3d();
+        auto raw_size = grid.positions.size() * sizeof(float) + grid.indices.size() * sizeof(int);
+        printf("geometry_filters: %.1f MB of positions and indices\n", raw_size / 1e6);
+
+        struct Case { const char* label; bfast::Codec codec; bool filters; g3d::DataType positions; };
+        const Case cases[] = {
+            { "uncompressed", bfast::codec_none, false, g3d::dt_float32 },
+            { "lz4", bfast::codec_lz4, false, g3d::dt_float32 },
+            { "lz4 + filters", bfast::codec_lz4, true, g3d::dt_float32 },
+            { "lz4 + filters + uint16 positions", bfast::codec_lz4, true, g3d::dt_uint16 },
+        };
+        for (const auto& c : cases) {
+            g3d::WriteOptions options;
+            options.codec = c.codec;
+            options.filters = c.filters;
+            options.position_type = c.positions;
+            auto write_ms = best_ms([&]() { g3d.write_file("bench_filters.g3d", options); }, 3);
+            auto read_ms = best_ms([&]() {
+                g3d::G3d r;
+                r.read_file("bench_filters.g3d");
+                sink = sink + r.view<float, 3>(g3d::descriptors::Position)[0][0];
+            }, 3);
+            printf("  %-34s compression %6.2fx, write %8.1f MB/s, read %8.1f MB/s\n", c.label, (double)raw_size / file_size("bench_filters.g3d"),
+                mb_per_s(raw_size, write_ms), mb_per_s(raw_size, read_ms));
+        }
+        remove("bench_filters.g3d");
+
+        auto num_vertices = grid.positions.size() / 3;
+        auto ranges = g3d::PositionQuantizer::ranges(grid.mesh_vertex_offsets.data(), grid.mesh_vertex_offsets.size(), num_vertices);
+        vector<uint16_t> quantized(grid.positions.size());
+        vector<float> bounds((ranges.size() - 1) * 6), positions(grid.positions.size());
+        auto quantize_ms = best_ms([&]() { g3d::PositionQuantizer::quantize(grid.positions.data(), ranges, quantized.data(), bounds.data()); });
+        auto dequantize_ms = best_ms([&]() { g3d::PositionQuantizer::dequantize(quantized.data(), ranges, bounds.data(), positions.data()); });
+        printf("  uint16 positions: quantize %8.1f MB/s, dequantize %8.1f MB/s\n",
+            mb_per_s(grid.positions.size() * sizeof(float), quantize_ms), mb_per_s(grid.positions.size() * sizeof(float), dequantize_ms));
+    }
+
+    /// Throughput of the float16 conversions of convert.h, of the scalar conversions they fall back to, and of the float64 ones.
+    /// Throughputs are of the float32 bytes.
+    inline void float16_convert(double scale)
+    {
+        auto count = (size_t)(16 * 1024 * 1024 * scale);
+        vector<float> floats(count), back(count);
+        for (size_t i = 0; i < count; ++i)
+            floats[i] = (float)((i % 20011) * 0.05 - 500);
+        vector<convert::half> halves(count);
+        vector<double> doubles(count);
+        auto bytes = count * sizeof(float);
+        printf("float16_convert: %zu values, F16C %s\n", count, convert::has_f16c() ? "used" : "not available");
+
+        auto report = [&](const char* label, const function<void()>& f) {
+            printf("  %-30s %8.1f MB/s\n", label, mb_per_s(bytes, best_ms(f)));
+        };
+        report("float_to_half scalar", [&]() { for (size_t i = 0; i < count; ++i) halves[i] = convert::to_half(floats[i]); });
+        report("half_to_float scalar", [&]() { for (size_t i = 0; i < count; ++i) back[i] = convert::to_float(halves[i]); });
+        report("float_to_half, 1 thread", [&]() { convert::float_to_half(floats.data(), halves.data(), count, 1); });
+        report("half_to_float, 1 thread", [&]() { convert::half_to_float(halves.data(), back.data(), count, 1); });
+        report("float_to_half, every core", [&]() { convert::float_to_half(floats.data(), halves.data(), count); });
+        report("half_to_float, every core", [&]() { convert::half_to_float(halves.data(), back.data(), count); });
+        report("float_to_double, every core", [&]() { convert::float_to_double(floats.data(), doubles.data(), count); });
+        report("double_to_float, every core", [&]() { convert::double_to_float(doubles.data(), back.data(), count); });
+        sink = sink + back[count / 2];
+    }
+
+    /// Time of Scene::ReadFile with an increasing number of threads, on a VIM whose entity tables and geometry are compressed
+    inline void scene_load(double scale)
+    {
+        const size_t num_tables = 200, num_entities = (size_t)(10000 * scale);
+        vector<vector<bfast::byte>> tables(num_tables);
+        for (size_t t = 0; t < num_tables; ++t) {
+            vector<Vim::SerializableProperty> properties;
+            vector<int> parents(num_entities), names(num_entities);
+            vector<double> areas(num_entities);
+            for (size_t e = 0; e < num_entities; ++e) {
+                parents[e] = (int)(e / 4);
+                names[e] = (int)(e % 1000);
+                areas[e] = e * 0.5;
+                for (int p = 0; p < 3; ++p)
+                    properties.push_back(Vim::SerializableProperty{ (int)e, p, (int)(e % 50) });
+            }
+            bfast::Bfast table;
+            table.add("properties", (bfast::byte*)properties.data(), (bfast::byte*)(properties.data() + properties.size()));
+            table.add("index:Parent", (bfast::byte*)parents.data(), (bfast::byte*)(parents.data() + parents.size()));
+            table.add("string:Name", (bfast::byte*)names.data(), (bfast::byte*)(names.data() + names.size()));
+            table.add("numeric:Area", (bfast::byte*)areas.data(), (bfast::byte*)(areas.data() + areas.size()));
+            table.compress(bfast::codec_lz4, 4096, 1);
+            tables[t] = table.pack();
+        }
+        bfast::Bfast entities;
+        vector<string> table_names(num_tables);
+        for (size_t t = 0; t < num_tables; ++t) {
+            table_names[t] = "Vim.Table" + to_string(t);
+            entities.add(table_names[t], tables[t].data(), tables[t].data() + tables[t].size());
+        }
+        auto packed_entities = entities.pack();
+
+        Grid grid((size_t)(16 * scale), 256);
+        g3d::WriteOptions options;
+        options.codec = bfast::codec_lz4;
+        grid.g3d().write_file("bench_scene.g3d", options);
+        auto geometry = bfast::Bfast::read_file("bench_scene.g3d");
+
+        const char strings[] = "\0Name\0Area\0Parent";
+        string header = "vim=1.0.0\n";
+        bfast::Bfast vim;
+        vim.add("header", header.c_str());
+        vim.add("entities", packed_entities.data(), packed_entities.data() + packed_entities.size());
+        vim.add("strings", (bfast::byte*)strings, (bfast::byte*)strings + sizeof(strings));
+        vim.add("geometry", (bfast::byte*)geometry.data.begin(), (bfast::byte*)geometry.data.end());
+        vim.write_file("bench_scene.vim");
+        printf("scene_load: %zu entity tables of %zu entities, %zu vertices\n", num_tables, num_entities, grid.positions.size() / 3);
+
+        auto cores = parallel::resolve_thread_count(0);
+        double single = 0;
+        for (unsigned threads = 1; ; threads = min(threads * 2, cores)) {
+            Vim::SceneLoadOptions load;
+            load.mThreadCount = threads;
+            auto ms = best_ms([&]() {
+                Vim::Scene scene;
+                if (scene.ReadFile("bench_scene.vim", load) != Vim::VimErrorCodes::Success)
+                    throw runtime_error("The scene could not be read");
+                sink = sink + scene.mEntityTables.size();
+            });
+            if (threads == 1)
+                single = ms;
+            printf("  %3u threads %8.2f ms, %5.2fx\n", threads, ms, single / ms);
+            if (threads == cores)
+                break;
+        }
+        remove("bench_scene.g3d");
+        remove("bench_scene.vim");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace bench;
+    string only = argc > 1 ? argv[1] : "";
+    auto scale = argc > 2 ? atof(argv[2]) : 1.0;
+    if (scale <= 0)
+        scale = 1.0;
+
+    const pair<const char*, void(*)(double)> benchmarks[] = {
+        { "mmap_load", mmap_load },
+        { "scene_load", scene_load },
+        { "descriptor_parse", descriptor_parse },
+        { "geometry_filters", geometry_filters },
+        { "float16_convert", float16_convert },
+    };
+    for (const auto& b : benchmarks)
+        if (only.empty() || only == b.first)
+            b.second(scale);
+    return 0;
+}
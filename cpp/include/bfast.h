@@ -17,6 +17,30 @@
 #include <algorithm>
 #include <iterator>
 #include <stdexcept>
+#include <memory>
+#include <cstring>
+#include <unordered_map>
+
+#include "parallel.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+#endif
 
 namespace bfast
 {
@@ -56,6 +80,16 @@ namespace bfast
         return r;
     }
 
+    // Computes the 64-bit FNV-1a hash of a name, used to index buffers by name without allocating 
+    inline ulong hash_name(const char* name, size_t length) {
+        ulong h = 14695981039346656037ull;
+        for (size_t i = 0; i < length; ++i) {
+            h ^= (byte)name[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
     // The array offset indicates where in the raw byte array (offset from beginning of BFAST byte stream) that a particular array's data can be found. 
     struct alignas(8) ArrayOffset {
         ulong _begin;
@@ -85,6 +119,9 @@ namespace bfast
     {
         string name;
         ByteRange data;
+
+        // Keeps the bytes of "data" alive, shared by every copy of the buffer. Null when they are owned by the caller.
+        shared_ptr<const void> owner;
     };
 
     // The Bfast container implementation is a container of date ranges: the first one contains the names 
@@ -95,23 +132,35 @@ namespace bfast
 
         // Computes where the data offsets are relative to the beginning of the BFAST byte stream.
         vector<ArrayOffset> compute_offsets() {
-            size_t n = compute_data_start();
-            vector<ArrayOffset> r(ranges.size());
-            for (auto i = 0; i < ranges.size(); i++)
+            vector<size_t> sizes(ranges.size());
+            for (size_t i = 0; i < ranges.size(); ++i)
+                sizes[i] = ranges[i].size();
+            return compute_offsets(sizes);
+        }
+
+        // Computes the data offsets of arrays of the given sizes, so a BFAST can be laid out before its data exists
+        static vector<ArrayOffset> compute_offsets(const vector<size_t>& sizes) {
+            size_t n = compute_data_start(sizes.size());
+            vector<ArrayOffset> r(sizes.size());
+            for (size_t i = 0; i < sizes.size(); i++)
             {
-                auto& range = ranges[i];
                 assert(is_aligned(n));
-                r[i] = { n, n += range.size() };
-                n = aligned_value(n);
+                r[i]._begin = n;
+                r[i]._end = n + sizes[i];
+                n = aligned_value(r[i]._end);
             }
             return r;
         }
 
         // Computes where the first array data starts 
         size_t compute_data_start() {
+            return compute_data_start(ranges.size());
+        }
+
+        static size_t compute_data_start(size_t num_arrays) {
             size_t r = 0;
             r += header_size;
-            r += array_offset_size * ranges.size();
+            r += array_offset_size * num_arrays;
             r = aligned_value(r);
             return r;
         }
@@ -197,9 +246,125 @@ namespace bfast
             return r;
         }
 
+        // Computes the bytes that precede the first array: the header, the array offsets and the padding 
+        static vector<byte> pack_header(const vector<ArrayOffset>& offsets) {
+            vector<byte> r(compute_data_start(offsets.size()));
+            Header h;
+            h.magic = MAGIC;
+            h.num_arrays = offsets.size();
+            h.data_start = offsets.empty() ? 0 : offsets.front()._begin;
+            h.data_end = offsets.empty() ? 0 : offsets.back()._end;
+            memcpy(r.data(), &h, sizeof(Header));
+            if (!offsets.empty())
+                memcpy(r.data() + array_offsets_start, offsets.data(), offsets.size() * sizeof(ArrayOffset));
+            return r;
+        }
+
+        // Returns the number of padding bytes written after the given array 
+        static size_t padding_after(const ArrayOffset& offset) {
+            return aligned_value(offset._end) - offset._end;
+        }
+
+        // Writes the BFAST byte stream to an output stream one array at a time, without materializing it in memory.
+        void write(ostream& out) {
+            static const byte zeros[alignment] = {};
+            auto offsets = compute_offsets();
+            auto header = pack_header(offsets);
+            out.write((const char*)header.data(), header.size());
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                out.write((const char*)ranges[i].begin(), ranges[i].size());
+                out.write((const char*)zeros, padding_after(offsets[i]));
+            }
+            if (!out)
+                throw std::runtime_error("Failed to write BFast data");
+        }
+
+        // Writes the BFAST byte stream to a file. The arrays are handed directly to the operating system, 
+        // using vectored writes where available, so they are never copied.
+        void write_file(const string& file) {
+            static const byte zeros[alignment] = {};
+            auto offsets = compute_offsets();
+            auto header = pack_header(offsets);
+#ifdef _WIN32
+            auto handle = CreateFileA(file.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Failed to open file");
+            auto ok = write_all(handle, header.data(), header.size());
+            for (size_t i = 0; ok && i < ranges.size(); ++i)
+                ok = write_all(handle, ranges[i].begin(), ranges[i].size())
+                    && write_all(handle, zeros, padding_after(offsets[i]));
+            CloseHandle(handle);
+            if (!ok)
+                throw std::runtime_error("Failed to write file");
+#else
+            vector<iovec> iov;
+            iov.reserve(1 + ranges.size() * 2);
+            iov.push_back(iovec{ header.data(), header.size() });
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                if (ranges[i].size() > 0)
+                    iov.push_back(iovec{ (void*)ranges[i].begin(), ranges[i].size() });
+                auto padding = padding_after(offsets[i]);
+                if (padding > 0)
+                    iov.push_back(iovec{ (void*)zeros, padding });
+            }
+
+            auto fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw std::runtime_error("Failed to open file");
+            auto ok = write_all(fd, iov);
+            if (::close(fd) != 0)
+                ok = false;
+            if (!ok)
+                throw std::runtime_error("Failed to write file");
+#endif
+        }
+
+#ifdef _WIN32
+        // Writes all of the bytes, splitting them into chunks that WriteFile can handle.
+        static bool write_all(HANDLE handle, const byte* data, size_t size) {
+            while (size > 0) {
+                auto chunk = (DWORD)min(size, (size_t)1 << 30);
+                DWORD written = 0;
+                if (!WriteFile(handle, data, chunk, &written, nullptr) || written == 0)
+                    return false;
+                data += written;
+                size -= written;
+            }
+            return true;
+        }
+#else
+        // Writes all of the io vectors, resuming after partial writes.
+        static bool write_all(int fd, vector<iovec>& iov) {
+#ifdef IOV_MAX
+            const size_t max_iov = IOV_MAX;
+#else
+            const size_t max_iov = 1024;
+#endif
+            size_t i = 0;
+            while (i < iov.size()) {
+                auto n = ::writev(fd, &iov[i], (int)min(iov.size() - i, max_iov));
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                auto written = (size_t)n;
+                while (i < iov.size() && written >= iov[i].iov_len)
+                    written -= iov[i++].iov_len;
+                if (written > 0) {
+                    iov[i].iov_base = (byte*)iov[i].iov_base + written;
+                    iov[i].iov_len -= written;
+                }
+            }
+            return true;
+        }
+#endif
+
         // Unpacks a vector of bytes into a 
         static RawData unpack(const ByteRange& data)
         {
+            if (data.size() < header_size)
+                throw std::runtime_error("data is too small to contain a BFast header");
             const auto& h = *(Header*)data.begin();
             if (h.magic != MAGIC)
                 throw std::runtime_error("invalid magic number, either not a BFast, or was created on a machine with different endianess");
@@ -229,31 +394,528 @@ namespace bfast
     };
 
 
+    // The codecs a buffer can be compressed with 
+    enum Codec
+    {
+        codec_none = 0,
+        codec_lz4 = 1,
+    };
+
+    // A compressed buffer keeps its name followed by this suffix, so readers that do not know about compression ignore it rather than misread it 
+    static const char* const compressed_suffix = "#lz4";
+
+    // Buffers are compressed in independent chunks of this many bytes so they can be decoded in parallel 
+    static const size_t default_chunk_size = 1 << 20;
+
+    // The start of a compressed buffer. It is followed by the compressed size of each chunk, then the chunks. 
+    // A chunk whose compressed size equals its raw size is stored as is. 
+    struct alignas(8) CompressedHeader {
+        ulong codec;         // The codec in the low byte, the filters in the second byte and the filtered element size in the third
+
+        ulong raw_size;
+        ulong chunk_size;
+        ulong num_chunks;
+    };
+
+    // A self-contained implementation of the LZ4 block format, so that compression needs no external library 
+    struct Lz4
+    {
+        static const size_t min_match = 4;
+        static const size_t last_literals = 5;
+        static const size_t match_limit = 12;
+        static const size_t max_offset = 65535;
+        static const int hash_bits = 16;
+
+        // The largest compressed size for n input bytes 
+        static size_t compress_bound(size_t n) {
+            return n + n / 255 + 16;
+        }
+
+        static uint32_t read32(const byte* p) {
+            uint32_t r;
+            memcpy(&r, p, sizeof(r));
+            return r;
+        }
+
+        static uint32_t hash(uint32_t sequence) {
+            return (sequence * 2654435761u) >> (32 - hash_bits);
+        }
+
+        // Writes a length that did not fit in a token nibble 
+        static bool write_length(size_t length, byte*& out, const byte* out_end) {
+            while (length >= 255) {
+                if (out >= out_end) return false;
+                *out++ = 255;
+                length -= 255;
+            }
+            if (out >= out_end) return false;
+            *out++ = (byte)length;
+            return true;
+        }
+
+        // Writes the literals and the match of one sequence, the match is omitted for the final sequence 
+        static bool write_sequence(const byte* literals, size_t num_literals, size_t offset, size_t match_length, byte*& out, const byte* out_end) {
+            if (out >= out_end) return false;
+            auto token = out++;
+            *token = (byte)(min(num_literals, (size_t)15) << 4);
+            if (num_literals >= 15 && !write_length(num_literals - 15, out, out_end)) return false;
+            if ((size_t)(out_end - out) < num_literals) return false;
+            memcpy(out, literals, num_literals);
+            out += num_literals;
+            if (match_length == 0)
+                return true;
+            if (out_end - out < 2) return false;
+            *out++ = (byte)offset;
+            *out++ = (byte)(offset >> 8);
+            auto length = match_length - min_match;
+            *token |= (byte)min(length, (size_t)15);
+            return length < 15 || write_length(length - 15, out, out_end);
+        }
+
+        // Compresses n bytes, returning the compressed size or 0 if it does not fit in capacity bytes 
+        static size_t compress(const byte* src, size_t n, byte* dst, size_t capacity) {
+            auto out = dst;
+            auto out_end = dst + capacity;
+            size_t anchor = 0;
+            if (n > match_limit) {
+                vector<uint32_t> table((size_t)1 << hash_bits, 0);
+                auto limit = n - match_limit;
+                size_t ip = 1;
+                while (ip < limit) {
+                    auto sequence = read32(src + ip);
+                    auto h = hash(sequence);
+                    size_t candidate = table[h];
+                    table[h] = (uint32_t)ip;
+                    if (ip - candidate > max_offset || read32(src + candidate) != sequence) {
+                        // Skip faster through data that does not compress 
+                        ip += 1 + ((ip - anchor) >> 6);
+                        continue;
+                    }
+                    auto length = min_match;
+                    while (ip + length < n - last_literals && src[candidate + length] == src[ip + length])
+                        length++;
+                    if (!write_sequence(src + anchor, ip - anchor, ip - candidate, length, out, out_end))
+                        return 0;
+                    ip += length;
+                    anchor = ip;
+                }
+            }
+            if (!write_sequence(src + anchor, n - anchor, 0, 0, out, out_end))
+                return 0;
+            return out - dst;
+        }
+
+        // Decompresses exactly raw_size bytes, returning false if the input is malformed 
+        static bool decompress(const byte* src, size_t n, byte* dst, size_t raw_size) {
+            auto in = src;
+            auto in_end = src + n;
+            auto out = dst;
+            auto out_end = dst + raw_size;
+            while (in < in_end) {
+                auto token = *in++;
+                size_t num_literals = token >> 4;
+                if (num_literals == 15) {
+                    byte b;
+                    do {
+                        if (in >= in_end) return false;
+                        b = *in++;
+                        num_literals += b;
+                    } while (b == 255);
+                }
+                if ((size_t)(in_end - in) < num_literals || (size_t)(out_end - out) < num_literals) return false;
+                memcpy(out, in, num_literals);
+                in += num_literals;
+                out += num_literals;
+                if (in == in_end)
+                    break;
+
+                if (in_end - in < 2) return false;
+                size_t offset = in[0] | ((size_t)in[1] << 8);
+                in += 2;
+                size_t length = (token & 15);
+                if (length == 15) {
+                    byte b;
+                    do {
+                        if (in >= in_end) return false;
+                        b = *in++;
+                        length += b;
+                    } while (b == 255);
+                }
+                length += min_match;
+                if (offset == 0 || offset > (size_t)(out - dst) || (size_t)(out_end - out) < length) return false;
+                auto match = out - offset;
+                // The match may overlap the output, so it is copied forwards one byte at a time 
+                for (size_t i = 0; i < length; ++i)
+                    out[i] = match[i];
+                out += length;
+            }
+            return out == out_end;
+        }
+    };
+
+    // Reversible filters applied to each chunk before it is compressed. They rearrange structured data so that it compresses better. 
+    enum Filter
+    {
+        filter_none = 0,
+
+        // Groups the n-th byte of every element together, e.g. all the exponents of a float array 
+        filter_shuffle = 1,
+
+        // Replaces each 32-bit integer by the zigzag encoded difference with the previous one, which turns index and offset arrays into small numbers 
+        filter_delta = 2,
+    };
+
+    // Filtering functions used by compress_buffer() and decompress_buffer(). Each works on one chunk. 
+    struct Filters
+    {
+        // Transposes n bytes of elements of the given size into planes of bytes. Trailing bytes that do not form a whole element are copied as is. 
+        static void shuffle(const byte* src, size_t n, size_t element_size, byte* dst) {
+            auto count = n / element_size;
+            for (size_t b = 0; b < element_size; ++b)
+                for (size_t i = 0; i < count; ++i)
+                    dst[b * count + i] = src[i * element_size + b];
+            memcpy(dst + count * element_size, src + count * element_size, n - count * element_size);
+        }
+
+        // The inverse of shuffle 
+        static void unshuffle(const byte* src, size_t n, size_t element_size, byte* dst) {
+            auto count = n / element_size;
+            size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+            if (element_size == 4) {
+                // Interleave 16 elements at a time from the four byte planes 
+                for (; i + 16 <= count; i += 16) {
+                    auto p0 = _mm_loadu_si128((const __m128i*)(src + i));
+                    auto p1 = _mm_loadu_si128((const __m128i*)(src + count + i));
+                    auto p2 = _mm_loadu_si128((const __m128i*)(src + 2 * count + i));
+                    auto p3 = _mm_loadu_si128((const __m128i*)(src + 3 * count + i));
+                    auto lo01 = _mm_unpacklo_epi8(p0, p1);
+                    auto hi01 = _mm_unpackhi_epi8(p0, p1);
+                    auto lo23 = _mm_unpacklo_epi8(p2, p3);
+                    auto hi23 = _mm_unpackhi_epi8(p2, p3);
+                    auto out = (__m128i*)(dst + i * 4);
+                    _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(lo01, lo23));
+                    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo01, lo23));
+                    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi01, hi23));
+                    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi01, hi23));
+                }
+            }
+#endif
+            for (; i < count; ++i)
+                for (size_t b = 0; b < element_size; ++b)
+                    dst[i * element_size + b] = src[b * count + i];
+            memcpy(dst + count * element_size, src + count * element_size, n - count * element_size);
+        }
+
+        // Replaces 32-bit integers with the zigzag encoded difference from the previous value, in place 
+        static void delta_encode(byte* data, size_t n) {
+            uint32_t previous = 0;
+            for (size_t i = 0; i + 4 <= n; i += 4) {
+                uint32_t value;
+                memcpy(&value, data + i, 4);
+                auto delta = (int32_t)(value - previous);
+                auto zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+                memcpy(data + i, &zigzag, 4);
+                previous = value;
+            }
+        }
+
+        // The inverse of delta_encode 
+        static void delta_decode(byte* data, size_t n) {
+            uint32_t previous = 0;
+            for (size_t i = 0; i + 4 <= n; i += 4) {
+                uint32_t zigzag;
+                memcpy(&zigzag, data + i, 4);
+                auto delta = (zigzag >> 1) ^ (0u - (zigzag & 1));
+                previous += delta;
+                memcpy(data + i, &previous, 4);
+            }
+        }
+
+        // Applies the filters to a chunk, using scratch memory of the same size 
+        static void encode(byte* data, size_t n, ulong filters, size_t element_size, vector<byte>& scratch) {
+            if (filters & filter_delta)
+                delta_encode(data, n);
+            if ((filters & filter_shuffle) && element_size > 1) {
+                scratch.resize(n);
+                shuffle(data, n, element_size, scratch.data());
+                memcpy(data, scratch.data(), n);
+            }
+        }
+
+        // Reverts the filters of a chunk, using scratch memory of the same size 
+        static void decode(byte* data, size_t n, ulong filters, size_t element_size, vector<byte>& scratch) {
+            if ((filters & filter_shuffle) && element_size > 1) {
+                scratch.resize(n);
+                unshuffle(data, n, element_size, scratch.data());
+                memcpy(data, scratch.data(), n);
+            }
+            if (filters & filter_delta)
+                delta_decode(data, n);
+        }
+    };
+
+    // Returns true if the buffer data starts with a valid compressed header 
+    inline bool is_compressed(const ByteRange& data) {
+        if (data.size() < sizeof(CompressedHeader)) return false;
+        CompressedHeader h;
+        memcpy(&h, data.begin(), sizeof(h));
+        return (h.codec & 0xFF) == codec_lz4 && h.chunk_size > 0
+            && h.num_chunks == (h.raw_size + h.chunk_size - 1) / h.chunk_size
+            && data.size() >= sizeof(CompressedHeader) + h.num_chunks * sizeof(ulong);
+    }
+
+    // Compresses a buffer into independently decodable chunks, compressing the chunks in parallel. 
+    // The filters are applied to each chunk first, the element size is the size of the values they operate on. 
+    inline vector<byte> compress_buffer(const ByteRange& data, Codec codec = codec_lz4, size_t chunk_size = default_chunk_size, unsigned thread_count = 0, ulong filters = filter_none, size_t element_size = 1) {
+        if (codec != codec_lz4)
+            throw std::runtime_error("Unsupported codec");
+        if (element_size == 0 || element_size > 255 || chunk_size % element_size != 0)
+            filters = filter_none;
+        if (element_size != 4)
+            filters &= ~(ulong)filter_delta;
+        CompressedHeader h;
+        h.codec = codec | (filters << 8) | ((ulong)element_size << 16);
+        h.raw_size = data.size();
+        h.chunk_size = chunk_size;
+        h.num_chunks = (data.size() + chunk_size - 1) / chunk_size;
+
+        vector<vector<byte>> chunks(h.num_chunks);
+        parallel::for_each(chunks.size(), [&](size_t c) {
+            auto begin = data.begin() + c * chunk_size;
+            auto size = min(chunk_size, (size_t)(data.end() - begin));
+            vector<byte> filtered;
+            if (filters != filter_none) {
+                vector<byte> scratch;
+                filtered.assign(begin, begin + size);
+                Filters::encode(filtered.data(), size, filters, element_size, scratch);
+                begin = filtered.data();
+            }
+            chunks[c].resize(Lz4::compress_bound(size));
+            auto n = Lz4::compress(begin, size, chunks[c].data(), size - 1);
+            if (n == 0)
+                chunks[c].assign(begin, begin + size);
+            else
+                chunks[c].resize(n);
+        }, thread_count);
+
+        size_t total = sizeof(CompressedHeader) + chunks.size() * sizeof(ulong);
+        for (const auto& chunk : chunks)
+            total += chunk.size();
+        vector<byte> r(total);
+        memcpy(r.data(), &h, sizeof(h));
+        auto sizes = r.data() + sizeof(CompressedHeader);
+        auto out = sizes + chunks.size() * sizeof(ulong);
+        for (size_t c = 0; c < chunks.size(); ++c) {
+            ulong size = chunks[c].size();
+            memcpy(sizes + c * sizeof(ulong), &size, sizeof(ulong));
+            if (!chunks[c].empty())
+                memcpy(out, chunks[c].data(), chunks[c].size());
+            out += chunks[c].size();
+        }
+        return r;
+    }
+
+    // Returns the size of a compressed buffer once decompressed 
+    inline size_t decompressed_size(const ByteRange& data) {
+        if (!is_compressed(data))
+            throw std::runtime_error("The buffer is not compressed");
+        CompressedHeader h;
+        memcpy(&h, data.begin(), sizeof(h));
+        return h.raw_size;
+    }
+
+    // Decompresses a buffer into dst, which must hold decompressed_size() bytes, decoding the chunks in parallel 
+    inline void decompress_buffer(const ByteRange& data, byte* dst, unsigned thread_count = 0) {
+        if (!is_compressed(data))
+            throw std::runtime_error("The buffer is not compressed");
+        CompressedHeader h;
+        memcpy(&h, data.begin(), sizeof(h));
+        auto filters = (h.codec >> 8) & 0xFF;
+        auto element_size = (size_t)((h.codec >> 16) & 0xFF);
+        auto sizes = data.begin() + sizeof(CompressedHeader);
+
+        // Find where each chunk starts 
+        vector<size_t> starts(h.num_chunks + 1);
+        starts[0] = sizeof(CompressedHeader) + h.num_chunks * sizeof(ulong);
+        for (size_t c = 0; c < h.num_chunks; ++c) {
+            ulong size;
+            memcpy(&size, sizes + c * sizeof(ulong), sizeof(ulong));
+            starts[c + 1] = starts[c] + size;
+            if (starts[c + 1] > data.size() || starts[c + 1] < starts[c])
+                throw std::runtime_error("Compressed chunk is after the end of the data");
+        }
+
+        parallel::for_each(h.num_chunks, [&](size_t c) {
+            auto raw = min((size_t)h.chunk_size, (size_t)h.raw_size - c * h.chunk_size);
+            auto src = data.begin() + starts[c];
+            auto size = starts[c + 1] - starts[c];
+            auto out = dst + c * h.chunk_size;
+            if (size == raw)
+                memcpy(out, src, raw);
+            else if (!Lz4::decompress(src, size, out, raw))
+                throw std::runtime_error("Corrupt compressed data");
+            if (filters != filter_none) {
+                vector<byte> scratch;
+                Filters::decode(out, raw, filters, element_size, scratch);
+            }
+        }, thread_count);
+    }
+
+    // A read-only mapping of an entire file into the address space of the process. 
+    // Pages are only loaded from disk when they are first touched, so opening a large file costs nothing up front.
+    class MappedFile
+    {
+    public:
+        MappedFile(const string& file)
+        {
+#ifdef _WIN32
+            auto handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Couldn't open file");
+            LARGE_INTEGER filesize;
+            if (!GetFileSizeEx(handle, &filesize) || filesize.QuadPart == 0)
+            {
+                CloseHandle(handle);
+                throw std::runtime_error("Couldn't map an empty file");
+            }
+            auto mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            CloseHandle(handle);
+            if (mapping == nullptr)
+                throw std::runtime_error("Couldn't create file mapping");
+            auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (view == nullptr)
+                throw std::runtime_error("Couldn't map view of file");
+            _data = (const byte*)view;
+            _size = (size_t)filesize.QuadPart;
+#else
+            auto fd = ::open(file.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("Couldn't open file");
+            struct stat st;
+            if (::fstat(fd, &st) != 0 || st.st_size == 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Couldn't map an empty file");
+            }
+            auto view = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (view == MAP_FAILED)
+                throw std::runtime_error("Couldn't map file");
+            _data = (const byte*)view;
+            _size = (size_t)st.st_size;
+#endif
+        }
+
+        ~MappedFile()
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(_data);
+#else
+            ::munmap((void*)_data, _size);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const byte* data() const { return _data; }
+        size_t size() const { return _size; }
+        ByteRange range() const { return ByteRange{ _data, _data + _size }; }
+
+    private:
+        const byte* _data = nullptr;
+        size_t _size = 0;
+    };
+
     // A Bfast conceptually is a collection of buffers: named byte arrays. 
     // It contains the raw data contained within.
     struct Bfast
     {
         vector<byte> name_data;
         ByteRange data;
-        vector<byte> dataBuffer;
         vector<Buffer> buffers;
 
+        // Keeps "data" alive: the file contents, its memory mapping, or the buffer of an enclosing Bfast. 
+        // The bytes are never modified, so copies of a Bfast share them instead of copying them.
+        shared_ptr<const void> storage;
+
+        // Maps the hash of each buffer name to the buffer index. It is kept up to date by unpack() and add().
+        unordered_multimap<ulong, size_t> name_index;
+
+        // False once "buffers" was modified directly and the name index no longer matches it 
+        bool index_valid = true;
+
+        // Rebuilds the name index, needed after modifying "buffers" directly
+        void build_index() {
+            name_index.clear();
+            name_index.reserve(buffers.size());
+            for (size_t i = 0; i < buffers.size(); ++i)
+                name_index.emplace(hash_name(buffers[i].name.data(), buffers[i].name.size()), i);
+            index_valid = true;
+        }
+
+        // Marks the name index as out of date after modifying "buffers" directly: lookups scan the buffers until the index is rebuilt
+        void invalidate_index() {
+            index_valid = false;
+        }
+
+        // True if lookups can use the name index. A change in the number of buffers is also detected. 
+        bool is_index_valid() const {
+            return index_valid && name_index.size() == buffers.size();
+        }
+
+        // Returns the index of the first buffer with the given name, or -1 if there is none 
+        int index_of(const char* name, size_t length) const {
+            int r = -1;
+            if (is_index_valid()) {
+                auto range = name_index.equal_range(hash_name(name, length));
+                for (auto it = range.first; it != range.second; ++it) {
+                    const auto& n = buffers[it->second].name;
+                    if ((r < 0 || (int)it->second < r) && n.size() == length && memcmp(n.data(), name, length) == 0)
+                        r = (int)it->second;
+                }
+                return r;
+            }
+            // The buffers were modified without updating the index 
+            for (size_t i = 0; i < buffers.size(); ++i)
+                if (buffers[i].name.size() == length && memcmp(buffers[i].name.data(), name, length) == 0)
+                    return (int)i;
+            return r;
+        }
+
+        int index_of(const string& name) const {
+            return index_of(name.data(), name.size());
+        }
+
+        int index_of(const char* name) const {
+            return index_of(name, strlen(name));
+        }
+
+        // Returns the first buffer with the given name, or nullptr if there is none 
+        const Buffer* find(const string& name) const {
+            auto i = index_of(name);
+            return i < 0 ? nullptr : &buffers[i];
+        }
+
+        const Buffer* find(const char* name) const {
+            auto i = index_of(name);
+            return i < 0 ? nullptr : &buffers[i];
+        }
+
         // Construct a raw BFast data block, using the names string argument to store the names data. 
         RawData to_raw_data() {
             // Compute the name data
             name_data.clear();
 
             size_t count = 0;
-            for (auto b : buffers)
-            {
-                for (auto c : b.name)
-                    count++;
-                count++;
-            }
+            for (const auto& b : buffers)
+                count += b.name.size() + 1;
 
             name_data.resize(count);
             count = 0;
-            for (auto b : buffers)
+            for (const auto& b : buffers)
             {
                 for (auto c : b.name)
                     name_data[count++] = c;
@@ -264,7 +926,7 @@ namespace bfast
             size_t index = 0;
             r.ranges.resize(1 + buffers.size());
             r.ranges[index++] = ByteRange{ name_data.data(), name_data.data() + name_data.size() };
-            for (auto b : buffers)
+            for (const auto& b : buffers)
                 r.ranges[index++] = b.data;
             return r;
         }
@@ -274,10 +936,18 @@ namespace bfast
             return to_raw_data().pack();
         }
 
-        // Adds a buffer with the given name and data
-        Bfast& add(const string& name, byte* begin, byte* end)
+        // Adds a buffer with the given name and data. The data must outlive the Bfast unless an owner keeping it alive is given.
+        // A name ending with the compressed suffix is only accepted for compressed data, since readers would try to decompress it.
+        Bfast& add(const string& name, byte* begin, byte* end, shared_ptr<const void> owner = nullptr)
         {
-            buffers.push_back(Buffer{ name, ByteRange { begin, end } });
+            if (is_compressed_name(name) && !is_compressed(ByteRange{ begin, end }))
+                throw std::runtime_error("Only compressed buffers can have a name ending with the compressed suffix");
+            auto indexed = is_index_valid();
+            buffers.push_back(Buffer{ name, ByteRange { begin, end }, move(owner) });
+            if (indexed)
+                name_index.emplace(hash_name(name.data(), name.size()), buffers.size() - 1);
+            else
+                build_index();
             return *this;
         }
 
@@ -314,8 +984,9 @@ namespace bfast
             return r;
         }
 
-        // Unpacks an array of buffers into a BFastData package
-        static Bfast unpack(const ByteRange& data)
+        // Unpacks an array of buffers into a BFastData package. The buffers point into data, which storage keeps alive. 
+        // Without storage the data must outlive the Bfast and everything unpacked from it.
+        static Bfast unpack(const ByteRange& data, shared_ptr<const void> storage = nullptr)
         {
             auto raw_data = RawData::unpack(data);
             auto names = split_names(raw_data.ranges[0]);
@@ -323,53 +994,99 @@ namespace bfast
                 throw std::runtime_error("The number of names does not match the raw data size");
             Bfast r;
             r.data = data;
+            r.storage = move(storage);
             r.buffers.resize(names.size());
             for (size_t i = 0; i < names.size(); ++i)
             {
-                r.buffers[i] = Buffer{ names[i], raw_data.ranges[i + 1] };
+                r.buffers[i] = Buffer{ names[i], raw_data.ranges[i + 1], r.storage };
             }
+            r.build_index();
             return r;
         }
 
+        // Unpacks a nested Bfast stored in a buffer, sharing the buffer's storage
+        static Bfast unpack(const Buffer& buffer)
+        {
+            return unpack(buffer.data, buffer.owner);
+        }
+
         static Bfast unpack(vector<byte>&& data)
         {
-            Bfast r;
-            r.dataBuffer = move(data);
-            r.data = ByteRange{ r.dataBuffer.data(), r.dataBuffer.data() + r.dataBuffer.size() };
-            auto raw_data = RawData::unpack(r.data);
-            auto names = split_names(raw_data.ranges[0]);
-            if (names.size() != raw_data.ranges.size() - 1)
-                throw std::runtime_error("The number of names does not match the raw data size");
-            r.buffers.resize(names.size());
-            for (size_t i = 0; i < names.size(); ++i)
-            {
-                r.buffers[i] = Buffer{ names[i], raw_data.ranges[i + 1] };
+            auto shared = make_shared<const vector<byte>>(move(data));
+            return unpack(ByteRange{ shared->data(), shared->data() + shared->size() }, shared);
+        }
+
+        // Returns true if the buffer name marks it as compressed 
+        static bool is_compressed_name(const string& name) {
+            auto n = strlen(compressed_suffix);
+            return name.size() > n && name.compare(name.size() - n, n, compressed_suffix) == 0;
+        }
+
+        // Compresses in place every buffer of at least min_size bytes that gets smaller when compressed, 
+        // appending the compressed suffix to its name. 
+        void compress(Codec codec = codec_lz4, size_t min_size = 4096, unsigned thread_count = 0) {
+            compress(codec, min_size, thread_count, [](const Buffer&, size_t&) { return (ulong)filter_none; });
+        }
+
+        // Compresses buffers like compress() above. choose_filters(buffer, element_size) returns the filters to apply to each buffer 
+        // and sets the size of the values they operate on. 
+        template<typename ChooseFilters>
+        void compress(Codec codec, size_t min_size, unsigned thread_count, ChooseFilters choose_filters) {
+            for (auto& b : buffers) {
+                if (b.data.size() < min_size || is_compressed_name(b.name))
+                    continue;
+                size_t element_size = 1;
+                ulong filters = choose_filters(b, element_size);
+                auto packed = make_shared<const vector<byte>>(compress_buffer(b.data, codec, default_chunk_size, thread_count, filters, element_size));
+                if (packed->size() >= b.data.size())
+                    continue;
+                b.name += compressed_suffix;
+                b.data = ByteRange{ packed->data(), packed->data() + packed->size() };
+                b.owner = move(packed);
             }
-            return r;
+            build_index();
         }
 
-#ifdef __ANDROID__
-		bool fopen_s(FILE** f, const char* name, const char* mode) 
-        {
-			assert(f);
-			*f = fopen(name, mode);
-            if (!*f) return false;
-			return true;
-		}
-#endif
+        // Decompresses in place every compressed buffer and restores its name. 
+        // Uncompressed buffers are left untouched, still pointing at the original data. 
+        void decompress(unsigned thread_count = 0) {
+            auto changed = false;
+            for (auto& b : buffers) {
+                if (!is_compressed_name(b.name))
+                    continue;
+                if (!is_compressed(b.data))
+                    throw std::runtime_error("Corrupt compressed data");
+                auto unpacked = make_shared<vector<byte>>(decompressed_size(b.data));
+                decompress_buffer(b.data, unpacked->data(), thread_count);
+                b.name.resize(b.name.size() - strlen(compressed_suffix));
+                b.data = ByteRange{ unpacked->data(), unpacked->data() + unpacked->size() };
+                b.owner = move(unpacked);
+                changed = true;
+            }
+            if (changed)
+                build_index();
+        }
 
+        // Writes the BFast to a file, streaming each buffer without packing the whole file in memory
         void write_file(string file) {
-            auto data = pack();
-            FILE* f = nullptr;
-            if (fopen_s(&f, file.c_str(), "wb") != 0)
-                throw std::runtime_error("Failed to open file");
-            if (f == nullptr)
-                return;
-            fwrite(&data[0], 1, data.size(), f);
-            fclose(f);
+            to_raw_data().write_file(file);
+        }
+
+        // Writes the BFast to an output stream, streaming each buffer without packing the whole file in memory
+        void write(ostream& out) {
+            to_raw_data().write(out);
+        }
+
+        // Maps the file into memory and unpacks it in place: buffers point directly into the mapping and no data is copied.
+        static Bfast map_file(string file) {
+            auto mapped = make_shared<const MappedFile>(file);
+            return Bfast::unpack(mapped->range(), mapped);
         }
 
-        static Bfast read_file(string file) {
+        static Bfast read_file(string file, bool memoryMapped = false) {
+            if (memoryMapped)
+                return map_file(file);
+
             std::ifstream fstrm(file, ios_base::in | ios_base::binary);
             fstrm.seekg(0, ios_base::end);
             auto filesize = fstrm.tellg();
@@ -387,6 +1104,444 @@ namespace bfast
             return Bfast::unpack(move(buffer));
         }
     };
+
+    // A heap allocated block of bytes whose start is aligned to the BFAST alignment 
+    class AlignedBuffer
+    {
+    public:
+        AlignedBuffer() = default;
+
+        explicit AlignedBuffer(size_t size)
+            : storage(new byte[size + alignment - 1])
+            , _size(size)
+        {
+            void* p = storage.get();
+            size_t space = size + alignment - 1;
+            _data = (byte*)std::align(alignment, size, p, space);
+            assert(_data != nullptr);
+        }
+
+        byte* data() { return _data; }
+        const byte* data() const { return _data; }
+        size_t size() const { return _size; }
+        ByteRange range() const { return ByteRange{ _data, _data + _size }; }
+
+    private:
+        unique_ptr<byte[]> storage;
+        byte* _data = nullptr;
+        size_t _size = 0;
+    };
+
+    // A file opened for reading at arbitrary positions (pread on POSIX, overlapped reads on Windows) 
+    class PositionalFile
+    {
+    public:
+        PositionalFile(const string& file)
+        {
+#ifdef _WIN32
+            handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+            if (handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Couldn't open file");
+            LARGE_INTEGER filesize;
+            if (!GetFileSizeEx(handle, &filesize))
+            {
+                CloseHandle(handle);
+                throw std::runtime_error("Couldn't read file size");
+            }
+            _size = (size_t)filesize.QuadPart;
+#else
+            fd = ::open(file.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("Couldn't open file");
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Couldn't read file size");
+            }
+            _size = (size_t)st.st_size;
+#endif
+        }
+
+        ~PositionalFile()
+        {
+#ifdef _WIN32
+            CloseHandle(handle);
+#else
+            ::close(fd);
+#endif
+        }
+
+        PositionalFile(const PositionalFile&) = delete;
+        PositionalFile& operator=(const PositionalFile&) = delete;
+
+        size_t size() const { return _size; }
+
+        // Reads exactly size bytes starting at the given position of the file
+        void read_at(void* dst, size_t size, ulong position) const
+        {
+            auto out = (byte*)dst;
+            while (size > 0)
+            {
+#ifdef _WIN32
+                OVERLAPPED overlapped = {};
+                overlapped.Offset = (DWORD)position;
+                overlapped.OffsetHigh = (DWORD)(position >> 32);
+                DWORD n = 0;
+                if (!ReadFile(handle, out, (DWORD)min(size, (size_t)1 << 30), &n, &overlapped) || n == 0)
+                    throw std::runtime_error("Failed to read file");
+#else
+                auto n = ::pread(fd, out, min(size, (size_t)1 << 30), (off_t)position);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    throw std::runtime_error("Failed to read file");
+#endif
+                out += n;
+                size -= (size_t)n;
+                position += (ulong)n;
+            }
+        }
+
+    private:
+        size_t _size = 0;
+#ifdef _WIN32
+        HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+        int fd = -1;
+#endif
+    };
+
+    // The result of a batched read: one range per requested buffer, pointing into the blocks that were read 
+    struct BufferBatch
+    {
+        vector<AlignedBuffer> blocks;
+        vector<ByteRange> ranges;
+    };
+
+    // Reads individual buffers of a BFAST file on demand. Only the header, the array offsets and the names 
+    // are read when the reader is created; each buffer is then fetched with a positional read. 
+    // Nested BFAST containers, such as the geometry of a VIM file, are opened in place with nested().
+    // Compressed buffers are listed under their name without the compressed suffix and are decompressed when they are read.
+    class BfastFileReader
+    {
+    public:
+        vector<string> names;
+        vector<ArrayOffset> offsets;
+
+        // True for the buffers stored compressed 
+        vector<bool> compressed;
+
+        BfastFileReader(const string& file)
+            : BfastFileReader(make_shared<const PositionalFile>(file), 0, to_end_of_file)
+        { }
+
+        // Returns the number of named buffers
+        size_t count() const { return names.size(); }
+
+        // Returns the index of the buffer with the given name, or -1 if there is none 
+        int find(const string& name) const {
+            for (size_t i = 0; i < names.size(); ++i)
+                if (names[i] == name)
+                    return (int)i;
+            return -1;
+        }
+
+        // Returns the size in bytes of the buffer at the given index, once decompressed 
+        size_t buffer_size(size_t index) const {
+            const auto& offset = offsets.at(index);
+            if (!compressed[index])
+                return offset._end - offset._begin;
+            if (offset._end - offset._begin < sizeof(CompressedHeader))
+                throw std::runtime_error("Corrupt compressed data");
+            CompressedHeader h;
+            file->read_at(&h, sizeof(h), base + offset._begin);
+            return (size_t)h.raw_size;
+        }
+
+        // Reads the buffer at the given index into caller supplied memory of at least buffer_size(index) bytes
+        void read(size_t index, void* dst) const {
+            const auto& offset = offsets.at(index);
+            if (!compressed[index]) {
+                file->read_at(dst, offset._end - offset._begin, base + offset._begin);
+                return;
+            }
+            AlignedBuffer packed(offset._end - offset._begin);
+            file->read_at(packed.data(), packed.size(), base + offset._begin);
+            decompress_into(packed.range(), (byte*)dst, buffer_size(index));
+        }
+
+        // Reads the buffer at the given index into newly allocated aligned memory 
+        AlignedBuffer read(size_t index) const {
+            AlignedBuffer r(buffer_size(index));
+            read(index, r.data());
+            return r;
+        }
+
+        // Reads the buffer with the given name into newly allocated aligned memory 
+        AlignedBuffer read(const string& name) const {
+            return read(index_of(name));
+        }
+
+        // Reads several buffers, merging buffers that are adjacent in the file (only separated by padding) into a single read.
+        BufferBatch read(const vector<size_t>& indices) const {
+            vector<size_t> order(indices.size());
+            for (size_t i = 0; i < order.size(); ++i)
+                order[i] = i;
+            sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return offsets.at(indices[a])._begin < offsets.at(indices[b])._begin;
+            });
+
+            BufferBatch r;
+            r.ranges.resize(indices.size());
+            size_t i = 0;
+            while (i < order.size())
+            {
+                // Extend the run while the next buffer starts within the padding of the current one
+                auto first = offsets.at(indices[order[i]]);
+                auto begin = first._begin;
+                auto end = first._end;
+                auto j = i + 1;
+                while (j < order.size() && offsets.at(indices[order[j]])._begin <= aligned_value(end))
+                    end = max(end, offsets.at(indices[order[j++]])._end);
+
+                AlignedBuffer block(end - begin);
+                file->read_at(block.data(), block.size(), base + begin);
+                for (auto k = i; k < j; ++k)
+                {
+                    const auto& offset = offsets.at(indices[order[k]]);
+                    auto p = block.data() + (offset._begin - begin);
+                    r.ranges[order[k]] = ByteRange{ p, p + (offset._end - offset._begin) };
+                }
+                r.blocks.push_back(move(block));
+                i = j;
+            }
+
+            // Compressed buffers are decompressed into blocks of their own 
+            for (size_t k = 0; k < indices.size(); ++k)
+            {
+                if (!compressed.at(indices[k]))
+                    continue;
+                const auto& packed = r.ranges[k];
+                if (!is_compressed(packed))
+                    throw std::runtime_error("Corrupt compressed data");
+                AlignedBuffer block(decompressed_size(packed));
+                decompress_into(packed, block.data(), block.size());
+                r.ranges[k] = block.range();
+                r.blocks.push_back(move(block));
+            }
+            return r;
+        }
+
+        // Reads several buffers by name 
+        BufferBatch read(const vector<string>& bufferNames) const {
+            vector<size_t> indices;
+            for (const auto& name : bufferNames)
+                indices.push_back(index_of(name));
+            return read(indices);
+        }
+
+        // Opens the BFAST container stored in the buffer at the given index, without reading it. 
+        // A compressed container has to be read and decompressed instead.
+        BfastFileReader nested(size_t index) const {
+            if (compressed.at(index))
+                throw std::runtime_error("A compressed container cannot be opened in place: " + names[index]);
+            const auto& offset = offsets.at(index);
+            return BfastFileReader(file, base + offset._begin, offset._end - offset._begin);
+        }
+
+        // Opens the BFAST container stored in the buffer with the given name, without reading it
+        BfastFileReader nested(const string& name) const {
+            return nested(index_of(name));
+        }
+
+    private:
+        shared_ptr<const PositionalFile> file;
+        ulong base = 0;
+
+        // The size of a container that extends to the end of the file 
+        static const ulong to_end_of_file = ~(ulong)0;
+
+        // Reads the header, array offsets and names of the container of the given size at the given position of the file. 
+        BfastFileReader(shared_ptr<const PositionalFile> source, ulong position, ulong size)
+            : file(move(source))
+            , base(position)
+        {
+            if (size == to_end_of_file)
+                size = file->size() - position;
+            if (size < header_size)
+                throw std::runtime_error("data is too small to contain a BFast header");
+
+            Header h;
+            file->read_at(&h, sizeof(Header), base);
+            if (h.magic != MAGIC)
+                throw std::runtime_error("invalid magic number, either not a BFast, or was created on a machine with different endianess");
+            if (h.data_end < h.data_start)
+                throw std::runtime_error("data ends before it starts");
+            if (h.num_arrays == 0)
+                throw std::runtime_error("The names buffer is missing");
+            if (array_offsets_start + h.num_arrays * array_offset_size > size)
+                throw std::runtime_error("Offset table is after the end of the data");
+
+            vector<ArrayOffset> all(h.num_arrays);
+            file->read_at(all.data(), all.size() * sizeof(ArrayOffset), base + array_offsets_start);
+            for (size_t i = 0; i < all.size(); ++i)
+            {
+                const auto& offset = all[i];
+                if (offset._begin > offset._end)
+                    throw std::runtime_error("Offset begin is after the offset end");
+                if (offset._end > size)
+                    throw std::runtime_error("Offset end is after the end of the data");
+                if (i > 0 && offset._begin < all[i - 1]._end)
+                    throw std::runtime_error("Offset begin is before the end of the previous offset");
+            }
+
+            vector<byte> name_data(all[0]._end - all[0]._begin);
+            file->read_at(name_data.data(), name_data.size(), base + all[0]._begin);
+            names = Bfast::split_names(ByteRange{ name_data.data(), name_data.data() + name_data.size() });
+            if (names.size() != all.size() - 1)
+                throw std::runtime_error("The number of names does not match the raw data size");
+            offsets.assign(all.begin() + 1, all.end());
+            compressed.resize(names.size());
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                compressed[i] = Bfast::is_compressed_name(names[i]);
+                if (compressed[i])
+                    names[i].resize(names[i].size() - strlen(compressed_suffix));
+            }
+        }
+
+        static void decompress_into(const ByteRange& packed, byte* dst, size_t size) {
+            if (!is_compressed(packed) || decompressed_size(packed) != size)
+                throw std::runtime_error("Corrupt compressed data");
+            decompress_buffer(packed, dst);
+        }
+
+        size_t index_of(const string& name) const {
+            auto i = find(name);
+            if (i < 0)
+                throw std::runtime_error("No buffer named " + name);
+            return (size_t)i;
+        }
+    };
+
+    // Writes a BFAST file incrementally, for when the buffer names are known up front but not their sizes. 
+    // The header and offset table are reserved when the file is opened, the buffers are appended in order 
+    // in chunks of any size, and the offsets are patched when the writer is closed. 
+    class BfastStreamWriter
+    {
+    public:
+        BfastStreamWriter(const string& file, const vector<string>& names)
+            : out(file, ios_base::out | ios_base::binary | ios_base::trunc)
+            , names(names)
+            , offsets(names.size() + 1)
+        {
+            // The buffers are written as they are, so none of them can be taken for a compressed buffer 
+            for (const auto& name : names)
+                if (Bfast::is_compressed_name(name))
+                    throw std::runtime_error("The names of streamed buffers cannot end with the compressed suffix");
+            if (!out.is_open())
+                throw std::runtime_error("Failed to open file");
+
+            // Reserve the header and the array offsets 
+            RawData layout;
+            layout.ranges.resize(offsets.size());
+            write_zeros(layout.compute_data_start());
+
+            // The first buffer contains the null terminated names 
+            open_buffer();
+            for (const auto& name : names)
+                append(name.c_str(), name.size() + 1);
+            close_buffer();
+        }
+
+        ~BfastStreamWriter() {
+            try {
+                close();
+            }
+            catch (std::exception&) {
+                // destructors must not throw, call close() explicitly to observe errors
+            }
+        }
+
+        BfastStreamWriter(const BfastStreamWriter&) = delete;
+        BfastStreamWriter& operator=(const BfastStreamWriter&) = delete;
+
+        // Starts the next buffer, which must have the next name passed to the constructor. 
+        void begin_buffer(const string& name) {
+            if (buffer_open)
+                close_buffer();
+            if (next >= offsets.size())
+                throw std::runtime_error("All buffers have already been written");
+            if (names[next - 1] != name)
+                throw std::runtime_error("Buffers must be written in the order of their names");
+            open_buffer();
+        }
+
+        // Appends a chunk of data to the current buffer 
+        void append(const void* data, size_t size) {
+            if (!buffer_open)
+                throw std::runtime_error("No buffer has been started");
+            out.write((const char*)data, size);
+            current += size;
+        }
+
+        // Finishes the last buffer, writes any remaining buffers as empty, then patches the header and offsets. 
+        void close() {
+            if (closed)
+                return;
+            closed = true;
+            if (buffer_open)
+                close_buffer();
+            while (next < offsets.size()) {
+                open_buffer();
+                close_buffer();
+            }
+
+            Header h;
+            h.magic = MAGIC;
+            h.num_arrays = offsets.size();
+            h.data_start = offsets.front()._begin;
+            h.data_end = offsets.back()._end;
+            out.seekp(0);
+            out.write((const char*)&h, sizeof(Header));
+            out.seekp(array_offsets_start);
+            out.write((const char*)offsets.data(), offsets.size() * sizeof(ArrayOffset));
+            out.close();
+            if (out.fail())
+                throw std::runtime_error("Failed to write file");
+        }
+
+    private:
+        void open_buffer() {
+            offsets[next]._begin = current;
+            buffer_open = true;
+        }
+
+        void close_buffer() {
+            offsets[next++]._end = current;
+            write_zeros(aligned_value(current) - current);
+            buffer_open = false;
+        }
+
+        void write_zeros(size_t n) {
+            static const byte zeros[alignment] = {};
+            while (n > 0) {
+                auto chunk = min(n, (size_t)alignment);
+                out.write((const char*)zeros, chunk);
+                current += chunk;
+                n -= chunk;
+            }
+        }
+
+        ofstream out;
+        vector<string> names;
+        vector<ArrayOffset> offsets;
+        size_t current = 0;
+        size_t next = 0;
+        bool buffer_open = false;
+        bool closed = false;
+    };
 }
 
 #endif
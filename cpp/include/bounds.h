@@ -0,0 +1,479 @@
+/*
+    Bounding boxes of G3D meshes, submeshes and instances, and a bounding volume hierarchy over them
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __BOUNDS_H__
+#define __BOUNDS_H__
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "g3d.h"
+#include "transforms.h"
+#include "parallel.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BOUNDS_SSE
+#endif
+
+namespace g3d
+{
+    using namespace std;
+
+    /// An axis aligned bounding box, laid out like the float32:6 bounds attributes: the minimum x, y and z followed by the maximum x, y and z.
+    /// An empty box has its minimum above its maximum.
+    struct AABB
+    {
+        float min[3];
+        float max[3];
+
+        static AABB empty() {
+            const auto big = numeric_limits<float>::max();
+            return AABB{ { big, big, big }, { -big, -big, -big } };
+        }
+
+        bool is_empty() const {
+            return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+        }
+
+        void add(const float* point) {
+            for (int c = 0; c < 3; ++c) {
+                min[c] = std::min(min[c], point[c]);
+                max[c] = std::max(max[c], point[c]);
+            }
+        }
+
+        void add(const AABB& box) {
+            for (int c = 0; c < 3; ++c) {
+                min[c] = std::min(min[c], box.min[c]);
+                max[c] = std::max(max[c], box.max[c]);
+            }
+        }
+
+        float center(int axis) const {
+            return (min[axis] + max[axis]) * 0.5f;
+        }
+
+        /// Half the surface area, used as the probability of a ray hitting the box
+        float half_area() const {
+            if (is_empty())
+                return 0;
+            auto x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+            return x * y + y * z + z * x;
+        }
+
+        /// The bounds of the box after transforming it (Arvo's method)
+        AABB transformed(const Matrix4x4& m) const {
+            if (is_empty())
+                return *this;
+            AABB r;
+            for (int j = 0; j < 3; ++j) {
+                r.min[j] = r.max[j] = m.m[12 + j];
+                for (int i = 0; i < 3; ++i) {
+                    auto a = m.m[i * 4 + j] * min[i];
+                    auto b = m.m[i * 4 + j] * max[i];
+                    r.min[j] += std::min(a, b);
+                    r.max[j] += std::max(a, b);
+                }
+            }
+            return r;
+        }
+    };
+
+    /// Returns the bounds of count points stored as consecutive x, y, z floats
+    inline AABB point_bounds(const float* points, size_t count)
+    {
+        auto r = AABB::empty();
+        if (count == 0)
+            return r;
+        if (count == 1) {
+            r.add(points);
+            return r;
+        }
+#ifdef BOUNDS_SSE
+        // Each load reads a point and the x of the next one, so the last point is added separately
+        auto lo = _mm_loadu_ps(points);
+        auto hi = lo;
+        for (size_t i = 1; i + 1 < count; ++i) {
+            auto p = _mm_loadu_ps(points + i * 3);
+            lo = _mm_min_ps(lo, p);
+            hi = _mm_max_ps(hi, p);
+        }
+        float lo4[4], hi4[4];
+        _mm_storeu_ps(lo4, lo);
+        _mm_storeu_ps(hi4, hi);
+        r.add(lo4);
+        r.add(hi4);
+        r.add(points + (count - 1) * 3);
+#else
+        for (size_t i = 0; i < count; ++i)
+            r.add(points + i * 3);
+#endif
+        return r;
+    }
+
+    /// The bounding boxes of the meshes, submeshes and instances of a G3d.
+    /// They can be stored in the G3d as attributes so that later reads do not need to compute them again.
+    struct SceneBounds
+    {
+        vector<AABB> meshes;
+        vector<AABB> submeshes;
+        vector<AABB> instances;
+
+        static constexpr const char* MeshBounds = "g3d:mesh:bounds:0:float32:6";
+        static constexpr const char* SubmeshBounds = "g3d:submesh:bounds:0:float32:6";
+        static constexpr const char* InstanceBounds = "g3d:instance:bounds:0:float32:6";
+
+        /// Computes the bounds from the positions. Mesh bounds cover the vertex range of each mesh, submesh bounds the vertices
+        /// their indices refer to. Instance bounds are the bounds of their mesh in world space, or empty for instances without a mesh.
+        static SceneBounds compute(const G3d& g3d, unsigned thread_count = 0) {
+            SceneBounds r;
+            auto positions = g3d.view<float, 3>(descriptors::Position);
+            auto indices = g3d.view<int, 1>(descriptors::Index);
+            auto submesh_offsets = g3d.view<int, 1>(descriptors::SubmeshIndexOffset);
+            auto layout = g3d.mesh_layout(thread_count);
+
+            r.meshes.resize(layout.num_meshes());
+            parallel::for_each(r.meshes.size(), [&](size_t m) {
+                auto begin = layout.vertex_offsets[m];
+                r.meshes[m] = point_bounds(positions.values() + (size_t)begin * 3, layout.vertex_offsets[m + 1] - begin);
+            }, thread_count);
+
+            r.submeshes.resize(submesh_offsets.size());
+            parallel::for_each(r.submeshes.size(), [&](size_t s) {
+                auto box = AABB::empty();
+                auto begin = max(0, min(submesh_offsets[s], (int)indices.size()));
+                auto end = s + 1 < submesh_offsets.size() ? max(begin, min(submesh_offsets[s + 1], (int)indices.size())) : (int)indices.size();
+                for (auto i = begin; i < end; ++i)
+                    if (indices[i] >= 0 && (size_t)indices[i] < positions.size())
+                        box.add(positions[indices[i]].values);
+                r.submeshes[s] = box;
+            }, thread_count);
+
+            auto instance_meshes = g3d.view<int, 1>(descriptors::InstanceMesh);
+            if (g3d.find(descriptors::InstanceTransform) != nullptr) {
+                TransformHierarchy hierarchy(g3d, thread_count);
+                r.instances.resize(hierarchy.size());
+                parallel::for_ranges(r.instances.size(), 4096, [&](size_t begin, size_t end) {
+                    for (auto i = begin; i < end; ++i) {
+                        auto mesh = i < instance_meshes.size() ? instance_meshes[i] : -1;
+                        r.instances[i] = mesh >= 0 && (size_t)mesh < r.meshes.size() ? r.meshes[mesh].transformed(hierarchy.world(i)) : AABB::empty();
+                    }
+                }, thread_count);
+            }
+            return r;
+        }
+
+        /// Reads the bounds stored by store(). Returns false, leaving the bounds empty, if the G3d does not have them.
+        bool load(const G3d& g3d) {
+            auto m = g3d.view<float, 6, AABB>(MeshBounds);
+            auto s = g3d.view<float, 6, AABB>(SubmeshBounds);
+            auto i = g3d.view<float, 6, AABB>(InstanceBounds);
+            meshes.assign(m.begin(), m.end());
+            submeshes.assign(s.begin(), s.end());
+            instances.assign(i.begin(), i.end());
+            return g3d.find(MeshBounds) != nullptr;
+        }
+
+        /// Adds the bounds to the G3d as attributes, replacing any that are already there
+        void store(G3d& g3d) const {
+            store(g3d, MeshBounds, meshes);
+            store(g3d, SubmeshBounds, submeshes);
+            store(g3d, InstanceBounds, instances);
+        }
+
+        static void store(G3d& g3d, const char* name, const vector<AABB>& boxes) {
+            g3d.remove_attribute(name);
+            if (boxes.empty())
+                return;
+            auto data = (const bfast::byte*)boxes.data();
+            g3d.add_attribute(name, make_shared<vector<bfast::byte>>(data, data + boxes.size() * sizeof(AABB)));
+        }
+    };
+
+    /// A node of a Bvh. Leaves refer to the items [first, first + count) of Bvh::items,
+    /// inner nodes have a count of 0 and their children are the nodes first and first + 1.
+    struct BvhNode
+    {
+        AABB bounds;
+        int first;
+        int count;
+
+        bool is_leaf() const { return count > 0; }
+    };
+
+    /// A bounding volume hierarchy over a set of boxes, built top down with a binned surface area heuristic.
+    /// Items with empty boxes are left out.
+    class Bvh
+    {
+    public:
+        static constexpr const char* NodeBounds = "g3d:all:bvhbounds:0:float32:6";
+        static constexpr const char* NodeChildren = "g3d:all:bvhnode:0:int32:2";
+        static constexpr const char* Items = "g3d:all:bvhitem:0:int32:1";
+        static constexpr const char* ItemBounds = "g3d:all:bvhitembounds:0:float32:6";
+
+        vector<BvhNode> nodes;
+        vector<int> items;
+
+        /// The box of each entry of items, so leaves can be tested without the original boxes 
+        vector<AABB> item_bounds;
+
+        Bvh() = default;
+
+        explicit Bvh(const vector<AABB>& boxes, int max_leaf_size = 4) {
+            build(boxes, max_leaf_size);
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+        /// Calls f(item, t) for each item whose box is hit by the ray within max_distance, where t is the distance to the box.
+        /// Items are not visited in order of distance. f returns false to stop the query.
+        template<typename F>
+        void query_ray(const float origin[3], const float direction[3], float max_distance, F f) const {
+            if (nodes.empty())
+                return;
+            float inverse[3];
+            for (int c = 0; c < 3; ++c)
+                inverse[c] = 1.0f / direction[c];
+            vector<int> stack(1, 0);
+            while (!stack.empty()) {
+                const auto& node = nodes[stack.back()];
+                stack.pop_back();
+                float t;
+                if (!hit(node.bounds, origin, inverse, max_distance, t))
+                    continue;
+                if (node.is_leaf()) {
+                    for (auto i = node.first; i < node.first + node.count; ++i)
+                        if (hit(item_bounds[i], origin, inverse, max_distance, t) && !f(items[i], t))
+                            return;
+                }
+                else {
+                    stack.push_back(node.first + 1);
+                    stack.push_back(node.first);
+                }
+            }
+        }
+
+        /// Calls f(item) for each item whose box is not entirely outside one of the planes.
+        /// A plane (a, b, c, d) keeps the points where a * x + b * y + c * z + d >= 0. f returns false to stop the query.
+        template<typename F>
+        void query_frustum(const float (*planes)[4], int num_planes, F f) const {
+            if (nodes.empty())
+                return;
+            vector<int> stack(1, 0);
+            while (!stack.empty()) {
+                const auto& node = nodes[stack.back()];
+                stack.pop_back();
+                if (outside(node.bounds, planes, num_planes))
+                    continue;
+                if (node.is_leaf()) {
+                    for (auto i = node.first; i < node.first + node.count; ++i)
+                        if (!outside(item_bounds[i], planes, num_planes) && !f(items[i]))
+                            return;
+                }
+                else {
+                    stack.push_back(node.first + 1);
+                    stack.push_back(node.first);
+                }
+            }
+        }
+
+        vector<int> intersect_ray(const float origin[3], const float direction[3], float max_distance = numeric_limits<float>::infinity()) const {
+            vector<int> r;
+            query_ray(origin, direction, max_distance, [&](int item, float) { r.push_back(item); return true; });
+            return r;
+        }
+
+        vector<int> intersect_frustum(const float (*planes)[4], int num_planes) const {
+            vector<int> r;
+            query_frustum(planes, num_planes, [&](int item) { r.push_back(item); return true; });
+            return r;
+        }
+
+        /// Reads a hierarchy stored by store(). Returns false, leaving the hierarchy empty, if the G3d does not have one.
+        bool load(const G3d& g3d) {
+            auto bounds = g3d.view<float, 6, AABB>(NodeBounds);
+            auto children = g3d.view<int, 2>(NodeChildren);
+            auto stored_items = g3d.view<int, 1>(Items);
+            auto leaf_bounds = g3d.view<float, 6, AABB>(ItemBounds);
+            nodes.clear();
+            items.assign(stored_items.begin(), stored_items.end());
+            item_bounds.assign(leaf_bounds.begin(), leaf_bounds.end());
+            if (bounds.size() != children.size() || item_bounds.size() != items.size())
+                throw runtime_error("The stored bounding volume hierarchy is inconsistent");
+            for (size_t i = 0; i < bounds.size(); ++i) {
+                auto first = children[i][0], count = children[i][1];
+                auto valid = count > 0 ? first >= 0 && (size_t)first + count <= items.size() : first > (int)i && (size_t)first + 1 < bounds.size();
+                if (!valid)
+                    throw runtime_error("The stored bounding volume hierarchy is inconsistent");
+                nodes.push_back(BvhNode{ bounds[i], first, count });
+            }
+            return !nodes.empty();
+        }
+
+        /// Adds the hierarchy to the G3d as attributes, replacing any that is already there
+        void store(G3d& g3d) const {
+            vector<AABB> bounds;
+            vector<int> children;
+            for (const auto& node : nodes) {
+                bounds.push_back(node.bounds);
+                children.push_back(node.first);
+                children.push_back(node.count);
+            }
+            SceneBounds::store(g3d, NodeBounds, bounds);
+            SceneBounds::store(g3d, ItemBounds, item_bounds);
+            g3d.remove_attribute(NodeChildren);
+            g3d.remove_attribute(Items);
+            if (nodes.empty())
+                return;
+            g3d.add_attribute(NodeChildren, make_shared<vector<bfast::byte>>((const bfast::byte*)children.data(), (const bfast::byte*)(children.data() + children.size())));
+            g3d.add_attribute(Items, make_shared<vector<bfast::byte>>((const bfast::byte*)items.data(), (const bfast::byte*)(items.data() + items.size())));
+        }
+
+    private:
+
+        struct Bin
+        {
+            AABB bounds = AABB::empty();
+            int count = 0;
+        };
+
+        void build(const vector<AABB>& boxes, int max_leaf_size) {
+            nodes.clear();
+            items.clear();
+            for (size_t i = 0; i < boxes.size(); ++i)
+                if (!boxes[i].is_empty())
+                    items.push_back((int)i);
+            if (items.empty())
+                return;
+            max_leaf_size = max(max_leaf_size, 1);
+
+            struct Task { int node, begin, end; };
+            vector<Task> tasks;
+            nodes.reserve(items.size() * 2);
+            nodes.push_back(BvhNode{ AABB::empty(), 0, 0 });
+            tasks.push_back(Task{ 0, 0, (int)items.size() });
+            const int num_bins = 16;
+            while (!tasks.empty()) {
+                auto task = tasks.back();
+                tasks.pop_back();
+                auto bounds = AABB::empty(), centers = AABB::empty();
+                for (auto i = task.begin; i < task.end; ++i) {
+                    const auto& box = boxes[items[i]];
+                    bounds.add(box);
+                    float center[3] = { box.center(0), box.center(1), box.center(2) };
+                    centers.add(center);
+                }
+                nodes[task.node].bounds = bounds;
+                auto count = task.end - task.begin;
+
+                // Splits along the axis where the centers are spread the most
+                auto axis = 0;
+                for (int c = 1; c < 3; ++c)
+                    if (centers.max[c] - centers.min[c] > centers.max[axis] - centers.min[axis])
+                        axis = c;
+                auto extent = centers.max[axis] - centers.min[axis];
+                if (count <= max_leaf_size || !(extent > 0)) {
+                    make_leaf(task.node, task.begin, count);
+                    continue;
+                }
+
+                Bin bins[num_bins];
+                auto scale = num_bins / extent;
+                auto bin_of = [&](int item) {
+                    return min(num_bins - 1, (int)((boxes[item].center(axis) - centers.min[axis]) * scale));
+                };
+                for (auto i = task.begin; i < task.end; ++i) {
+                    auto& bin = bins[bin_of(items[i])];
+                    bin.bounds.add(boxes[items[i]]);
+                    ++bin.count;
+                }
+
+                // Sweeps from the right to get the cost of every split in one pass from the left
+                float right_area[num_bins];
+                int right_count[num_bins];
+                auto right = AABB::empty();
+                auto n = 0;
+                for (auto b = num_bins - 1; b > 0; --b) {
+                    right.add(bins[b].bounds);
+                    n += bins[b].count;
+                    right_area[b] = right.half_area();
+                    right_count[b] = n;
+                }
+                auto left = AABB::empty();
+                n = 0;
+                auto best_cost = numeric_limits<float>::max();
+                auto best_split = 0;
+                for (auto b = 1; b < num_bins; ++b) {
+                    left.add(bins[b - 1].bounds);
+                    n += bins[b - 1].count;
+                    auto cost = left.half_area() * n + right_area[b] * right_count[b];
+                    if (n > 0 && right_count[b] > 0 && cost < best_cost) {
+                        best_cost = cost;
+                        best_split = b;
+                    }
+                }
+                if (best_split == 0) {
+                    make_leaf(task.node, task.begin, count);
+                    continue;
+                }
+
+                auto middle = (int)(partition(items.begin() + task.begin, items.begin() + task.end, [&](int item) {
+                    return bin_of(item) < best_split;
+                }) - items.begin());
+                auto child = (int)nodes.size();
+                nodes.push_back(BvhNode{ AABB::empty(), 0, 0 });
+                nodes.push_back(BvhNode{ AABB::empty(), 0, 0 });
+                nodes[task.node].first = child;
+                nodes[task.node].count = 0;
+                tasks.push_back(Task{ child + 1, middle, task.end });
+                tasks.push_back(Task{ child, task.begin, middle });
+            }
+
+            item_bounds.resize(items.size());
+            for (size_t i = 0; i < items.size(); ++i)
+                item_bounds[i] = boxes[items[i]];
+        }
+
+        void make_leaf(int node, int begin, int count) {
+            nodes[node].first = begin;
+            nodes[node].count = count;
+        }
+
+        // Slab test, giving the distance at which the ray enters the box
+        static bool hit(const AABB& box, const float origin[3], const float inverse[3], float max_distance, float& t) {
+            auto near_t = 0.0f, far_t = max_distance;
+            for (int c = 0; c < 3; ++c) {
+                auto t0 = (box.min[c] - origin[c]) * inverse[c];
+                auto t1 = (box.max[c] - origin[c]) * inverse[c];
+                if (t0 > t1)
+                    swap(t0, t1);
+                // Written so that NaNs from rays in the plane of a face keep the current interval
+                near_t = t0 > near_t ? t0 : near_t;
+                far_t = t1 < far_t ? t1 : far_t;
+                if (near_t > far_t)
+                    return false;
+            }
+            t = near_t;
+            return true;
+        }
+
+        static bool outside(const AABB& box, const float (*planes)[4], int num_planes) {
+            for (int p = 0; p < num_planes; ++p) {
+                // The corner of the box furthest along the plane normal
+                auto d = planes[p][3];
+                for (int c = 0; c < 3; ++c)
+                    d += planes[p][c] * (planes[p][c] >= 0 ? box.max[c] : box.min[c]);
+                if (d < 0)
+                    return true;
+            }
+            return false;
+        }
+    };
+}
+
+#endif
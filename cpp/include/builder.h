@@ -0,0 +1,289 @@
+/*
+    Builds a G3D in place: attributes are written directly into their final position in the BFAST byte stream
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __BUILDER_H__
+#define __BUILDER_H__
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include "bfast.h"
+#include "g3d.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// A writable typed range of the elements of an attribute being built
+    template<typename T, int N, typename Element = element_of<T, N>>
+    struct AttributeSpan {
+        AttributeSpan() = default;
+        AttributeSpan(Element* begin, size_t count)
+            : _begin(begin), _end(begin + count)
+        { }
+        Element* begin() const { return _begin; }
+        Element* end() const { return _end; }
+        Element* data() const { return _begin; }
+        size_t size() const { return _end - _begin; }
+        bool empty() const { return _begin == _end; }
+        Element& operator[](size_t i) const { return _begin[i]; }
+
+        /// The values of all the elements, N per element
+        T* values() const { return reinterpret_cast<T*>(_begin); }
+
+    private:
+        Element* _begin = nullptr;
+        Element* _end = nullptr;
+    };
+
+    /// Builds a G3d without copying its data. Attributes are declared with their number of elements first,
+    /// then allocate() lays out the whole BFAST byte stream in one 64 byte aligned arena, and every attribute is written
+    /// in place through span() or the append helpers. finish() returns a G3d that uses the arena directly, and
+    /// write_file() writes the arena as it is.
+    ///
+    /// For example:
+    ///     G3dBuilder b;
+    ///     b.declare_meshes(1, 1, 3, 3);
+    ///     b.allocate();
+    ///     b.add_mesh(positions, 3, indices, 3);
+    ///     auto g3d = b.finish();
+    ///
+    /// The arena is not cleared, so every element of every declared attribute has to be written.
+    class G3dBuilder
+    {
+    public:
+        G3dBuilder(const string& meta = G3d::default_meta())
+            : meta(meta)
+        { }
+
+        /// Declares an attribute with the given number of elements. Declaring it again changes its number of elements.
+        void declare(const string& descriptor, size_t num_elements) {
+            if (arena)
+                throw runtime_error("Attributes must be declared before allocate()");
+            auto desc = AttributeDescriptor::from_string(descriptor);
+            auto byte_size = num_elements * desc.data_type_size() * desc.data_arity;
+            for (auto& attr : attributes)
+                if (attr.name == descriptor) {
+                    attr.byte_size = byte_size;
+                    return;
+                }
+            attributes.push_back(Declared{ descriptor, desc, byte_size, nullptr });
+        }
+
+        /// Declares the positions, indices, submeshes and meshes filled by add_mesh()
+        void declare_meshes(size_t num_meshes, size_t num_submeshes, size_t num_vertices, size_t num_indices) {
+            declare(descriptors::Position, num_vertices);
+            declare(descriptors::Index, num_indices);
+            declare(descriptors::SubmeshIndexOffset, num_submeshes);
+            declare(descriptors::SubmeshMaterial, num_submeshes);
+            declare(descriptors::MeshSubmeshOffset, num_meshes);
+            declare(descriptors::MeshVertexOffset, num_meshes);
+            counts.meshes = num_meshes;
+            counts.submeshes = num_submeshes;
+            counts.vertices = num_vertices;
+            counts.indices = num_indices;
+        }
+
+        /// Declares the instance attributes filled by add_instances()
+        void declare_instances(size_t num_instances) {
+            declare(descriptors::InstanceTransform, num_instances);
+            declare(descriptors::InstanceParent, num_instances);
+            declare(descriptors::InstanceMesh, num_instances);
+            counts.instances = num_instances;
+        }
+
+        /// Declares the material attributes filled by add_materials()
+        void declare_materials(size_t num_materials) {
+            declare(descriptors::MaterialColor, num_materials);
+            declare(descriptors::MaterialGlossiness, num_materials);
+            declare(descriptors::MaterialSmoothness, num_materials);
+            counts.materials = num_materials;
+        }
+
+        /// Lays out the BFAST byte stream and allocates it. The header, the names, the meta data and the padding are written here.
+        void allocate() {
+            if (arena)
+                throw runtime_error("The builder is already allocated");
+            string names = "meta";
+            names.push_back(0);
+            for (const auto& attr : attributes) {
+                names += attr.name;
+                names.push_back(0);
+            }
+            vector<size_t> sizes = { names.size(), meta.size() };
+            for (const auto& attr : attributes)
+                sizes.push_back(attr.byte_size);
+            auto offsets = bfast::RawData::compute_offsets(sizes);
+            auto header = bfast::RawData::pack_header(offsets);
+            arena = make_shared<bfast::AlignedBuffer>(bfast::aligned_value(offsets.back()._end));
+
+            auto data = arena->data();
+            memcpy(data, header.data(), header.size());
+            memcpy(data + offsets[0]._begin, names.data(), names.size());
+            memcpy(data + offsets[1]._begin, meta.data(), meta.size());
+            for (size_t i = 0; i < offsets.size(); ++i) {
+                auto end = (size_t)offsets[i]._end;
+                memset(data + end, 0, bfast::aligned_value(end) - end);
+            }
+            for (size_t i = 0; i < attributes.size(); ++i)
+                attributes[i].data = data + offsets[i + 2]._begin;
+        }
+
+        /// Returns the writable elements of a declared attribute, throwing if it was not declared with N values of type T per element
+        template<typename T, int N, typename Element = element_of<T, N>>
+        AttributeSpan<T, N, Element> span(const string& descriptor) {
+            auto& attr = find(descriptor);
+            if (attr.descriptor.data_type != data_type_of<T>::value || attr.descriptor.data_arity != N)
+                throw runtime_error("The attribute data type or arity does not match the requested span");
+            return AttributeSpan<T, N, Element>(reinterpret_cast<Element*>(attr.data), attr.byte_size / sizeof(Element));
+        }
+
+        /// Appends a mesh and its submeshes, returning the index of the mesh. Indices are relative to the mesh's own vertices,
+        /// and submesh index offsets to its own indices. Without submeshes the mesh gets one submesh with the given material.
+        int add_mesh(const float* positions, size_t num_vertices, const int* indices, size_t num_indices,
+            const int* submesh_index_offsets = nullptr, const int* submesh_materials = nullptr, size_t num_submeshes = 0, int material = -1)
+        {
+            const int whole[1] = { 0 };
+            if (submesh_index_offsets == nullptr) {
+                submesh_index_offsets = whole;
+                submesh_materials = nullptr;
+                num_submeshes = 1;
+            }
+            if (added.meshes + 1 > counts.meshes || added.submeshes + num_submeshes > counts.submeshes
+                || added.vertices + num_vertices > counts.vertices || added.indices + num_indices > counts.indices)
+                throw runtime_error("The mesh does not fit in the declared sizes");
+            for (size_t s = 0; s < num_submeshes; ++s)
+                if (submesh_index_offsets[s] < 0 || (size_t)submesh_index_offsets[s] > num_indices || (s > 0 && submesh_index_offsets[s] < submesh_index_offsets[s - 1]))
+                    throw runtime_error("The submesh index offsets must be ascending and within the mesh's indices");
+
+            auto mesh = (int)added.meshes;
+            span<int, 1>(descriptors::MeshSubmeshOffset)[mesh] = (int)added.submeshes;
+            span<int, 1>(descriptors::MeshVertexOffset)[mesh] = (int)added.vertices;
+            memcpy(span<float, 3>(descriptors::Position).values() + added.vertices * 3, positions, num_vertices * 3 * sizeof(float));
+            auto index_out = span<int, 1>(descriptors::Index).data() + added.indices;
+            for (size_t i = 0; i < num_indices; ++i) {
+                if (indices[i] < 0 || (size_t)indices[i] >= num_vertices)
+                    throw runtime_error("An index is out of the range of the mesh's vertices");
+                index_out[i] = indices[i] + (int)added.vertices;
+            }
+            auto offset_out = span<int, 1>(descriptors::SubmeshIndexOffset).data() + added.submeshes;
+            auto material_out = span<int, 1>(descriptors::SubmeshMaterial).data() + added.submeshes;
+            for (size_t s = 0; s < num_submeshes; ++s) {
+                offset_out[s] = submesh_index_offsets[s] + (int)added.indices;
+                material_out[s] = submesh_materials != nullptr ? submesh_materials[s] : material;
+            }
+            added.meshes += 1;
+            added.submeshes += num_submeshes;
+            added.vertices += num_vertices;
+            added.indices += num_indices;
+            return mesh;
+        }
+
+        /// Appends instances, returning the index of the first one. transforms holds 16 floats per instance.
+        /// Without parents the instances have none.
+        int add_instances(const float* transforms, const int* meshes, size_t count, const int* parents = nullptr) {
+            if (added.instances + count > counts.instances)
+                throw runtime_error("The instances do not fit in the declared sizes");
+            auto first = added.instances;
+            memcpy(span<float, 16>(descriptors::InstanceTransform).values() + first * 16, transforms, count * 16 * sizeof(float));
+            memcpy(span<int, 1>(descriptors::InstanceMesh).data() + first, meshes, count * sizeof(int));
+            auto parent_out = span<int, 1>(descriptors::InstanceParent).data() + first;
+            for (size_t i = 0; i < count; ++i)
+                parent_out[i] = parents != nullptr ? parents[i] : -1;
+            added.instances += count;
+            return (int)first;
+        }
+
+        int add_instance(const float transform[16], int mesh, int parent = -1) {
+            return add_instances(transform, &mesh, 1, &parent);
+        }
+
+        /// Appends materials, returning the index of the first one. colors holds 4 floats per material.
+        /// Without glossiness or smoothness those are 0.
+        int add_materials(const float* colors, size_t count, const float* glossiness = nullptr, const float* smoothness = nullptr) {
+            if (added.materials + count > counts.materials)
+                throw runtime_error("The materials do not fit in the declared sizes");
+            auto first = added.materials;
+            memcpy(span<float, 4>(descriptors::MaterialColor).values() + first * 4, colors, count * 4 * sizeof(float));
+            auto glossiness_out = span<float, 1>(descriptors::MaterialGlossiness).data() + first;
+            auto smoothness_out = span<float, 1>(descriptors::MaterialSmoothness).data() + first;
+            for (size_t i = 0; i < count; ++i) {
+                glossiness_out[i] = glossiness != nullptr ? glossiness[i] : 0.0f;
+                smoothness_out[i] = smoothness != nullptr ? smoothness[i] : 0.0f;
+            }
+            added.materials += count;
+            return (int)first;
+        }
+
+        int add_material(const float color[4], float glossiness = 0, float smoothness = 0) {
+            return add_materials(color, 1, &glossiness, &smoothness);
+        }
+
+        /// Returns a G3d whose attributes point into the arena, which it keeps alive.
+        /// Throws if the meshes, instances or materials were appended with the helpers but fewer were added than declared.
+        /// Those filled through span() instead are not counted, so they are not checked.
+        G3d finish() const {
+            return G3d(to_bfast());
+        }
+
+        /// Writes the arena to a file as it is
+        void write_file(const string& path) const {
+            to_bfast().write_file(path);
+        }
+
+        /// The whole BFAST byte stream
+        bfast::ByteRange bytes() const {
+            if (!arena)
+                throw runtime_error("The builder is not allocated");
+            return arena->range();
+        }
+
+    private:
+        struct Declared {
+            string name;
+            AttributeDescriptor descriptor;
+            size_t byte_size;
+            bfast::byte* data;
+        };
+
+        struct Counts {
+            size_t meshes = 0;
+            size_t submeshes = 0;
+            size_t vertices = 0;
+            size_t indices = 0;
+            size_t instances = 0;
+            size_t materials = 0;
+        };
+
+        Declared& find(const string& descriptor) {
+            if (!arena)
+                throw runtime_error("The builder is not allocated");
+            for (auto& attr : attributes)
+                if (attr.name == descriptor)
+                    return attr;
+            throw runtime_error("The attribute was not declared");
+        }
+
+        bfast::Bfast to_bfast() const {
+            // Only the groups that the append helpers started filling are checked
+            auto meshes_added = added.meshes > 0 || added.submeshes > 0 || added.vertices > 0 || added.indices > 0;
+            if ((meshes_added && (added.meshes != counts.meshes || added.submeshes != counts.submeshes || added.vertices != counts.vertices
+                || added.indices != counts.indices)) || (added.instances > 0 && added.instances != counts.instances)
+                || (added.materials > 0 && added.materials != counts.materials))
+                throw runtime_error("Fewer elements were added than declared");
+            return bfast::Bfast::unpack(bytes(), arena);
+        }
+
+        string meta;
+        vector<Declared> attributes;
+        shared_ptr<bfast::AlignedBuffer> arena;
+        Counts counts;
+        Counts added;
+    };
+}
+
+#endif
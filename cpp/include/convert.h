@@ -0,0 +1,191 @@
+/*
+    Floating point conversion kernels for float16 and float64 attribute data
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include "parallel.h"
+
+// The F16C kernels are chosen at runtime, so they are compiled even when the target does not enable F16C.
+// Code compiled with /clr cannot use intrinsics and always takes the scalar path.
+#if !defined(_M_CEE) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define CONVERT_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CONVERT_TARGET_F16C
+#else
+#include <cpuid.h>
+#define CONVERT_TARGET_F16C __attribute__((target("avx,f16c")))
+#endif
+#endif
+
+namespace convert
+{
+    // The bits of an IEEE 754 half precision float, as stored in dt_float16 attributes
+    struct half
+    {
+        uint16_t bits;
+    };
+
+    inline uint32_t float_bits(float f) {
+        uint32_t r;
+        memcpy(&r, &f, sizeof(r));
+        return r;
+    }
+
+    inline float bits_float(uint32_t u) {
+        float r;
+        memcpy(&r, &u, sizeof(r));
+        return r;
+    }
+
+    // Rounds to the nearest half, ties to even. Values beyond the half range become infinity and NaNs stay NaNs.
+    inline half to_half(float f)
+    {
+        auto u = float_bits(f);
+        auto sign = (uint16_t)((u >> 16) & 0x8000);
+        u &= 0x7fffffff;
+        uint16_t h;
+        if (u >= 0x47800000) {
+            // Infinity or NaN, or too large for a half
+            h = u > 0x7f800000 ? 0x7e00 : 0x7c00;
+        }
+        else if (u < 0x38800000) {
+            // A subnormal half or zero: adding 0.5 lets the FPU do the rounding shift
+            const uint32_t magic = 126u << 23;
+            h = (uint16_t)(float_bits(bits_float(u) + bits_float(magic)) - magic);
+        }
+        else {
+            auto odd = (u >> 13) & 1;
+            u += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+            h = (uint16_t)(u >> 13);
+        }
+        return half{ (uint16_t)(h | sign) };
+    }
+
+    inline float to_float(half h)
+    {
+        auto sign = (uint32_t)(h.bits & 0x8000) << 16;
+        auto exponent = (uint32_t)(h.bits >> 10) & 0x1f;
+        auto mantissa = (uint32_t)h.bits & 0x3ff;
+        if (exponent == 0) {
+            // Zero or subnormal: the mantissa counts multiples of 2^-24
+            return bits_float(float_bits((float)mantissa * (1.0f / 16777216.0f)) | sign);
+        }
+        if (exponent == 31)
+            return bits_float(sign | 0x7f800000 | (mantissa << 13));
+        return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+    }
+
+#ifdef CONVERT_X86
+    // True when the CPU and operating system support the F16C conversion instructions (which need AVX registers)
+    inline bool has_f16c()
+    {
+        static const bool supported = []() {
+            unsigned ecx;
+#if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 1);
+            ecx = (unsigned)info[2];
+#else
+            unsigned eax, ebx, edx;
+            if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+                return false;
+#endif
+            const unsigned osxsave = 1u << 27, avx = 1u << 28, f16c = 1u << 29;
+            if ((ecx & (osxsave | avx | f16c)) != (osxsave | avx | f16c))
+                return false;
+            // The OS must save the SSE and AVX registers on context switches
+#if defined(_MSC_VER)
+            auto xcr0 = (unsigned)_xgetbv(0);
+#else
+            unsigned xcr0, xcr0_high;
+            __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+#endif
+            return (xcr0 & 6) == 6;
+        }();
+        return supported;
+    }
+
+    CONVERT_TARGET_F16C inline void half_to_float_f16c(const half* src, float* dst, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+        for (; i < count; ++i)
+            dst[i] = to_float(src[i]);
+    }
+
+    CONVERT_TARGET_F16C inline void float_to_half_f16c(const float* src, half* dst, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+        for (; i < count; ++i)
+            dst[i] = to_half(src[i]);
+    }
+#else
+    inline bool has_f16c() {
+        return false;
+    }
+#endif
+
+    // Chunk size for the parallel conversions: large enough that thread overhead does not show
+    static const size_t conversion_grain = 1 << 18;
+
+    // Widens count halves to floats
+    inline void half_to_float(const half* src, float* dst, size_t count, unsigned thread_count = 0)
+    {
+        parallel::for_ranges(count, conversion_grain, [&](size_t begin, size_t end) {
+#ifdef CONVERT_X86
+            if (has_f16c()) {
+                half_to_float_f16c(src + begin, dst + begin, end - begin);
+                return;
+            }
+#endif
+            for (auto i = begin; i < end; ++i)
+                dst[i] = to_float(src[i]);
+        }, thread_count);
+    }
+
+    // Narrows count floats to halves, rounding to nearest even
+    inline void float_to_half(const float* src, half* dst, size_t count, unsigned thread_count = 0)
+    {
+        parallel::for_ranges(count, conversion_grain, [&](size_t begin, size_t end) {
+#ifdef CONVERT_X86
+            if (has_f16c()) {
+                float_to_half_f16c(src + begin, dst + begin, end - begin);
+                return;
+            }
+#endif
+            for (auto i = begin; i < end; ++i)
+                dst[i] = to_half(src[i]);
+        }, thread_count);
+    }
+
+    // The double conversions are plain loops, which compilers vectorize with the baseline SSE2 or NEON instructions
+    inline void double_to_float(const double* src, float* dst, size_t count, unsigned thread_count = 0)
+    {
+        parallel::for_ranges(count, conversion_grain, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i)
+                dst[i] = (float)src[i];
+        }, thread_count);
+    }
+
+    inline void float_to_double(const float* src, double* dst, size_t count, unsigned thread_count = 0)
+    {
+        parallel::for_ranges(count, conversion_grain, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i)
+                dst[i] = (double)src[i];
+        }, thread_count);
+    }
+}
+
+#endif
@@ -0,0 +1,351 @@
+/*
+    Finds identical G3D meshes and collapses them into one mesh shared by all their instances
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "g3d.h"
+#include "parallel.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// A 64 bit hash of a block of memory (the XXH64 algorithm)
+    inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0)
+    {
+        const uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL, p3 = 1609587929392839161ULL;
+        const uint64_t p4 = 9650029242287828579ULL, p5 = 2870177450012600261ULL;
+        auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+        auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+        auto merge = [&](uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * p1 + p4; };
+        auto read64 = [](const uint8_t* p) { uint64_t r; memcpy(&r, p, 8); return r; };
+        auto read32 = [](const uint8_t* p) { uint32_t r; memcpy(&r, p, 4); return r; };
+
+        auto p = (const uint8_t*)data;
+        auto end = p + size;
+        uint64_t h;
+        if (size >= 32) {
+            uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+            for (; p + 32 <= end; p += 32) {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+        }
+        else
+            h = seed + p5;
+        h += size;
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+        if (p + 4 <= end) {
+            h = rotl(h ^ (read32(p) * p1), 23) * p2 + p3;
+            p += 4;
+        }
+        for (; p < end; ++p)
+            h = rotl(h ^ (*p * p5), 11) * p1;
+        h ^= h >> 33;
+        h *= p2;
+        h ^= h >> 29;
+        h *= p3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    struct DedupReport
+    {
+        size_t meshes_before = 0;
+        size_t meshes_after = 0;
+        size_t instances_remapped = 0;
+    };
+
+    /// Keeps a subset of the meshes of a G3d, in order, with all their vertices, corners, faces and submeshes, and points the instances
+    /// at new meshes. Offsets and indices are rebased, every other vertex, corner, face, submesh and mesh attribute is gathered to match.
+    /// instance_mesh_of_mesh maps each old mesh to the old mesh that its instances use afterwards, which must be kept.
+    /// The layout must start at the first vertex, index and submesh, and indices must stay within the vertex range of their mesh.
+    /// Face attributes are gathered by g3d:all:facesize corners per face, and it throws if there are any while a mesh does not start on a whole face.
+    /// The levels of detail and meshlets refer to the old vertices and submeshes and are removed, so they have to be generated after this.
+    inline void keep_meshes(G3d& g3d, const MeshLayout& layout, const vector<char>& keep, const vector<int>& instance_mesh_of_mesh, unsigned thread_count = 0)
+    {
+        auto num_meshes = layout.num_meshes();
+        auto indices = g3d.view<int, 1>(descriptors::Index);
+        auto submesh_index_offsets = g3d.view<int, 1>(descriptors::SubmeshIndexOffset);
+        auto num_vertices = g3d.num_vertices();
+        auto num_indices = indices.size();
+        auto num_submeshes = submesh_index_offsets.size();
+
+        // The new position of each kept mesh and of its first vertex, index and submesh
+        vector<int> new_mesh(num_meshes, -1);
+        vector<int> vertex_offsets, index_offsets, submesh_offsets;
+        vector<int> vertex_sources, corner_sources, submesh_sources, mesh_sources;
+        for (size_t m = 0; m < num_meshes; ++m) {
+            if (!keep[m])
+                continue;
+            new_mesh[m] = (int)mesh_sources.size();
+            mesh_sources.push_back((int)m);
+            vertex_offsets.push_back((int)vertex_sources.size());
+            index_offsets.push_back((int)corner_sources.size());
+            submesh_offsets.push_back((int)submesh_sources.size());
+            for (auto v = layout.vertex_offsets[m]; v < layout.vertex_offsets[m + 1]; ++v)
+                vertex_sources.push_back(v);
+            for (auto i = layout.index_offsets[m]; i < layout.index_offsets[m + 1]; ++i)
+                corner_sources.push_back(i);
+            for (auto s = layout.submesh_offsets[m]; s < layout.submesh_offsets[m + 1]; ++s)
+                submesh_sources.push_back(s);
+        }
+
+        // Faces follow the corners when the indices are whole faces and the meshes start on whole faces
+        auto face_size = g3d.corners_per_face();
+        auto whole_faces = num_indices % face_size == 0;
+        for (size_t m = 0; m < num_meshes && whole_faces; ++m)
+            whole_faces = layout.index_offsets[m] % face_size == 0;
+        vector<int> face_sources;
+        if (whole_faces)
+            for (size_t k = 0; k < corner_sources.size(); k += face_size)
+                face_sources.push_back(corner_sources[k] / (int)face_size);
+
+        auto to_bytes = [](const vector<int>& values) {
+            auto data = (const bfast::byte*)values.data();
+            return make_shared<vector<bfast::byte>>(data, data + values.size() * sizeof(int));
+        };
+
+        vector<pair<string, shared_ptr<vector<bfast::byte>>>> replaced;
+        for (const auto& attr : g3d.attributes) {
+            const auto& name = attr.name;
+            auto count = attr.num_elements();
+            auto association = attr.descriptor.association;
+            if (name == descriptors::Index) {
+                vector<int> values(corner_sources.size());
+                parallel::for_each(mesh_sources.size(), [&](size_t k) {
+                    auto m = mesh_sources[k];
+                    auto shift = vertex_offsets[k] - layout.vertex_offsets[m];
+                    for (auto i = index_offsets[k], j = layout.index_offsets[m]; j < layout.index_offsets[m + 1]; ++i, ++j)
+                        values[i] = indices[j] + shift;
+                }, thread_count);
+                replaced.emplace_back(name, to_bytes(values));
+            }
+            else if (name == descriptors::SubmeshIndexOffset) {
+                vector<int> values(submesh_sources.size());
+                for (size_t k = 0; k < mesh_sources.size(); ++k) {
+                    auto m = mesh_sources[k];
+                    for (auto s = layout.submesh_offsets[m], t = submesh_offsets[k]; s < layout.submesh_offsets[m + 1]; ++s, ++t)
+                        values[t] = submesh_index_offsets[s] - layout.index_offsets[m] + index_offsets[k];
+                }
+                replaced.emplace_back(name, to_bytes(values));
+            }
+            else if (name == descriptors::MeshSubmeshOffset)
+                replaced.emplace_back(name, to_bytes(submesh_offsets));
+            else if (name == descriptors::MeshVertexOffset)
+                replaced.emplace_back(name, to_bytes(vertex_offsets));
+            else if (name == descriptors::InstanceMesh) {
+                auto instance_meshes = attr.as<int, 1>();
+                vector<int> values(instance_meshes.begin(), instance_meshes.end());
+                for (auto& mesh : values)
+                    if (mesh >= 0 && (size_t)mesh < num_meshes)
+                        mesh = new_mesh[instance_mesh_of_mesh[mesh]];
+                replaced.emplace_back(name, to_bytes(values));
+            }
+            else if (association == assoc_vertex && count == num_vertices)
+                replaced.emplace_back(name, attr.gather(vertex_sources.data(), vertex_sources.size(), thread_count));
+            else if (association == assoc_corner && count == num_indices)
+                replaced.emplace_back(name, attr.gather(corner_sources.data(), corner_sources.size(), thread_count));
+            else if (association == assoc_face) {
+                if (!whole_faces)
+                    throw runtime_error("The face attributes cannot be kept since the meshes do not start on whole faces");
+                if (count == num_indices / face_size)
+                    replaced.emplace_back(name, attr.gather(face_sources.data(), face_sources.size(), thread_count));
+            }
+            else if (association == assoc_submesh && count == num_submeshes)
+                replaced.emplace_back(name, attr.gather(submesh_sources.data(), submesh_sources.size(), thread_count));
+            else if (association == assoc_mesh && count == num_meshes)
+                replaced.emplace_back(name, attr.gather(mesh_sources.data(), mesh_sources.size(), thread_count));
+        }
+        for (auto& r : replaced)
+            g3d.replace_attribute(r.first, r.second);
+        g3d.remove_derived_attributes();
+    }
+
+    /// Finds meshes that are identical: the same vertices with the same attribute values, the same indices relative to the
+    /// first vertex, and the same submeshes with the same materials. Each mesh is hashed in parallel, then meshes with equal hashes
+    /// are compared in full. Returns the first mesh identical to each mesh, itself for the first of each group.
+    /// Meshes whose indices leave their vertex range are only identical to themselves.
+    inline vector<int> find_identical_meshes(const G3d& g3d, const MeshLayout& layout, unsigned thread_count = 0)
+    {
+        auto num_meshes = layout.num_meshes();
+        auto indices = g3d.view<int, 1>(descriptors::Index);
+        auto submesh_index_offsets = g3d.view<int, 1>(descriptors::SubmeshIndexOffset);
+        auto num_vertices = g3d.num_vertices();
+        auto num_corners = indices.size();
+        auto num_submeshes = submesh_index_offsets.size();
+        auto face_size = g3d.corners_per_face();
+
+        // The attributes compared as plain bytes for each association, apart from the offsets that are compared relative to the mesh
+        vector<const Attribute*> vertex_attrs, corner_attrs, face_attrs, submesh_attrs, mesh_attrs;
+        for (const auto& attr : g3d.attributes) {
+            if (attr.name == descriptors::Index || attr.name == descriptors::SubmeshIndexOffset
+                || attr.name == descriptors::MeshSubmeshOffset || attr.name == descriptors::MeshVertexOffset)
+                continue;
+            auto association = attr.descriptor.association;
+            auto count = attr.num_elements();
+            if (association == assoc_vertex && count == num_vertices)
+                vertex_attrs.push_back(&attr);
+            else if (association == assoc_corner && count == num_corners)
+                corner_attrs.push_back(&attr);
+            else if (association == assoc_face && num_corners % face_size == 0 && count == num_corners / face_size)
+                face_attrs.push_back(&attr);
+            else if (association == assoc_submesh && count == num_submeshes)
+                submesh_attrs.push_back(&attr);
+            else if (association == assoc_mesh && count == layout.num_meshes())
+                mesh_attrs.push_back(&attr);
+        }
+        auto position = g3d.find(descriptors::Position);
+        auto material = g3d.find(descriptors::SubmeshMaterial);
+
+        auto relative_indices = [&](size_t m, vector<int>& r) {
+            r.clear();
+            auto first = layout.vertex_offsets[m], last = layout.vertex_offsets[m + 1];
+            for (auto i = layout.index_offsets[m]; i < layout.index_offsets[m + 1]; ++i) {
+                if (indices[i] < first || indices[i] >= last)
+                    return false;
+                r.push_back(indices[i] - first);
+            }
+            for (auto s = layout.submesh_offsets[m]; s < layout.submesh_offsets[m + 1]; ++s)
+                r.push_back(submesh_index_offsets[s] - layout.index_offsets[m]);
+            return true;
+        };
+        auto range_bytes = [](const Attribute* attr, size_t begin, size_t end) {
+            auto size = attr->data_element_size();
+            return make_pair(attr->_begin + begin * size, (end - begin) * size);
+        };
+
+        // Hashes the positions, relative indices and submesh materials. Meshes with indices out of range get a unique hash.
+        vector<uint64_t> hashes(num_meshes);
+        vector<char> valid(num_meshes);
+        parallel::for_each(num_meshes, [&](size_t m) {
+            vector<int> relative;
+            valid[m] = relative_indices(m, relative);
+            auto h = hash_bytes(relative.data(), relative.size() * sizeof(int), layout.vertex_offsets[m + 1] - layout.vertex_offsets[m]);
+            if (position != nullptr) {
+                auto bytes = range_bytes(position, layout.vertex_offsets[m], layout.vertex_offsets[m + 1]);
+                h = hash_bytes(bytes.first, bytes.second, h);
+            }
+            if (material != nullptr) {
+                auto bytes = range_bytes(material, layout.submesh_offsets[m], layout.submesh_offsets[m + 1]);
+                h = hash_bytes(bytes.first, bytes.second, h);
+            }
+            hashes[m] = valid[m] ? h : (uint64_t)m;
+        }, thread_count);
+
+        auto identical = [&](size_t a, size_t b) {
+            if (!valid[a] || !valid[b])
+                return false;
+            auto same_range = [&](const Attribute* attr, int a_begin, int a_end, int b_begin, int b_end) {
+                auto x = range_bytes(attr, a_begin, a_end), y = range_bytes(attr, b_begin, b_end);
+                return x.second == y.second && memcmp(x.first, y.first, x.second) == 0;
+            };
+            for (auto attr : vertex_attrs)
+                if (!same_range(attr, layout.vertex_offsets[a], layout.vertex_offsets[a + 1], layout.vertex_offsets[b], layout.vertex_offsets[b + 1]))
+                    return false;
+            for (auto attr : corner_attrs)
+                if (!same_range(attr, layout.index_offsets[a], layout.index_offsets[a + 1], layout.index_offsets[b], layout.index_offsets[b + 1]))
+                    return false;
+            for (auto attr : face_attrs) {
+                // Faces can only be matched up when both meshes start on a whole face
+                auto n = (int)face_size;
+                if (layout.index_offsets[a] % n != 0 || layout.index_offsets[b] % n != 0)
+                    return false;
+                if (!same_range(attr, layout.index_offsets[a] / n, layout.index_offsets[a + 1] / n, layout.index_offsets[b] / n, layout.index_offsets[b + 1] / n))
+                    return false;
+            }
+            for (auto attr : submesh_attrs)
+                if (!same_range(attr, layout.submesh_offsets[a], layout.submesh_offsets[a + 1], layout.submesh_offsets[b], layout.submesh_offsets[b + 1]))
+                    return false;
+            for (auto attr : mesh_attrs)
+                if (!same_range(attr, (int)a, (int)a + 1, (int)b, (int)b + 1))
+                    return false;
+            vector<int> x, y;
+            relative_indices(a, x);
+            relative_indices(b, y);
+            return x == y && layout.vertex_offsets[a + 1] - layout.vertex_offsets[a] == layout.vertex_offsets[b + 1] - layout.vertex_offsets[b];
+        };
+
+        // Sorting by hash puts candidates next to each other, then each run of equal hashes is resolved on its own
+        vector<int> order(num_meshes);
+        for (size_t m = 0; m < num_meshes; ++m)
+            order[m] = (int)m;
+        sort(order.begin(), order.end(), [&](int a, int b) {
+            return hashes[a] != hashes[b] ? hashes[a] < hashes[b] : a < b;
+        });
+        vector<size_t> runs;
+        for (size_t k = 0; k < num_meshes; ++k)
+            if (k == 0 || hashes[order[k]] != hashes[order[k - 1]])
+                runs.push_back(k);
+        runs.push_back(num_meshes);
+
+        vector<int> r(num_meshes);
+        parallel::for_each(runs.size() - 1, [&](size_t run) {
+            // The meshes of the run are in ascending order, so the representative of each group is its first mesh
+            vector<int> representatives;
+            for (auto k = runs[run]; k < runs[run + 1]; ++k) {
+                auto m = order[k];
+                r[m] = m;
+                for (auto rep : representatives)
+                    if (identical(rep, m)) {
+                        r[m] = rep;
+                        break;
+                    }
+                if (r[m] == m)
+                    representatives.push_back(m);
+            }
+        }, thread_count);
+        return r;
+    }
+
+    /// Collapses identical meshes into the first of them and points their instances at it, removing the other copies.
+    /// Rendering is unchanged since the removed meshes had the same content. Does nothing if the mesh layout does not start at the
+    /// first vertex, index and submesh, or if any mesh indexes vertices outside its own range.
+    inline DedupReport deduplicate_meshes(G3d& g3d, unsigned thread_count = 0)
+    {
+        DedupReport report;
+        auto layout = g3d.mesh_layout(thread_count);
+        auto num_meshes = layout.num_meshes();
+        report.meshes_before = report.meshes_after = num_meshes;
+        if (num_meshes == 0 || layout.vertex_offsets[0] != 0 || layout.index_offsets[0] != 0 || layout.submesh_offsets[0] != 0)
+            return report;
+
+        auto same_as = find_identical_meshes(g3d, layout, thread_count);
+        vector<char> keep(num_meshes);
+        size_t kept = 0;
+        for (size_t m = 0; m < num_meshes; ++m) {
+            keep[m] = same_as[m] == (int)m;
+            kept += keep[m];
+        }
+        if (kept == num_meshes)
+            return report;
+
+        // Meshes that index outside their range could be referenced by the meshes being removed
+        auto indices = g3d.view<int, 1>(descriptors::Index);
+        for (size_t m = 0; m < num_meshes; ++m)
+            for (auto i = layout.index_offsets[m]; i < layout.index_offsets[m + 1]; ++i)
+                if (indices[i] < layout.vertex_offsets[m] || indices[i] >= layout.vertex_offsets[m + 1])
+                    return report;
+
+        for (auto mesh : g3d.view<int, 1>(descriptors::InstanceMesh))
+            if (mesh >= 0 && (size_t)mesh < num_meshes && same_as[mesh] != mesh)
+                ++report.instances_remapped;
+        keep_meshes(g3d, layout, keep, same_as, thread_count);
+        report.meshes_after = kept;
+        return report;
+    }
+}
+
+#endif
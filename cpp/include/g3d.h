@@ -11,8 +11,15 @@
 #include <vector>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <string_view>
+#include <type_traits>
+#include <limits>
+#include <algorithm>
+#include <cmath>
 
 #include "bfast.h"
+#include "convert.h"
 
 namespace g3d
 {
@@ -57,12 +64,163 @@ namespace g3d
         assoc_none,
     };
 
+    /// Maps a C++ type to the data type used to store it 
+    template<typename T> struct data_type_of;
+    template<> struct data_type_of<uint8_t> { static constexpr DataType value = dt_uint8; };
+    template<> struct data_type_of<int8_t> { static constexpr DataType value = dt_int8; };
+    template<> struct data_type_of<uint16_t> { static constexpr DataType value = dt_uint16; };
+    template<> struct data_type_of<int16_t> { static constexpr DataType value = dt_int16; };
+    template<> struct data_type_of<uint32_t> { static constexpr DataType value = dt_uint32; };
+    template<> struct data_type_of<int32_t> { static constexpr DataType value = dt_int32; };
+    template<> struct data_type_of<uint64_t> { static constexpr DataType value = dt_uint64; };
+    template<> struct data_type_of<int64_t> { static constexpr DataType value = dt_int64; };
+    template<> struct data_type_of<convert::half> { static constexpr DataType value = dt_float16; };
+    template<> struct data_type_of<float> { static constexpr DataType value = dt_float32; };
+    template<> struct data_type_of<double> { static constexpr DataType value = dt_float64; };
+
     enum InstanceFlags
     {
         None = 0,
         Hidden = 1,
     };
 
+    /// The parts of an attribute descriptor string, with the semantic referring into the parsed string. 
+    /// Parsing never allocates and can be done at compile time, e.g. "constexpr auto d = DescriptorView::parse(descriptors::Position);"
+    struct DescriptorView
+    {
+        DataType data_type = dt_uint8;
+        int data_arity = 0;
+        int index = 0;
+        Association association = assoc_none;
+        string_view semantic;
+
+        /// Null if the string was parsed successfully, otherwise the reason it was rejected 
+        const char* error = nullptr;
+
+        constexpr bool valid() const {
+            return error == nullptr;
+        }
+
+        static constexpr bool association_from_string(string_view s, Association& r) {
+            switch (s.size()) {
+                case 3:
+                    if (s == "all") { r = assoc_all; return true; }
+                    break;
+                case 4:
+                    if (s == "face") { r = assoc_face; return true; }
+                    if (s == "edge") { r = assoc_edge; return true; }
+                    if (s == "mesh") { r = assoc_mesh; return true; }
+                    if (s == "none") { r = assoc_none; return true; }
+                    break;
+                case 5:
+                    if (s == "shape") { r = assoc_shape; return true; }
+                    break;
+                case 6:
+                    if (s == "vertex") { r = assoc_vertex; return true; }
+                    if (s == "corner") { r = assoc_corner; return true; }
+                    break;
+                case 7:
+                    if (s == "submesh") { r = assoc_submesh; return true; }
+                    break;
+                case 8:
+                    if (s == "instance") { r = assoc_instance; return true; }
+                    if (s == "material") { r = assoc_material; return true; }
+                    break;
+                case 11:
+                    if (s == "subgeometry") { r = assoc_subgeometry; return true; }
+                    if (s == "shapevertex") { r = assoc_shapevertex; return true; }
+                    break;
+            }
+            return false;
+        }
+
+        static constexpr bool data_type_from_string(string_view s, DataType& r) {
+            switch (s.size()) {
+                case 4:
+                    if (s == "int8") { r = dt_int8; return true; }
+                    break;
+                case 5:
+                    if (s == "uint8") { r = dt_uint8; return true; }
+                    if (s == "int16") { r = dt_int16; return true; }
+                    if (s == "int32") { r = dt_int32; return true; }
+                    if (s == "int64") { r = dt_int64; return true; }
+                    break;
+                case 6:
+                    if (s == "uint16") { r = dt_uint16; return true; }
+                    if (s == "uint32") { r = dt_uint32; return true; }
+                    if (s == "uint64") { r = dt_uint64; return true; }
+                    if (s == "int128") { r = dt_int128; return true; }
+                    break;
+                case 7:
+                    if (s == "uint128") { r = dt_uint128; return true; }
+                    if (s == "float16") { r = dt_float16; return true; }
+                    if (s == "float32") { r = dt_float32; return true; }
+                    if (s == "float64") { r = dt_float64; return true; }
+                    break;
+                case 8:
+                    if (s == "float128") { r = dt_float128; return true; }
+                    break;
+            }
+            return false;
+        }
+
+        /// Parses an int like stoi, with an optional sign and the full range of int, but rejects any character that is not part of the number 
+        static constexpr bool int_from_string(string_view s, int& r) {
+            auto negative = !s.empty() && s[0] == '-';
+            if (!s.empty() && (s[0] == '-' || s[0] == '+'))
+                s.remove_prefix(1);
+            if (s.empty())
+                return false;
+            long long value = 0;
+            for (auto c : s) {
+                if (c < '0' || c > '9')
+                    return false;
+                value = value * 10 + (c - '0');
+                if (value > (long long)numeric_limits<int>::max() + 1)
+                    return false;
+            }
+            value = negative ? -value : value;
+            if (value > numeric_limits<int>::max())
+                return false;
+            r = (int)value;
+            return true;
+        }
+
+        /// Splits off the next token, up to the next ':' or the end of the string 
+        static constexpr bool next_token(string_view& s, string_view& token) {
+            if (s.data() == nullptr)
+                return false;
+            auto n = s.find(':');
+            if (n == string_view::npos) {
+                token = s;
+                s = string_view();
+            }
+            else {
+                token = s.substr(0, n);
+                s = s.substr(n + 1);
+            }
+            return true;
+        }
+
+        static constexpr DescriptorView parse(string_view s) {
+            DescriptorView r;
+            string_view token;
+            if (!next_token(s, token)) { r.error = "Insufficient tokens"; return r; }
+            if (token != "g3d") { r.error = "Expected g3d"; return r; }
+            if (!next_token(s, token)) { r.error = "Insufficient tokens"; return r; }
+            if (!association_from_string(token, r.association)) { r.error = "unknown association"; return r; }
+            if (!next_token(s, r.semantic)) { r.error = "Insufficient tokens"; return r; }
+            if (!next_token(s, token)) { r.error = "Insufficient tokens"; return r; }
+            if (!int_from_string(token, r.index)) { r.error = "invalid index"; return r; }
+            if (!next_token(s, token)) { r.error = "Insufficient tokens"; return r; }
+            if (!data_type_from_string(token, r.data_type)) { r.error = "unknown data-type"; return r; }
+            if (!next_token(s, token)) { r.error = "Insufficient tokens"; return r; }
+            if (!int_from_string(token, r.data_arity)) { r.error = "invalid arity"; return r; }
+            if (s.data() != nullptr) { r.error = "Too many tokens"; return r; }
+            return r;
+        }
+    };
+
     // Contains all the information necessary to parse an attribute data channel and associate it with some part of the geometry 
     struct AttributeDescriptor
     {
@@ -187,53 +345,163 @@ namespace g3d
             return oss.str();
         };
 
-        template<typename Out>
-        static void split(const string &s, char delim, Out result) {
-            stringstream ss(s);
-            string item;
-            while (getline(ss, item, delim)) 
-                *(result++) = item;
+        static Association association_from_string(string_view s) {
+            Association r = assoc_none;
+            if (!DescriptorView::association_from_string(s, r)) throw runtime_error("unknown association");
+            return r;
         }
 
-        static vector<string> split(const string &s, char delim) {
-            vector<string> elems;
-            split(s, delim, back_inserter(elems));
-            return elems;
+        static DataType data_type_from_string(string_view s) {
+            DataType r = dt_uint8;
+            if (!DescriptorView::data_type_from_string(s, r)) throw runtime_error("unknown data-type");
+            return r;
         }
 
-        static Association association_from_string(const string& s) {
-            auto d = associations_from_strings();
-            if (d.find(s) == d.end()) throw runtime_error("unknown association");
-            return d.at(s);
+        static AttributeDescriptor from_view(const DescriptorView& view) {
+            if (!view.valid()) throw runtime_error(view.error);
+            AttributeDescriptor desc;
+            desc.data_type = view.data_type;
+            desc.data_arity = view.data_arity;
+            desc.index = view.index;
+            desc.association = view.association;
+            desc.semantic.assign(view.semantic.data(), view.semantic.size());
+            return desc;
         }
 
-        static DataType data_type_from_string(const string& s) {
-            auto d = data_types_from_strings();
-            if (d.find(s) == d.end()) throw runtime_error("unknown data-type");
-            return d.at(s);
+        static AttributeDescriptor from_string(string_view s) {
+            return from_view(DescriptorView::parse(s));
         }
+    };
 
-        static AttributeDescriptor from_string(const string& s) {
-            AttributeDescriptor desc;
-            auto tokens = split(s, ':');
-            auto token = tokens.begin();
-            auto end = tokens.end();
-            if (token == end) throw runtime_error("Insufficient tokens");
-            if (*token++ != "g3d") throw runtime_error("Expected g3d"); if (token == end) throw runtime_error("Insufficient tokens");
-            desc.association = association_from_string(*token++); if (token == end) throw runtime_error("Insufficient tokens");
-            desc.semantic = *token++; if (token == end) throw runtime_error("Insufficient tokens");
-            desc.index = stoi(*token++);
-            desc.data_type = data_type_from_string(*token++); if (token == end) throw runtime_error("Insufficient tokens");
-            desc.data_arity = stoi(*token++);
-            if (token != end) throw runtime_error("Too many tokens");
-            return desc;
-        }
+    struct descriptors
+    {
+        static constexpr const char* Position = "g3d:vertex:position:0:float32:3";
+        static constexpr const char* Index = "g3d:corner:index:0:int32:1";
+        static constexpr const char* ObjectFaceSize = "g3d:all:facesize:0:int32:1";
+
+        static constexpr const char* VertexUv = "g3d:vertex:uv:0:float32:2";
+        static constexpr const char* VertexUvw = "g3d:vertex:uv:0:float32:3";
+        static constexpr const char* VertexNormal = "g3d:vertex:normal:0:float32:3";
+        static constexpr const char* VertexColor = "g3d:vertex:color:0:float32:3";
+        static constexpr const char* VertexColorWithAlpha = "g3d:vertex:color:0:float32:4";
+        static constexpr const char* VertexBitangent = "g3d:vertex:bitangent:0:float32:3";
+        static constexpr const char* VertexTangent = "g3d:vertex:tangent:0:float32:3";
+        static constexpr const char* VertexTangent4 = "g3d:vertex:tangent:0:float32:4";
+        static constexpr const char* VertexSelectionWeight = "g3d:vertex:weight:0:float32:1";
+
+        static constexpr const char* FaceMaterial = "g3d:face:material:0:int32:1";
+        static constexpr const char* FaceNormal = "g3d:face:normal:0:float32:3";
+        static constexpr const char* FaceSize = "g3d:face:facesize:0:int32:1";
+        static constexpr const char* FaceIndexOffset = "g3d:face:indexoffset:0:int32:1";
+        static constexpr const char* FaceSelectionWeight = "g3d:face:weight:0:float32:1";
+
+        //VIM 1.0
+        
+        // Meshes
+        static constexpr const char* MeshSubmeshOffset = "g3d:mesh:submeshoffset:0:int32:1";
+        static constexpr const char* MeshVertexOffset = "g3d:mesh:vertexoffset:0:int32:1";
+
+        // Instances
+        static constexpr const char* InstanceTransform = "g3d:instance:transform:0:float32:16";
+        static constexpr const char* InstanceParent = "g3d:instance:parent:0:int32:1";
+        static constexpr const char* InstanceMesh = "g3d:instance:mesh:0:int32:1";
+        static constexpr const char* InstanceFlags = "g3d:instance:flags:0:uint16:1";
+
+        // Shapes
+        static constexpr const char* ShapeVertex = "g3d:shapevertex:position:0:float32:3";
+        static constexpr const char* ShapeVertexOffset = "g3d:shape:vertexoffset:0:int32:1";
+        static constexpr const char* ShapeColor = "g3d:shape:color:0:float32:4";
+        static constexpr const char* ShapeWidth = "g3d:shape:width:0:float32:1";
+
+        // Materials
+        static constexpr const char* MaterialColor = "g3d:material:color:0:float32:4";
+        static constexpr const char* MaterialGlossiness = "g3d:material:glossiness:0:float32:1";
+        static constexpr const char* MaterialSmoothness = "g3d:material:smoothness:0:float32:1";
+
+        // Submeshes
+        static constexpr const char* SubmeshIndexOffset = "g3d:submesh:indexoffset:0:int32:1";
+        static constexpr const char* SubmeshMaterial = "g3d:submesh:material:0:int32:1";
+
+        // Quantized positions, see PositionQuantizer. They are decoded to Position when read.
+        static constexpr const char* PositionQuantized16 = "g3d:vertex:position:0:uint16:3";
+        static constexpr const char* PositionQuantized32 = "g3d:vertex:position:0:uint32:3";
+        static constexpr const char* MeshPositionBounds = "g3d:mesh:positionbounds:0:float32:6";
+        static constexpr const char* PositionBounds = "g3d:all:positionbounds:0:float32:6";
+
+        // https://docs.thinkboxsoftware.com/products/krakatoa/2.6/1_Documentation/manual/formats/particle_channels.html
+        static constexpr const char* PointVelocity = "g3d:vertex:velocity:0:float32:3";
+        static constexpr const char* PointNormal = "g3d:vertex:normal:0:float32:3";
+        static constexpr const char* PointAcceleration = "g3d:vertex:acceleration:0:float32:3";
+        static constexpr const char* PointDensity = "g3d:vertex:density:0:float32:1";
+        static constexpr const char* PointEmissionColor = "g3d:vertex:emission:0:float32:3";
+        static constexpr const char* PointAbsorptionColor = "g3d:vertex:absorption:0:float32:3";
+        static constexpr const char* PointSpin = "g3d:vertex:spin:0:float32:4";
+        static constexpr const char* PointOrientation = "g3d:vertex:orientation:0:float32:4";
+        static constexpr const char* PointParticleId = "g3d:vertex:particleid:0:int32:1";
+        static constexpr const char* PointAge = "g3d:vertex:age:0:int32:1";
+
+        // Line specific attributes 
+        static constexpr const char* LineTangentIn = "g3d:vertex:tangent:0:float32:3";
+        static constexpr const char* LineTangentOut = "g3d:vertex:tangent:1:float32:3";
     };
 
-    /// Manage the data buffer and meta-information of an attribute 
+    /// A tuple of N values, laid out exactly like one element of an attribute with an arity of N 
+    template<typename T, int N>
+    struct Vector {
+        T values[N];
+        T& operator[](int i) { return values[i]; }
+        const T& operator[](int i) const { return values[i]; }
+    };
+
+    /// The element type of an attribute view: the value itself for an arity of 1, otherwise a Vector 
+    template<typename T, int N>
+    using element_of = typename conditional<N == 1, T, Vector<T, N>>::type;
+
+    /// A read-only typed view of the elements of an attribute. The type and arity are checked once when the view is created, 
+    /// after which the elements are a plain contiguous array that can be used with standard algorithms. 
+    /// Any trivially copyable type with the same size as N values of type T, such as a math library vector, can be used as the element type.
+    /// Like the attribute it comes from, a view keeps the data alive through the storage when there is one.
+    template<typename T, int N, typename Element = element_of<T, N>>
+    class AttributeView {
+        static_assert(sizeof(Element) == sizeof(T) * N, "The element type must have the size of N values of type T");
+        static_assert(is_trivially_copyable<Element>::value, "The element type must be trivially copyable");
+
+    public:
+        typedef Element value_type;
+        typedef const Element* iterator;
+        typedef const Element* const_iterator;
+
+        AttributeView() = default;
+
+        AttributeView(const Element* begin, size_t count, shared_ptr<const void> storage = nullptr)
+            : storage(move(storage)), _begin(begin), _end(begin + count)
+        { }
+
+        const Element* begin() const { return _begin; }
+        const Element* end() const { return _end; }
+        const Element* data() const { return _begin; }
+        size_t size() const { return _end - _begin; }
+        bool empty() const { return _begin == _end; }
+        const Element& operator[](size_t i) const { return _begin[i]; }
+
+        /// The individual values of all elements 
+        const T* values() const { return reinterpret_cast<const T*>(_begin); }
+        size_t num_values() const { return size() * N; }
+
+        shared_ptr<const void> storage;
+
+    private:
+        const Element* _begin = nullptr;
+        const Element* _end = nullptr;
+    };
+
+    /// Manage the data buffer and meta-information of an attribute. 
+    /// The storage, when there is one, keeps the data alive for as long as any copy of the attribute exists.
     struct Attribute {
-        Attribute(const string& desc, const void* begin, const void* end)
+        Attribute(const string& desc, const void* begin, const void* end, shared_ptr<const void> storage = nullptr)
             : descriptor(AttributeDescriptor::from_string(desc))
+            , name(desc)
+            , storage(move(storage))
             , _begin((uint8_t*)begin)
             , _end((uint8_t*)end)
         { 
@@ -249,42 +517,244 @@ namespace g3d
         size_t num_elements() const {
             return byte_size() / data_element_size();
         }
-        bfast::Buffer to_buffer() {
-            return bfast::Buffer{ descriptor.to_string(), bfast::ByteRange { _begin, _end } };
+        bfast::Buffer to_buffer() const {
+            return bfast::Buffer{ descriptor.to_string(), bfast::ByteRange { _begin, _end }, storage };
         }
-        static Attribute from_buffer(bfast::Buffer buffer) {
-            return Attribute(buffer.name, buffer.data.begin(), buffer.data.end());
+        static Attribute from_buffer(const bfast::Buffer& buffer) {
+            return Attribute(buffer.name, buffer.data.begin(), buffer.data.end(), buffer.owner);
+        }
+
+        /// Returns true if each element of the attribute is N values of type T 
+        template<typename T, int N>
+        bool is() const {
+            return descriptor.data_type == data_type_of<T>::value && descriptor.data_arity == N;
         }
+
+        /// Returns a typed view of the elements, throwing if the attribute does not hold N values of type T per element.
+        /// For example: g3d.find(descriptors::Position)->as<float, 3>()
+        template<typename T, int N, typename Element = element_of<T, N>>
+        AttributeView<T, N, Element> as() const {
+            if (!is<T, N>()) throw runtime_error("The attribute data type or arity does not match the requested view");
+            if (reinterpret_cast<uintptr_t>(_begin) % alignof(T) != 0) throw runtime_error("The attribute data is not aligned for the requested view");
+            return AttributeView<T, N, Element>(reinterpret_cast<const Element*>(_begin), num_elements(), storage);
+        }
+
+        /// Writes the values of a float16, float32 or float64 attribute to dst as floats. dst must hold num_elements() * arity values.
+        void to_float32(float* dst, unsigned thread_count = 0) const {
+            auto count = num_elements() * descriptor.data_arity;
+            if (reinterpret_cast<uintptr_t>(_begin) % descriptor.data_type_size() != 0) 
+                throw runtime_error("The attribute data is not aligned for conversion");
+            switch (descriptor.data_type) {
+                case dt_float16: convert::half_to_float(reinterpret_cast<const convert::half*>(_begin), dst, count, thread_count); break;
+                case dt_float32: memcpy(dst, _begin, count * sizeof(float)); break;
+                case dt_float64: convert::double_to_float(reinterpret_cast<const double*>(_begin), dst, count, thread_count); break;
+                default: throw runtime_error("The attribute does not hold floating point values");
+            }
+        }
+
+        /// Returns a new buffer whose element i is the element sources[i] of this attribute 
+        shared_ptr<vector<uint8_t>> gather(const int* sources, size_t count, unsigned thread_count = 0) const {
+            auto size = data_element_size();
+            auto r = make_shared<vector<uint8_t>>(count * size);
+            auto dst = r->data();
+            parallel::for_ranges(count, 1 << 14, [&](size_t begin, size_t end) {
+                for (auto i = begin; i < end; ++i)
+                    memcpy(dst + i * size, _begin + (size_t)sources[i] * size, size);
+            }, thread_count);
+            return r;
+        }
+
+        vector<float> to_float32(unsigned thread_count = 0) const {
+            vector<float> r(num_elements() * descriptor.data_arity);
+            to_float32(r.data(), thread_count);
+            return r;
+        }
+
         AttributeDescriptor descriptor;
+        string name;
+        shared_ptr<const void> storage;
         uint8_t* _begin;
         uint8_t* _end;
     };
 
+    /// The submesh, index and vertex ranges of each mesh. Mesh m uses the submeshes [submesh_offsets[m], submesh_offsets[m + 1]), 
+    /// and likewise for indices and vertices, so each array has one more entry than there are meshes.
+    struct MeshLayout
+    {
+        vector<int> submesh_offsets;
+        vector<int> index_offsets;
+        vector<int> vertex_offsets;
+
+        size_t num_meshes() const {
+            return submesh_offsets.empty() ? 0 : submesh_offsets.size() - 1;
+        }
+
+        /// Derives the layout from the mesh and submesh offsets. When the mesh vertex offsets are not stored, each mesh 
+        /// starts at the smallest vertex its indices refer to, as in the C# G3D class. Offsets are clamped to be ascending and in range.
+        static MeshLayout compute(AttributeView<int, 1> mesh_submesh_offsets, AttributeView<int, 1> submesh_index_offsets, 
+            AttributeView<int, 1> indices, AttributeView<int, 1> mesh_vertex_offsets, size_t num_vertices, unsigned thread_count = 0)
+        {
+            MeshLayout r;
+            auto num_meshes = mesh_submesh_offsets.size();
+            auto num_submeshes = (int)submesh_index_offsets.size();
+            auto num_indices = (int)indices.size();
+            if (num_meshes == 0)
+                return r;
+
+            r.submesh_offsets.resize(num_meshes + 1);
+            r.index_offsets.resize(num_meshes + 1);
+            for (size_t m = 0; m < num_meshes; ++m) {
+                auto previous = m == 0 ? 0 : r.submesh_offsets[m - 1];
+                r.submesh_offsets[m] = max(previous, min(mesh_submesh_offsets[m], num_submeshes));
+                auto submesh = r.submesh_offsets[m];
+                auto index = submesh < num_submeshes ? submesh_index_offsets[submesh] : num_indices;
+                r.index_offsets[m] = max(m == 0 ? 0 : r.index_offsets[m - 1], min(index, num_indices));
+            }
+            r.submesh_offsets[num_meshes] = num_submeshes;
+            r.index_offsets[num_meshes] = num_indices;
+
+            r.vertex_offsets.resize(num_meshes + 1);
+            if (mesh_vertex_offsets.size() == num_meshes) {
+                for (size_t m = 0; m < num_meshes; ++m)
+                    r.vertex_offsets[m] = mesh_vertex_offsets[m];
+            }
+            else {
+                parallel::for_each(num_meshes, [&](size_t m) {
+                    auto lowest = (int)num_vertices;
+                    for (auto i = r.index_offsets[m]; i < r.index_offsets[m + 1]; ++i)
+                        lowest = min(lowest, indices[i]);
+                    r.vertex_offsets[m] = lowest;
+                }, thread_count);
+            }
+            for (size_t m = 0; m < num_meshes; ++m)
+                r.vertex_offsets[m] = max(m == 0 ? 0 : r.vertex_offsets[m - 1], min(r.vertex_offsets[m], (int)num_vertices));
+            r.vertex_offsets[num_meshes] = (int)num_vertices;
+            return r;
+        }
+    };
+
+    /// Quantizes positions to unsigned integers within the bounding box of each vertex range, and back. 
+    /// Each range has 6 bounds values: the minimum x, y and z followed by the maximum x, y and z.
+    struct PositionQuantizer
+    {
+        /// Splits the vertices into ranges that are quantized together, one per mesh. The first range also covers any vertices before the first mesh.
+        /// Returns the boundaries of the ranges, one more than the number of ranges.
+        static vector<size_t> ranges(const int* mesh_vertex_offsets, size_t num_meshes, size_t num_vertices) {
+            vector<size_t> r(max(num_meshes, (size_t)1) + 1, 0);
+            for (size_t m = 1; m < num_meshes; ++m)
+                r[m] = max(r[m - 1], min((size_t)max(mesh_vertex_offsets[m], 0), num_vertices));
+            r.back() = num_vertices;
+            return r;
+        }
+
+        template<typename Q>
+        static void quantize(const float* positions, const vector<size_t>& ranges, Q* out, float* bounds, unsigned thread_count = 0) {
+            const double max_value = (double)numeric_limits<Q>::max();
+            parallel::for_each(ranges.size() - 1, [&](size_t r) {
+                auto b = bounds + r * 6;
+                for (int c = 0; c < 3; ++c) {
+                    b[c] = numeric_limits<float>::max();
+                    b[c + 3] = -numeric_limits<float>::max();
+                }
+                for (auto v = ranges[r]; v < ranges[r + 1]; ++v)
+                    for (int c = 0; c < 3; ++c) {
+                        b[c] = min(b[c], positions[v * 3 + c]);
+                        b[c + 3] = max(b[c + 3], positions[v * 3 + c]);
+                    }
+                if (ranges[r] == ranges[r + 1])
+                    for (int c = 0; c < 6; ++c)
+                        b[c] = 0;
+
+                double scale[3];
+                for (int c = 0; c < 3; ++c) {
+                    auto extent = (double)b[c + 3] - (double)b[c];
+                    scale[c] = extent > 0 ? max_value / extent : 0;
+                }
+                for (auto v = ranges[r]; v < ranges[r + 1]; ++v)
+                    for (int c = 0; c < 3; ++c) {
+                        auto q = ((double)positions[v * 3 + c] - (double)b[c]) * scale[c] + 0.5;
+                        out[v * 3 + c] = (Q)min(max(q, 0.0), max_value);
+                    }
+            }, thread_count);
+        }
+
+        template<typename Q>
+        static void dequantize(const Q* quantized, const vector<size_t>& ranges, const float* bounds, float* out, unsigned thread_count = 0) {
+            const double max_value = (double)numeric_limits<Q>::max();
+            parallel::for_ranges(ranges.back(), 1 << 16, [&](size_t begin, size_t end) {
+                auto r = (size_t)(upper_bound(ranges.begin(), ranges.end(), begin) - ranges.begin()) - 1;
+                while (begin < end) {
+                    while (begin >= ranges[r + 1])
+                        ++r;
+                    auto b = bounds + r * 6;
+                    float origin[3], step[3];
+                    for (int c = 0; c < 3; ++c) {
+                        origin[c] = b[c];
+                        step[c] = (float)(((double)b[c + 3] - (double)b[c]) / max_value);
+                    }
+                    auto last = min(end, ranges[r + 1]);
+                    for (auto v = begin; v < last; ++v)
+                        for (int c = 0; c < 3; ++c)
+                            out[v * 3 + c] = origin[c] + (float)quantized[v * 3 + c] * step[c];
+                    begin = last;
+                }
+            }, thread_count);
+        }
+    };
+
+    /// Options for G3d::write_file 
+    struct WriteOptions
+    {
+        /// Compresses the larger attributes with this codec 
+        bfast::Codec codec = bfast::codec_none;
+
+        /// Applies the shuffle and delta filters to attributes before compressing them 
+        bool filters = true;
+
+        /// dt_float32 stores positions as they are, dt_float16 narrows them, and dt_uint16 or dt_uint32 quantizes them within the bounds of each mesh 
+        DataType position_type = dt_float32;
+
+        /// Narrows vertex normals and uvs to float16 
+        bool float16_normals = false;
+        bool float16_uvs = false;
+
+        /// An attribute is only narrowed to float16 if no value changes by more than this, otherwise it is kept as float32 
+        float float16_max_error = 0.001f;
+    };
+
     // A G3d data structure, is a set of attributes. It is stored internally as a BFast 
+    // Attributes share their data with the BFast and with copies of the G3d, so copying a G3d does not copy the data.
     struct G3d    
     {
         string meta;
         bfast::Bfast bfast;
         std::vector<Attribute> attributes;
 
+        /// Maps the hash of each attribute name to the attribute index 
+        unordered_multimap<bfast::ulong, size_t> name_index;
+
+        /// Maps the hash of each association, semantic and index to the attribute index 
+        unordered_multimap<bfast::ulong, size_t> semantic_index;
+
+        /// False once "attributes" was modified directly and the indices no longer match it 
+        bool index_valid = true;
+
         G3d()
             : meta(default_meta())
         { }
 
-        G3d(bfast::Bfast& inputBfast)
+        /// Shares the data of the Bfast, which is only copied where it has to be decompressed.
+        /// Decompressing and decoding use up to thread_count threads (0 uses every core).
+        G3d(const bfast::Bfast& inputBfast, unsigned thread_count = 0)
+            : bfast(inputBfast)
         {
-            attributes.clear();
-            bfast = inputBfast;
-            for (auto i = 0; i < bfast.buffers.size(); ++i)
-            {
-                auto b = bfast.buffers[i];
-                if (i == 0)
-                    meta = b.data.to_string();
-                else
-                {
-                    add_attribute(b.name, b.data.begin(), b.data.end());
-                }
-            }
+            load_bfast(thread_count);
+        }
+
+        G3d(bfast::Bfast&& inputBfast, unsigned thread_count = 0)
+            : bfast(move(inputBfast))
+        {
+            load_bfast(thread_count);
         }
             
         static string default_meta() {
@@ -292,110 +762,430 @@ namespace g3d
         }
 
         void recompute_bfast() {
-            for (auto attr : attributes)
+            for (const auto& attr : attributes)
                 bfast.buffers.push_back(attr.to_buffer());
+            bfast.build_index();
         }
 
         void write_file(string path) {
+            write_file(path, WriteOptions());
+        }
+
+        /// Writes the G3d to a file, optionally quantizing the positions and compressing the larger attributes 
+        void write_file(string path, const WriteOptions& options) {
             bfast::Bfast b;
             b.add("meta", meta.c_str());
-            for (auto attr : attributes)
+            for (const auto& attr : attributes)
                 b.buffers.push_back(attr.to_buffer());
+            // The buffers are renamed and replaced below, the index is rebuilt once they are final
+            b.invalidate_index();
+            if (options.position_type == dt_uint16)
+                encode_positions<uint16_t>(b, descriptors::PositionQuantized16);
+            else if (options.position_type == dt_uint32)
+                encode_positions<uint32_t>(b, descriptors::PositionQuantized32);
+            else if (options.position_type == dt_float16)
+                encode_float16(b, descriptors::Position, options.float16_max_error);
+            else if (options.position_type != dt_float32)
+                throw runtime_error("Unsupported position type");
+            if (options.float16_normals)
+                encode_float16(b, descriptors::VertexNormal, options.float16_max_error);
+            if (options.float16_uvs) {
+                encode_float16(b, descriptors::VertexUv, options.float16_max_error);
+                encode_float16(b, descriptors::VertexUvw, options.float16_max_error);
+            }
+            b.build_index();
+            if (options.codec != bfast::codec_none && options.filters)
+                b.compress(options.codec, 4096, 0, choose_filters);
+            else if (options.codec != bfast::codec_none)
+                b.compress(options.codec);
             b.write_file(path);
         }
 
-        void read_file(string path)
-        {
-            attributes.clear();
-            bfast = bfast::Bfast::read_file(path);
-            for (auto i = 0; i < bfast.buffers.size(); ++i)
-            {
-                auto b = bfast.buffers[i];
-                if (i == 0)
-                    meta = b.data.to_string();
-                else
-                    add_attribute(b.name, b.data.begin(), b.data.end());
+        /// Picks the compression filters for an attribute: values are shuffled by their size, and index and offset arrays are also delta encoded 
+        static bfast::ulong choose_filters(const bfast::Buffer& buffer, size_t& element_size) {
+            auto desc = DescriptorView::parse(buffer.name);
+            if (!desc.valid())
+                return bfast::filter_none;
+            element_size = AttributeDescriptor::data_type_size(desc.data_type);
+            bfast::ulong filters = bfast::filter_shuffle;
+            auto is_offset = desc.semantic.size() >= 6 && desc.semantic.substr(desc.semantic.size() - 6) == "offset";
+            if ((desc.data_type == dt_int32 || desc.data_type == dt_uint32) && desc.data_arity == 1 && (desc.semantic == "index" || is_offset))
+                filters |= bfast::filter_delta;
+            return filters;
+        }
+
+        /// Returns the number of vertices, taken from the positions 
+        size_t num_vertices() const {
+            if (auto attr = find(assoc_vertex, "position"))
+                return attr->num_elements();
+            return 0;
+        }
+
+        /// Returns the number of corners of each face, taken from g3d:all:facesize, which may be stored as an int8, int16 or int32.
+        /// Faces are triangles when it is missing or not positive.
+        size_t corners_per_face() const {
+            auto face_size = find(descriptors::ObjectFaceSize);
+            if (face_size == nullptr || face_size->num_elements() == 0)
+                return 3;
+            auto n = face_size->is<int8_t, 1>() ? face_size->as<int8_t, 1>()[0] : face_size->is<int16_t, 1>() ? face_size->as<int16_t, 1>()[0]
+                : face_size->is<int, 1>() ? face_size->as<int, 1>()[0] : 0;
+            return n > 0 ? (size_t)n : 3;
+        }
+
+        /// Returns the boundaries of the index ranges of the submeshes, one more than the number of submeshes.
+        /// Without submeshes all the indices are one range. Offsets are clamped to be ascending and in range.
+        vector<size_t> submesh_index_ranges() const {
+            auto offsets = view<int, 1>(descriptors::SubmeshIndexOffset);
+            auto num_indices = view<int, 1>(descriptors::Index).size();
+            vector<size_t> r(max(offsets.size(), (size_t)1) + 1, 0);
+            for (size_t s = 1; s < offsets.size(); ++s)
+                r[s] = max(r[s - 1], min((size_t)max(offsets[s], 0), num_indices));
+            r.back() = num_indices;
+            return r;
+        }
+
+        /// Returns the submesh, index and vertex ranges of each mesh 
+        MeshLayout mesh_layout(unsigned thread_count = 0) const {
+            return MeshLayout::compute(view<int, 1>(descriptors::MeshSubmeshOffset), view<int, 1>(descriptors::SubmeshIndexOffset), 
+                view<int, 1>(descriptors::Index), view<int, 1>(descriptors::MeshVertexOffset), num_vertices(), thread_count);
+        }
+
+        /// Replaces the attributes that are stored encoded by their regular form: float16 attributes are widened to float32, and quantized 
+        /// positions are dequantized and their bounds removed. Only the regular form is kept, so it is the one edited and written back by write_file.
+        /// uint16 and uint32 positions are only taken as quantized when their bounds are present.
+        void decode_attributes(unsigned thread_count = 0) {
+            vector<string> superseded;
+            for (auto& attr : attributes) {
+                if (attr.descriptor.data_type != dt_float16)
+                    continue;
+                auto desc = attr.descriptor;
+                desc.data_type = dt_float32;
+                auto name = desc.to_string();
+                if (find(name) != nullptr) {
+                    superseded.push_back(attr.name);
+                    continue;
+                }
+                auto widened = make_shared<vector<bfast::byte>>(attr.num_elements() * desc.data_arity * sizeof(float));
+                attr.to_float32((float*)widened->data(), thread_count);
+                auto begin = widened->data(), end = begin + widened->size();
+                attr = Attribute(name, begin, end, move(widened));
             }
+            build_index();
+            for (const auto& name : superseded)
+                remove_attribute(name);
+
+            if (find(descriptors::Position) != nullptr)
+                return;
+            if (find<float, 6>(descriptors::MeshPositionBounds) == nullptr && find<float, 6>(descriptors::PositionBounds) == nullptr)
+                return;
+            if (auto attr = find<uint16_t, 3>(descriptors::PositionQuantized16))
+                decode_positions<uint16_t>(*attr, thread_count);
+            else if (auto attr = find<uint32_t, 3>(descriptors::PositionQuantized32))
+                decode_positions<uint32_t>(*attr, thread_count);
         }
 
-        void add_attribute(const string& name, const void* begin, const void* end) {
+        void read_file(string path, bool memoryMapped = false, unsigned thread_count = 0)
+        {
+            bfast = bfast::Bfast::read_file(path, memoryMapped);
+            load_bfast(thread_count);
+        }
+
+        /// Adds an attribute pointing to the given data, which must outlive the G3d unless a storage keeping it alive is given 
+        void add_attribute(const string& name, const void* begin, const void* end, shared_ptr<const void> storage = nullptr) {
+            auto indexed = is_index_valid();
             try
             {
-                attributes.push_back(Attribute(name, begin, end));
+                attributes.push_back(Attribute(name, begin, end, move(storage)));
             } catch (std::exception& e) {
                 e;
                 // do nothing; the attribute was not recognized.
+                return;
             }
+            if (indexed)
+                index_attribute(attributes.size() - 1);
+            else
+                build_index();
         }
 
         void add_attribute(const string& name, void* begin, size_t size) {
             add_attribute(name, begin, (uint8_t*)begin + size);
         }
-    };
 
-    struct descriptors
-    {
-        static constexpr const char* Position = "g3d:vertex:position:0:float32:3";
-        static constexpr const char* Index = "g3d:corner:index:0:int32:1";
-        static constexpr const char* ObjectFaceSize = "g3d:all:facesize:0:int32:1";
+        /// Adds an attribute whose data is kept alive by the G3d 
+        void add_attribute(const string& name, shared_ptr<const vector<bfast::byte>> data) {
+            auto begin = data->data(), end = begin + data->size();
+            add_attribute(name, begin, end, move(data));
+        }
 
-        static constexpr const char* VertexUv = "g3d:vertex:uv:0:float32:2";
-        static constexpr const char* VertexUvw = "g3d:vertex:uv:0:float32:3";
-        static constexpr const char* VertexNormal = "g3d:vertex:normal:0:float32:3";
-        static constexpr const char* VertexColor = "g3d:vertex:color:0:float32:3";
-        static constexpr const char* VertexColorWithAlpha = "g3d:vertex:color:0:float32:4";
-        static constexpr const char* VertexBitangent = "g3d:vertex:bitangent:0:float32:3";
-        static constexpr const char* VertexTangent = "g3d:vertex:tangent:0:float32:3";
-        static constexpr const char* VertexTangent4 = "g3d:vertex:tangent:0:float32:4";
-        static constexpr const char* VertexSelectionWeight = "g3d:vertex:weight:0:float32:1";
+        /// Replaces the data of the attribute with the given descriptor string, keeping its position, or adds it if there is none.
+        /// Empty data removes the attribute.
+        void replace_attribute(const string& name, shared_ptr<const vector<bfast::byte>> data) {
+            if (data->empty()) {
+                remove_attribute(name);
+                return;
+            }
+            for (auto& attr : attributes)
+                if (attr.name == name) {
+                    auto begin = data->data(), end = begin + data->size();
+                    attr = Attribute(name, begin, end, move(data));
+                    return;
+                }
+            add_attribute(name, data);
+        }
 
-        static constexpr const char* FaceMaterial = "g3d:face:material:0:int32:1";
-        static constexpr const char* FaceNormal = "g3d:face:normal:0:float32:3";
-        static constexpr const char* FaceSize = "g3d:face:facesize:0:int32:1";
-        static constexpr const char* FaceIndexOffset = "g3d:face:indexoffset:0:int32:1";
-        static constexpr const char* FaceSelectionWeight = "g3d:face:weight:0:float32:1";
+        /// Removes every attribute with the given descriptor string 
+        void remove_attribute(const string& name) {
+            attributes.erase(remove_if(attributes.begin(), attributes.end(), [&](const Attribute& attr) {
+                return attr.name == name;
+            }), attributes.end());
+            build_index();
+        }
 
-        //VIM 1.0
-        
-        // Meshes
-        static constexpr const char* MeshSubmeshOffset = "g3d:mesh:submeshoffset:0:int32:1";
+        /// Removes the attributes computed from the order of the vertices and corners: the levels of detail (g3d:corner:index:L and
+        /// g3d:submesh:indexoffset:L for L > 0) and the meshlets (g3d:submesh:meshletoffset and g3d:all:meshlet*).
+        /// The passes that renumber vertices or corners call this, and the removed attributes have to be generated again after them.
+        void remove_derived_attributes() {
+            attributes.erase(remove_if(attributes.begin(), attributes.end(), [](const Attribute& attr) {
+                const auto& d = attr.descriptor;
+                return (d.association == assoc_corner && d.semantic == "index" && d.index > 0)
+                    || (d.association == assoc_submesh && d.semantic == "indexoffset" && d.index > 0)
+                    || (d.association == assoc_submesh && d.semantic == "meshletoffset")
+                    || (d.association == assoc_all && d.semantic.compare(0, 7, "meshlet") == 0);
+            }), attributes.end());
+            build_index();
+        }
 
-        // Instances
-        static constexpr const char* InstanceTransform = "g3d:instance:transform:0:float32:16";
-        static constexpr const char* InstanceParent = "g3d:instance:parent:0:int32:1";
-        static constexpr const char* InstanceMesh = "g3d:instance:mesh:0:int32:1";
-        static constexpr const char* InstanceFlags = "g3d:instance:flags:0:uint16:1";
+        void clear_attributes() {
+            attributes.clear();
+            name_index.clear();
+            semantic_index.clear();
+            index_valid = true;
+        }
 
-        // Shapes
-        static constexpr const char* ShapeVertex = "g3d:shapevertex:position:0:float32:3";
-        static constexpr const char* ShapeVertexOffset = "g3d:shape:vertexoffset:0:int32:1";
-        static constexpr const char* ShapeColor = "g3d:shape:color:0:float32:4";
-        static constexpr const char* ShapeWidth = "g3d:shape:width:0:float32:1";
+        /// Rebuilds the attribute indices, needed after modifying "attributes" directly 
+        void build_index() {
+            name_index.clear();
+            semantic_index.clear();
+            for (size_t i = 0; i < attributes.size(); ++i)
+                index_attribute(i);
+            index_valid = true;
+        }
 
-        // Materials
-        static constexpr const char* MaterialColor = "g3d:material:color:0:float32:4";
-        static constexpr const char* MaterialGlossiness = "g3d:material:glossiness:0:float32:1";
-        static constexpr const char* MaterialSmoothness = "g3d:material:smoothness:0:float32:1";
+        /// Marks the indices as out of date after modifying "attributes" directly: lookups scan the attributes until they are rebuilt
+        void invalidate_index() {
+            index_valid = false;
+        }
 
-        // Submeshes
-        static constexpr const char* SubmeshIndexOffset = "g3d:submesh:indexoffset:0:int32:1";
-        static constexpr const char* SubmeshMaterial = "g3d:submesh:material:0:int32:1";
+        /// True if lookups can use the indices. A change in the number of attributes is also detected. 
+        bool is_index_valid() const {
+            return index_valid && name_index.size() == attributes.size() && semantic_index.size() == attributes.size();
+        }
 
-        // https://docs.thinkboxsoftware.com/products/krakatoa/2.6/1_Documentation/manual/formats/particle_channels.html
-        static constexpr const char* PointVelocity = "g3d:vertex:velocity:0:float32:3";
-        static constexpr const char* PointNormal = "g3d:vertex:normal:0:float32:3";
-        static constexpr const char* PointAcceleration = "g3d:vertex:acceleration:0:float32:3";
-        static constexpr const char* PointDensity = "g3d:vertex:density:0:float32:1";
-        static constexpr const char* PointEmissionColor = "g3d:vertex:emission:0:float32:3";
-        static constexpr const char* PointAbsorptionColor = "g3d:vertex:absorption:0:float32:3";
-        static constexpr const char* PointSpin = "g3d:vertex:spin:0:float32:4";
-        static constexpr const char* PointOrientation = "g3d:vertex:orientation:0:float32:4";
-        static constexpr const char* PointParticleId = "g3d:vertex:particleid:0:int32:1";
-        static constexpr const char* PointAge = "g3d:vertex:age:0:int32:1";
+        /// Returns the attribute with the given descriptor string, or nullptr if there is none 
+        const Attribute* find(const char* name, size_t length) const {
+            if (!is_index_valid()) {
+                for (const auto& attr : attributes)
+                    if (attr.name.size() == length && memcmp(attr.name.data(), name, length) == 0)
+                        return &attr;
+                return nullptr;
+            }
+            const Attribute* r = nullptr;
+            auto range = name_index.equal_range(bfast::hash_name(name, length));
+            for (auto it = range.first; it != range.second; ++it) {
+                const auto& attr = attributes[it->second];
+                if ((r == nullptr || &attr < r) && attr.name.size() == length && memcmp(attr.name.data(), name, length) == 0)
+                    r = &attr;
+            }
+            return r;
+        }
 
-        // Line specific attributes 
-        static constexpr const char* LineTangentIn = "g3d:vertex:tangent:0:float32:3";
-        static constexpr const char* LineTangentOut = "g3d:vertex:tangent:1:float32:3";
+        const Attribute* find(const char* name) const {
+            return find(name, strlen(name));
+        }
+
+        const Attribute* find(const string& name) const {
+            return find(name.data(), name.size());
+        }
+
+        /// Returns the attribute with the given descriptor string if it stores N values of type T per element, or nullptr otherwise.
+        /// For example: g3d.find<float, 3>(descriptors::Position)
+        template<typename T, int N>
+        const Attribute* find(const char* name) const {
+            auto attr = find(name);
+            if (attr == nullptr || !attr->is<T, N>())
+                return nullptr;
+            return attr;
+        }
+
+        /// Returns a typed view of the attribute with the given descriptor string, or an empty view if there is none. 
+        /// Throws if the attribute does not hold N values of type T per element.
+        /// For example: for (auto& p : g3d.view<float, 3>(descriptors::Position)) ...
+        template<typename T, int N, typename Element = element_of<T, N>>
+        AttributeView<T, N, Element> view(const char* name) const {
+            auto attr = find(name);
+            if (attr == nullptr)
+                return AttributeView<T, N, Element>();
+            return attr->as<T, N, Element>();
+        }
+
+        /// Returns the attribute with the given association, semantic and index, or nullptr if there is none 
+        const Attribute* find(Association association, const char* semantic, int index = 0) const {
+            auto length = strlen(semantic);
+            auto matches = [&](const Attribute& attr) {
+                return attr.descriptor.association == association
+                    && attr.descriptor.index == index
+                    && attr.descriptor.semantic.size() == length
+                    && memcmp(attr.descriptor.semantic.data(), semantic, length) == 0;
+            };
+            if (!is_index_valid()) {
+                for (const auto& attr : attributes)
+                    if (matches(attr))
+                        return &attr;
+                return nullptr;
+            }
+            const Attribute* r = nullptr;
+            auto range = semantic_index.equal_range(semantic_key(association, semantic, length, index));
+            for (auto it = range.first; it != range.second; ++it) {
+                const auto& attr = attributes[it->second];
+                if ((r == nullptr || &attr < r) && matches(attr))
+                    r = &attr;
+            }
+            return r;
+        }
+
+        static bfast::ulong semantic_key(Association association, const char* semantic, size_t length, int index) {
+            auto h = bfast::hash_name(semantic, length);
+            h ^= (bfast::ulong)association * 0x9E3779B97F4A7C15ull;
+            h ^= (bfast::ulong)(uint32_t)index * 0xC2B2AE3D27D4EB4Full;
+            return h;
+        }
+
+    private:
+        /// Decompresses the bfast and creates the attributes from its buffers, the first of which is the meta data 
+        void load_bfast(unsigned thread_count) {
+            clear_attributes();
+            bfast.decompress(thread_count);
+            for (size_t i = 0; i < bfast.buffers.size(); ++i)
+            {
+                const auto& b = bfast.buffers[i];
+                if (i == 0)
+                    meta = string(b.data.begin(), b.data.end());
+                else
+                    add_attribute(b.name, b.data.begin(), b.data.end(), b.owner);
+            }
+            decode_attributes(thread_count);
+        }
+
+        /// Replaces a float32 attribute in the bfast being written by a float16 one, unless a value would change by more than max_error 
+        void encode_float16(bfast::Bfast& b, const char* name, float max_error, unsigned thread_count = 0) {
+            auto attr = find(name);
+            if (attr == nullptr || attr->descriptor.data_type != dt_float32)
+                return;
+            // A float16 form added next to the float32 one would be written twice, the stale copy winning on the next read
+            auto encoded = attr->descriptor;
+            encoded.data_type = dt_float16;
+            erase_buffers(b, { encoded.to_string() });
+            auto values = attr->to_float32(thread_count);
+            auto narrowed = make_shared<vector<bfast::byte>>(values.size() * sizeof(convert::half));
+            auto halves = (convert::half*)narrowed->data();
+
+            // Narrows and widens back in small blocks to measure the error without a second full size buffer
+            const size_t block = 1024;
+            auto num_blocks = (values.size() + block - 1) / block;
+            vector<char> ok(num_blocks, 1);
+            parallel::for_ranges(num_blocks, 64, [&](size_t first, size_t last) {
+                float check[block];
+                for (auto k = first; k < last; ++k) {
+                    auto begin = k * block;
+                    auto count = min(block, values.size() - begin);
+                    convert::float_to_half(values.data() + begin, halves + begin, count, 1);
+                    convert::half_to_float(halves + begin, check, count, 1);
+                    for (size_t i = 0; i < count; ++i)
+                        if (!(fabs(check[i] - values[begin + i]) <= max_error))
+                            ok[k] = 0;
+                }
+            }, thread_count);
+            if (std::find(ok.begin(), ok.end(), 0) != ok.end())
+                return;
+
+            auto desc = attr->descriptor;
+            auto stored_name = desc.to_string();
+            desc.data_type = dt_float16;
+            for (auto& buffer : b.buffers)
+                if (buffer.name == stored_name)
+                    buffer = bfast::Buffer{ desc.to_string(), bfast::ByteRange{ narrowed->data(), narrowed->data() + narrowed->size() }, narrowed };
+        }
+
+        /// Replaces the positions in the bfast being written by positions quantized within the bounds of each mesh 
+        template<typename Q>
+        void encode_positions(bfast::Bfast& b, const char* quantized_name, unsigned thread_count = 0) {
+            auto positions = view<float, 3>(descriptors::Position);
+            if (positions.empty())
+                return;
+            auto layout = mesh_layout(thread_count);
+            auto num_meshes = layout.num_meshes();
+            auto ranges = PositionQuantizer::ranges(layout.vertex_offsets.data(), num_meshes, positions.size());
+
+            auto quantized = make_shared<vector<bfast::byte>>(positions.num_values() * sizeof(Q));
+            auto bounds = make_shared<vector<bfast::byte>>((ranges.size() - 1) * 6 * sizeof(float));
+            PositionQuantizer::quantize(positions.values(), ranges, (Q*)quantized->data(), (float*)bounds->data(), thread_count);
+
+            // Any encoded positions already in the G3d are replaced too, so that only the current positions are written
+            auto& buffers = b.buffers;
+            erase_buffers(b, { descriptors::Position, descriptors::PositionQuantized16, descriptors::PositionQuantized32, 
+                descriptors::MeshPositionBounds, descriptors::PositionBounds });
+            buffers.push_back(bfast::Buffer{ quantized_name, bfast::ByteRange{ quantized->data(), quantized->data() + quantized->size() }, quantized });
+            buffers.push_back(bfast::Buffer{ num_meshes > 0 ? descriptors::MeshPositionBounds : descriptors::PositionBounds, 
+                bfast::ByteRange{ bounds->data(), bounds->data() + bounds->size() }, bounds });
+            if (num_meshes > 0 && find(descriptors::MeshVertexOffset) == nullptr) {
+                auto offsets = make_shared<vector<bfast::byte>>(num_meshes * sizeof(int));
+                memcpy(offsets->data(), layout.vertex_offsets.data(), offsets->size());
+                buffers.push_back(bfast::Buffer{ descriptors::MeshVertexOffset, bfast::ByteRange{ offsets->data(), offsets->data() + offsets->size() }, offsets });
+            }
+        }
+
+        static void erase_buffers(bfast::Bfast& b, const vector<string>& names) {
+            b.buffers.erase(remove_if(b.buffers.begin(), b.buffers.end(), [&](const bfast::Buffer& buffer) {
+                return std::find(names.begin(), names.end(), buffer.name) != names.end();
+            }), b.buffers.end());
+        }
+
+        /// Replaces quantized positions by the float32 positions and removes their bounds 
+        template<typename Q>
+        void decode_positions(const Attribute& attr, unsigned thread_count) {
+            auto quantized = attr.as<Q, 3>();
+            vector<size_t> ranges;
+            const float* bounds = nullptr;
+            auto mesh_bounds = view<float, 6>(descriptors::MeshPositionBounds);
+            if (!mesh_bounds.empty()) {
+                auto offsets = view<int, 1>(descriptors::MeshVertexOffset);
+                if (offsets.size() != mesh_bounds.size())
+                    throw runtime_error("The quantized positions do not have one bounding box per mesh");
+                ranges = PositionQuantizer::ranges(offsets.data(), offsets.size(), quantized.size());
+                bounds = mesh_bounds.values();
+            }
+            else {
+                auto all_bounds = view<float, 6>(descriptors::PositionBounds);
+                if (all_bounds.size() != 1)
+                    throw runtime_error("The quantized positions do not have a bounding box");
+                ranges = { 0, quantized.size() };
+                bounds = all_bounds.values();
+            }
+
+            auto decoded = make_shared<vector<bfast::byte>>(quantized.num_values() * sizeof(float));
+            PositionQuantizer::dequantize(quantized.values(), ranges, bounds, (float*)decoded->data(), thread_count);
+            auto begin = decoded->data(), end = begin + decoded->size();
+            attributes[&attr - attributes.data()] = Attribute(descriptors::Position, begin, end, move(decoded));
+            remove_attribute(descriptors::MeshPositionBounds);
+            remove_attribute(descriptors::PositionBounds);
+        }
+
+        void index_attribute(size_t i) {
+            const auto& attr = attributes[i];
+            name_index.emplace(bfast::hash_name(attr.name.data(), attr.name.size()), i);
+            const auto& desc = attr.descriptor;
+            semantic_index.emplace(semantic_key(desc.association, desc.semantic.data(), desc.semantic.size(), desc.index), i);
+        }
     };
 }
 
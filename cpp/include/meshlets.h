@@ -0,0 +1,225 @@
+/*
+    Splits G3D submeshes into small clusters of triangles (meshlets) with bounds for cluster culling
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __MESHLETS_H__
+#define __MESHLETS_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "g3d.h"
+#include "bounds.h"
+#include "parallel.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    struct MeshletOptions
+    {
+        /// At most 256, since triangles refer to the vertices of their meshlet with 8 bit indices
+        int max_vertices = 64;
+        int max_triangles = 124;
+    };
+
+    /// The meshlets of every submesh. Meshlets never cross submeshes, so each one has a single material.
+    /// Submesh s has the meshlets [submesh_offsets[s], submesh_offsets[s + 1]), the last submesh ending at size().
+    /// Meshlet m uses the vertices [vertex_offsets[m], vertex_offsets[m + 1]) of vertices, which are indices into the G3d vertices,
+    /// and the triangles [triangle_offsets[m], triangle_offsets[m + 1]) of triangles, whose values index the vertices of the meshlet.
+    struct Meshlets
+    {
+        static constexpr const char* SubmeshMeshletOffset = "g3d:submesh:meshletoffset:0:int32:1";
+        static constexpr const char* VertexOffset = "g3d:all:meshletvertexoffset:0:int32:1";
+        static constexpr const char* Vertex = "g3d:all:meshletvertex:0:int32:1";
+        static constexpr const char* TriangleOffset = "g3d:all:meshlettriangleoffset:0:int32:1";
+        static constexpr const char* Triangle = "g3d:all:meshlettriangle:0:uint8:3";
+        static constexpr const char* Sphere = "g3d:all:meshletsphere:0:float32:4";
+        static constexpr const char* Cone = "g3d:all:meshletcone:0:float32:4";
+
+        vector<int> submesh_offsets;
+        vector<int> vertex_offsets;
+        vector<int> vertices;
+        vector<int> triangle_offsets;
+        vector<Vector<uint8_t, 3>> triangles;
+
+        /// The bounding sphere of each meshlet: center and radius
+        vector<Vector<float, 4>> spheres;
+
+        /// The normal cone of each meshlet: the average normal direction and the cutoff used by backfacing()
+        vector<Vector<float, 4>> cones;
+
+        size_t size() const { return spheres.size(); }
+
+        /// Splits the triangles of each submesh, in order, into meshlets. Runs of nearby triangles make tighter meshlets,
+        /// so running optimize_vertex_cache first helps. Submeshes are processed in parallel.
+        /// The stored meshlets refer to the vertices by index, so weld_vertices, optimize_vertex_cache and deduplicate_meshes remove them:
+        /// run those first.
+        static Meshlets build(const G3d& g3d, const MeshletOptions& options = MeshletOptions(), unsigned thread_count = 0) {
+            auto positions = g3d.view<float, 3>(descriptors::Position);
+            auto indices = g3d.view<int, 1>(descriptors::Index);
+            auto max_vertices = (size_t)max(3, min(options.max_vertices, 256));
+            auto max_triangles = (size_t)max(1, options.max_triangles);
+            for (auto i : indices)
+                if (i < 0 || (size_t)i >= positions.size())
+                    throw runtime_error("An index is out of the range of the vertices");
+
+            auto ranges = g3d.submesh_index_ranges();
+            auto num_submeshes = ranges.size() - 1;
+            vector<Meshlets> parts(num_submeshes);
+            parallel::for_each(num_submeshes, [&](size_t s) {
+                auto& part = parts[s];
+                auto begin = ranges[s], end = ranges[s] + (ranges[s + 1] - ranges[s]) / 3 * 3;
+                for (auto t = begin; t < end; t += 3) {
+                    // Starts a new meshlet when the triangle's new vertices or the triangle itself would not fit
+                    size_t added = 0;
+                    auto first = part.vertex_offsets.empty() ? 0 : (size_t)part.vertex_offsets.back();
+                    auto open = !part.vertex_offsets.empty();
+                    if (open)
+                        for (int c = 0; c < 3; ++c)
+                            added += find(part.vertices.begin() + first, part.vertices.end(), indices[t + c]) == part.vertices.end();
+                    if (!open || part.vertices.size() - first + added > max_vertices || part.triangles.size() - part.triangle_offsets.back() >= max_triangles) {
+                        part.vertex_offsets.push_back((int)part.vertices.size());
+                        part.triangle_offsets.push_back((int)part.triangles.size());
+                        first = part.vertices.size();
+                    }
+                    Vector<uint8_t, 3> local;
+                    for (int c = 0; c < 3; ++c) {
+                        auto it = find(part.vertices.begin() + first, part.vertices.end(), indices[t + c]);
+                        local[c] = (uint8_t)(it - part.vertices.begin() - first);
+                        if (it == part.vertices.end())
+                            part.vertices.push_back(indices[t + c]);
+                    }
+                    part.triangles.push_back(local);
+                }
+                for (size_t m = 0; m < part.vertex_offsets.size(); ++m)
+                    part.compute_bounds(m, positions.values(), m + 1 < part.vertex_offsets.size() ? part.vertex_offsets[m + 1] : (int)part.vertices.size(),
+                        m + 1 < part.triangle_offsets.size() ? part.triangle_offsets[m + 1] : (int)part.triangles.size());
+            }, thread_count);
+
+            Meshlets r;
+            for (auto& part : parts) {
+                r.submesh_offsets.push_back((int)r.size());
+                for (auto offset : part.vertex_offsets)
+                    r.vertex_offsets.push_back(offset + (int)r.vertices.size());
+                for (auto offset : part.triangle_offsets)
+                    r.triangle_offsets.push_back(offset + (int)r.triangles.size());
+                r.vertices.insert(r.vertices.end(), part.vertices.begin(), part.vertices.end());
+                r.triangles.insert(r.triangles.end(), part.triangles.begin(), part.triangles.end());
+                r.spheres.insert(r.spheres.end(), part.spheres.begin(), part.spheres.end());
+                r.cones.insert(r.cones.end(), part.cones.begin(), part.cones.end());
+            }
+            return r;
+        }
+
+        /// True if every triangle of the meshlet faces away from the camera, so it can be culled.
+        /// This is the conservative test dot(center - camera, axis) >= cutoff * |center - camera| + radius, where the cutoff is the sine
+        /// of the half angle of the normal cone, or 1 when the normals are spread over more than a half sphere and the test never passes.
+        bool backfacing(size_t meshlet, const float camera[3]) const {
+            const auto& sphere = spheres[meshlet];
+            const auto& cone = cones[meshlet];
+            float d[3] = { sphere[0] - camera[0], sphere[1] - camera[1], sphere[2] - camera[2] };
+            auto distance = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            return d[0] * cone[0] + d[1] * cone[1] + d[2] * cone[2] >= cone[3] * distance + sphere[3];
+        }
+
+        /// Reads the meshlets stored by store(). Returns false, leaving them empty, if the G3d does not have them.
+        /// Throws if they are inconsistent with each other or refer to vertices that the G3d does not have.
+        bool load(const G3d& g3d) {
+            auto assign = [](auto& values, auto view) { values.assign(view.begin(), view.end()); };
+            assign(submesh_offsets, g3d.view<int, 1>(SubmeshMeshletOffset));
+            assign(vertex_offsets, g3d.view<int, 1>(VertexOffset));
+            assign(vertices, g3d.view<int, 1>(Vertex));
+            assign(triangle_offsets, g3d.view<int, 1>(TriangleOffset));
+            assign(triangles, g3d.view<uint8_t, 3>(Triangle));
+            assign(spheres, g3d.view<float, 4>(Sphere));
+            assign(cones, g3d.view<float, 4>(Cone));
+            if (vertex_offsets.size() != size() || triangle_offsets.size() != size() || cones.size() != size())
+                throw runtime_error("The stored meshlets are inconsistent");
+            for (size_t m = 0; m < size(); ++m) {
+                auto vertex_end = m + 1 < size() ? vertex_offsets[m + 1] : (int)vertices.size();
+                auto triangle_end = m + 1 < size() ? triangle_offsets[m + 1] : (int)triangles.size();
+                if (vertex_offsets[m] < 0 || vertex_offsets[m] > vertex_end || triangle_offsets[m] < 0 || triangle_offsets[m] > triangle_end)
+                    throw runtime_error("The stored meshlets are inconsistent");
+                for (auto t = triangle_offsets[m]; t < triangle_end; ++t)
+                    for (int c = 0; c < 3; ++c)
+                        if (triangles[t][c] >= vertex_end - vertex_offsets[m])
+                            throw runtime_error("The stored meshlets are inconsistent");
+            }
+            auto num_vertices = g3d.num_vertices();
+            for (auto v : vertices)
+                if (v < 0 || (size_t)v >= num_vertices)
+                    throw runtime_error("The stored meshlets are inconsistent");
+            for (size_t s = 0; s < submesh_offsets.size(); ++s)
+                if (submesh_offsets[s] < (s > 0 ? submesh_offsets[s - 1] : 0) || (size_t)submesh_offsets[s] > size())
+                    throw runtime_error("The stored meshlets are inconsistent");
+            return size() > 0;
+        }
+
+        /// Adds the meshlets to the G3d as attributes, replacing any that are already there
+        void store(G3d& g3d) const {
+            auto store = [&](const char* name, const auto& values) {
+                auto data = (const bfast::byte*)values.data();
+                g3d.replace_attribute(name, make_shared<vector<bfast::byte>>(data, data + values.size() * sizeof(values[0])));
+            };
+            store(SubmeshMeshletOffset, submesh_offsets);
+            store(VertexOffset, vertex_offsets);
+            store(Vertex, vertices);
+            store(TriangleOffset, triangle_offsets);
+            store(Triangle, triangles);
+            store(Sphere, spheres);
+            store(Cone, cones);
+        }
+
+    private:
+        void compute_bounds(size_t m, const float* positions, int vertex_end, int triangle_end) {
+            // The sphere around the bounding box of the vertices
+            auto box = AABB::empty();
+            for (auto v = vertex_offsets[m]; v < vertex_end; ++v)
+                box.add(positions + (size_t)vertices[v] * 3);
+            float center[3] = { box.center(0), box.center(1), box.center(2) };
+            auto radius = 0.0f;
+            for (auto v = vertex_offsets[m]; v < vertex_end; ++v) {
+                auto p = positions + (size_t)vertices[v] * 3;
+                auto dx = p[0] - center[0], dy = p[1] - center[1], dz = p[2] - center[2];
+                radius = max(radius, sqrt(dx * dx + dy * dy + dz * dz));
+            }
+            spheres.push_back(Vector<float, 4>{ { center[0], center[1], center[2], radius } });
+
+            // The cone around the unit normals of the triangles, with its axis along their average
+            vector<Vector<float, 3>> normals;
+            double axis[3] = { 0, 0, 0 };
+            for (auto t = triangle_offsets[m]; t < triangle_end; ++t) {
+                const float* p[3];
+                for (int c = 0; c < 3; ++c)
+                    p[c] = positions + (size_t)vertices[vertex_offsets[m] + triangles[t][c]] * 3;
+                double e1[3], e2[3];
+                for (int c = 0; c < 3; ++c) {
+                    e1[c] = (double)p[1][c] - p[0][c];
+                    e2[c] = (double)p[2][c] - p[0][c];
+                }
+                double n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+                auto length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                if (length == 0)
+                    continue;
+                normals.push_back(Vector<float, 3>{ { (float)(n[0] / length), (float)(n[1] / length), (float)(n[2] / length) } });
+                for (int c = 0; c < 3; ++c)
+                    axis[c] += n[c] / length;
+            }
+            auto length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+            if (normals.empty() || length == 0) {
+                cones.push_back(Vector<float, 4>{ { 0, 0, 0, 1 } });
+                return;
+            }
+            auto min_dot = 1.0;
+            for (const auto& n : normals)
+                min_dot = min(min_dot, (n[0] * axis[0] + n[1] * axis[1] + n[2] * axis[2]) / length);
+            auto cutoff = min_dot <= 0 ? 1.0 : sqrt(1 - min_dot * min_dot);
+            cones.push_back(Vector<float, 4>{ { (float)(axis[0] / length), (float)(axis[1] / length), (float)(axis[2] / length), (float)cutoff } });
+        }
+    };
+}
+
+#endif
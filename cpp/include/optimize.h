@@ -0,0 +1,282 @@
+/*
+    Reorders G3D triangles and vertices for GPU vertex cache and vertex fetch locality
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __OPTIMIZE_H__
+#define __OPTIMIZE_H__
+
+#include <vector>
+#include <algorithm>
+#include "g3d.h"
+#include "parallel.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// Post-transform vertex cache behaviour of an index buffer, simulated with a FIFO cache
+    struct VertexCacheStats
+    {
+        size_t triangles = 0;
+        size_t vertices = 0;
+        size_t misses = 0;
+
+        /// Average cache miss ratio: transformed vertices per triangle, between 0.5 and 3
+        double acmr() const { return triangles == 0 ? 0 : (double)misses / triangles; }
+
+        /// Average transform to vertex ratio: transformed vertices per referenced vertex, 1 at best
+        double atvr() const { return vertices == 0 ? 0 : (double)misses / vertices; }
+    };
+
+    struct VertexCacheReport
+    {
+        VertexCacheStats before;
+        VertexCacheStats after;
+    };
+
+    /// The smallest and largest index of a range of indices, used to address per vertex arrays with local ids
+    struct IndexSpan
+    {
+        int first = 0;
+        int count = 0;
+
+        IndexSpan(const int* indices, size_t num_indices) {
+            if (num_indices == 0)
+                return;
+            auto lo = indices[0], hi = indices[0];
+            for (size_t i = 1; i < num_indices; ++i) {
+                lo = min(lo, indices[i]);
+                hi = max(hi, indices[i]);
+            }
+            first = lo;
+            count = hi - lo + 1;
+        }
+    };
+
+    /// Counts the misses of a FIFO vertex cache of cache_size entries over a triangle list
+    inline size_t vertex_cache_misses(const int* indices, size_t num_indices, unsigned cache_size)
+    {
+        IndexSpan span(indices, num_indices);
+        // A vertex is cached while fewer than cache_size misses happened since it was loaded
+        vector<size_t> loaded(span.count, 0);
+        size_t misses = 0;
+        for (size_t i = 0; i < num_indices; ++i) {
+            auto& stamp = loaded[indices[i] - span.first];
+            if (stamp == 0 || misses - stamp >= cache_size)
+                stamp = ++misses;
+        }
+        return misses;
+    }
+
+    /// Reorders the triangles of a triangle list for vertex cache locality with the Tipsify algorithm
+    /// (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw", 2007).
+    /// Writes the new order of the original triangles to triangle_order.
+    inline void tipsify(const int* indices, size_t num_indices, unsigned cache_size, vector<int>& triangle_order)
+    {
+        auto num_triangles = num_indices / 3;
+        triangle_order.clear();
+        triangle_order.reserve(num_triangles);
+        IndexSpan span(indices, num_triangles * 3);
+        auto n = (size_t)span.count;
+
+        // The triangles using each vertex
+        vector<int> offsets(n + 1, 0);
+        for (size_t i = 0; i < num_triangles * 3; ++i)
+            ++offsets[indices[i] - span.first + 1];
+        for (size_t v = 0; v < n; ++v)
+            offsets[v + 1] += offsets[v];
+        vector<int> adjacency(num_triangles * 3);
+        {
+            auto next = offsets;
+            for (size_t i = 0; i < num_triangles * 3; ++i)
+                adjacency[next[indices[i] - span.first]++] = (int)(i / 3);
+        }
+
+        vector<int> live(n);
+        for (size_t v = 0; v < n; ++v)
+            live[v] = offsets[v + 1] - offsets[v];
+        vector<int> cache_time(n, 0);
+        vector<char> emitted(num_triangles, 0);
+        vector<int> dead_end;
+        vector<int> candidates;
+        int time = (int)cache_size + 1;
+        int cursor = 0;
+        int fan = -1;
+        for (; fan < 0 && cursor < (int)n; ++cursor)
+            if (live[cursor] > 0)
+                fan = cursor;
+
+        while (fan >= 0) {
+            candidates.clear();
+            for (auto a = offsets[fan]; a < offsets[fan + 1]; ++a) {
+                auto t = adjacency[a];
+                if (emitted[t])
+                    continue;
+                emitted[t] = 1;
+                triangle_order.push_back(t);
+                for (int c = 0; c < 3; ++c) {
+                    auto v = indices[t * 3 + c] - span.first;
+                    dead_end.push_back(v);
+                    candidates.push_back(v);
+                    --live[v];
+                    if (time - cache_time[v] > (int)cache_size)
+                        cache_time[v] = time++;
+                }
+            }
+
+            // The next fanning vertex is the candidate that will stay in the cache the longest while its remaining triangles are emitted
+            fan = -1;
+            auto best = -1;
+            for (auto v : candidates) {
+                if (live[v] <= 0)
+                    continue;
+                auto priority = 0;
+                if (time - cache_time[v] + 2 * live[v] <= (int)cache_size)
+                    priority = time - cache_time[v];
+                if (priority > best) {
+                    best = priority;
+                    fan = v;
+                }
+            }
+            if (fan >= 0)
+                continue;
+            // Otherwise a recently used vertex with triangles left, or the next vertex in order
+            while (!dead_end.empty() && fan < 0) {
+                auto v = dead_end.back();
+                dead_end.pop_back();
+                if (live[v] > 0)
+                    fan = v;
+            }
+            for (; fan < 0 && cursor < (int)n; ++cursor)
+                if (live[cursor] > 0)
+                    fan = cursor;
+        }
+    }
+
+    /// Returns the cache statistics of the triangles of every submesh, with the cache emptied at the start of each submesh
+    inline VertexCacheStats vertex_cache_stats(const G3d& g3d, unsigned cache_size = 16, unsigned thread_count = 0)
+    {
+        VertexCacheStats r;
+        auto indices = g3d.view<int, 1>(descriptors::Index);
+        auto ranges = g3d.submesh_index_ranges();
+        vector<size_t> misses(ranges.size() - 1);
+        parallel::for_each(misses.size(), [&](size_t s) {
+            auto begin = ranges[s];
+            auto count = (ranges[s + 1] - begin) / 3 * 3;
+            misses[s] = vertex_cache_misses(indices.data() + begin, count, cache_size);
+        }, thread_count);
+        vector<char> used(g3d.num_vertices(), 0);
+        for (size_t s = 0; s + 1 < ranges.size(); ++s) {
+            r.misses += misses[s];
+            r.triangles += (ranges[s + 1] - ranges[s]) / 3;
+        }
+        for (auto i : indices)
+            if (i >= 0 && (size_t)i < used.size() && !used[i]) {
+                used[i] = 1;
+                ++r.vertices;
+            }
+        return r;
+    }
+
+    /// Reorders the triangles of each submesh for post-transform vertex cache hits, then the vertices of each mesh in order of first use
+    /// for vertex fetch locality. Vertex, corner and face attributes are remapped to match, so the rendered geometry does not change.
+    /// Vertices stay within the vertex range of their mesh. Files with faces that are not triangles are left unchanged.
+    /// The levels of detail and meshlets refer to the old vertex order and are removed, so they have to be generated after this.
+    inline VertexCacheReport optimize_vertex_cache(G3d& g3d, unsigned cache_size = 16, unsigned thread_count = 0)
+    {
+        VertexCacheReport report;
+        report.before = vertex_cache_stats(g3d, cache_size, thread_count);
+        auto index_attr = g3d.find(descriptors::Index);
+        auto face_size = g3d.view<int, 1>(descriptors::ObjectFaceSize);
+        if (index_attr == nullptr || index_attr->num_elements() % 3 != 0 || (!face_size.empty() && face_size[0] != 3)) {
+            report.after = report.before;
+            return report;
+        }
+        auto indices = index_attr->as<int, 1>();
+        auto num_vertices = g3d.num_vertices();
+        for (auto i : indices)
+            if (i < 0 || (size_t)i >= num_vertices)
+                throw runtime_error("An index is out of the range of the vertices");
+
+        // Triangle order: a permutation of the triangles that keeps each submesh in place
+        auto ranges = g3d.submesh_index_ranges();
+        vector<int> corner_sources(indices.size());
+        parallel::for_each(ranges.size() - 1, [&](size_t s) {
+            auto begin = ranges[s];
+            auto count = ranges[s + 1] - begin;
+            vector<int> order;
+            tipsify(indices.data() + begin, count, cache_size, order);
+            size_t k = begin;
+            for (auto t : order)
+                for (int c = 0; c < 3; ++c)
+                    corner_sources[k++] = (int)begin + t * 3 + c;
+            // Corners of a trailing partial triangle stay where they are
+            for (; k < begin + count; ++k)
+                corner_sources[k] = (int)k;
+        }, thread_count);
+
+        // Vertex order: within each mesh's vertex range, the vertices its indices use in order of first use, then the unused ones
+        auto layout = g3d.mesh_layout(thread_count);
+        vector<int> vertex_sources(num_vertices);
+        vector<int> new_index_of(num_vertices, -1);
+        auto vertex_offsets = layout.vertex_offsets;
+        auto index_offsets = layout.index_offsets;
+        if (layout.num_meshes() == 0) {
+            vertex_offsets = { 0, (int)num_vertices };
+            index_offsets = { 0, (int)indices.size() };
+        }
+        vertex_offsets[0] = 0;
+        parallel::for_each(vertex_offsets.size() - 1, [&](size_t m) {
+            auto first = vertex_offsets[m], last = vertex_offsets[m + 1];
+            auto next = first;
+            for (auto k = index_offsets[m]; k < index_offsets[m + 1]; ++k) {
+                auto v = indices[corner_sources[k]];
+                if (v >= first && v < last && new_index_of[v] < 0) {
+                    new_index_of[v] = next;
+                    vertex_sources[next++] = v;
+                }
+            }
+            for (auto v = first; v < last; ++v)
+                if (new_index_of[v] < 0) {
+                    new_index_of[v] = next;
+                    vertex_sources[next++] = v;
+                }
+        }, thread_count);
+
+        auto new_indices = make_shared<vector<bfast::byte>>(indices.size() * sizeof(int));
+        auto new_index_values = (int*)new_indices->data();
+        parallel::for_ranges(indices.size(), 1 << 16, [&](size_t begin, size_t end) {
+            for (auto k = begin; k < end; ++k)
+                new_index_values[k] = new_index_of[indices[corner_sources[k]]];
+        }, thread_count);
+
+        vector<int> face_sources(indices.size() / 3);
+        for (size_t f = 0; f < face_sources.size(); ++f)
+            face_sources[f] = corner_sources[f * 3] / 3;
+
+        // Gathers every remapped attribute before replacing any, since replacing invalidates the attribute references
+        vector<pair<string, shared_ptr<vector<bfast::byte>>>> replaced;
+        for (const auto& attr : g3d.attributes) {
+            if (&attr == index_attr || attr.num_elements() == 0)
+                continue;
+            auto association = attr.descriptor.association;
+            if (association == assoc_vertex && attr.num_elements() == num_vertices)
+                replaced.emplace_back(attr.name, attr.gather(vertex_sources.data(), vertex_sources.size(), thread_count));
+            else if (association == assoc_corner && attr.num_elements() == indices.size())
+                replaced.emplace_back(attr.name, attr.gather(corner_sources.data(), corner_sources.size(), thread_count));
+            else if (association == assoc_face && attr.num_elements() == face_sources.size())
+                replaced.emplace_back(attr.name, attr.gather(face_sources.data(), face_sources.size(), thread_count));
+        }
+        replaced.emplace_back(index_attr->name, new_indices);
+        for (auto& r : replaced)
+            g3d.replace_attribute(r.first, r.second);
+        g3d.remove_derived_attributes();
+
+        report.after = vertex_cache_stats(g3d, cache_size, thread_count);
+        return report;
+    }
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+    Parallel loop helpers shared by the BFAST, G3D and VIM headers
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+
+// The threading headers are not available to code compiled with /clr, in which case every loop runs serially.
+#ifndef _M_CEE
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+namespace parallel
+{
+    // Returns the number of threads to use when the caller asks for 0 (meaning "as many as there are cores")
+    inline unsigned resolve_thread_count(unsigned thread_count)
+    {
+#ifdef _M_CEE
+        return 1;
+#else
+        if (thread_count == 0)
+            thread_count = std::thread::hardware_concurrency();
+        return thread_count == 0 ? 1 : thread_count;
+#endif
+    }
+
+    // Calls f(i) for every i in [0, count), spreading the calls over up to thread_count threads (0 uses every core).
+    // Indices are handed out dynamically so uneven work is balanced. The first exception thrown by f is rethrown once every thread is done.
+    template<typename F>
+    void for_each(size_t count, F f, unsigned thread_count = 0)
+    {
+        auto threads = (size_t)resolve_thread_count(thread_count);
+        if (threads <= 1 || count <= 1)
+        {
+            for (size_t i = 0; i < count; ++i)
+                f(i);
+            return;
+        }
+#ifndef _M_CEE
+        threads = std::min(threads, count);
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+
+        auto worker = [&]() {
+            try
+            {
+                for (auto i = next++; i < count; i = next++)
+                    f(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        };
+
+        std::vector<std::thread> pool;
+        pool.reserve(threads - 1);
+        for (size_t t = 1; t < threads; ++t)
+            pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool)
+            t.join();
+        if (error)
+            std::rethrow_exception(error);
+#endif
+    }
+
+    // Splits [0, count) into chunks of at least grain elements and calls f(begin, end) for each chunk in parallel.
+    template<typename F>
+    void for_ranges(size_t count, size_t grain, F f, unsigned thread_count = 0)
+    {
+        if (count == 0)
+            return;
+        auto threads = (size_t)resolve_thread_count(thread_count);
+        grain = std::max(grain, (size_t)1);
+        // A few chunks per thread keeps the threads busy when chunks take different times
+        auto chunks = std::max((size_t)1, std::min(count / grain, threads * 4));
+        auto chunk_size = (count + chunks - 1) / chunks;
+        for_each(chunks, [&](size_t c) {
+            auto begin = c * chunk_size;
+            auto end = std::min(count, begin + chunk_size);
+            if (begin < end)
+                f(begin, end);
+        }, (unsigned)threads);
+    }
+}
+
+#endif
@@ -0,0 +1,361 @@
+/*
+    Generates levels of detail for G3D meshes with quadric error edge collapses
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include "g3d.h"
+#include "optimize.h"
+#include "parallel.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    /// The error quadric of Garland and Heckbert: the sum of squared distances to a set of planes, as a symmetric 4x4 matrix
+    struct Quadric
+    {
+        double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+
+        /// The plane through three points, weighted by the area of the triangle
+        static Quadric from_triangle(const float* p0, const float* p1, const float* p2) {
+            double e1[3], e2[3], n[3];
+            for (int c = 0; c < 3; ++c) {
+                e1[c] = (double)p1[c] - p0[c];
+                e2[c] = (double)p2[c] - p0[c];
+            }
+            n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+            n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+            n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+            auto length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            Quadric q;
+            if (length == 0)
+                return q;
+            auto area = length * 0.5;
+            for (int c = 0; c < 3; ++c)
+                n[c] /= length;
+            auto d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+            q.a2 = n[0] * n[0] * area; q.ab = n[0] * n[1] * area; q.ac = n[0] * n[2] * area; q.ad = n[0] * d * area;
+            q.b2 = n[1] * n[1] * area; q.bc = n[1] * n[2] * area; q.bd = n[1] * d * area;
+            q.c2 = n[2] * n[2] * area; q.cd = n[2] * d * area;
+            q.d2 = d * d * area;
+            return q;
+        }
+
+        void add(const Quadric& q) {
+            a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad; b2 += q.b2;
+            bc += q.bc; bd += q.bd; c2 += q.c2; cd += q.cd; d2 += q.d2;
+        }
+
+        double error(const float* p) const {
+            double x = p[0], y = p[1], z = p[2];
+            return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+                + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+                + c2 * z * z + 2 * cd * z + d2;
+        }
+    };
+
+    /// Simplifies the triangles of one or more submeshes that share vertices, by collapsing vertices onto a neighbour so that
+    /// no new vertices are made and every vertex attribute stays valid. Vertices on an open edge, or used by more than one submesh,
+    /// never move, which keeps the outline of each submesh and the seams between materials. Collapses that would flip a triangle
+    /// are skipped. Each pass collapses the cheapest edges whose neighbourhoods do not overlap, until every submesh has at most its
+    /// target number of triangles or no edge can be collapsed.
+    class Simplifier
+    {
+    public:
+        /// submeshes holds the triangle list of each submesh, using vertex ids below num_vertices
+        Simplifier(const float* positions, size_t num_vertices, vector<vector<int>> submeshes)
+            : _positions(positions)
+            , _submeshes(move(submeshes))
+            , _quadrics(num_vertices)
+            , _locked(num_vertices, 0)
+            , _triangles_of(num_vertices)
+            , _removed(_submeshes.size(), 0)
+        {
+            vector<int> submesh_of(num_vertices, -1);
+            for (size_t s = 0; s < _submeshes.size(); ++s) {
+                const auto& triangles = _submeshes[s];
+                for (size_t t = 0; t + 2 < triangles.size(); t += 3) {
+                    auto q = Quadric::from_triangle(position(triangles[t]), position(triangles[t + 1]), position(triangles[t + 2]));
+                    for (int c = 0; c < 3; ++c) {
+                        auto v = triangles[t + c];
+                        _quadrics[v].add(q);
+                        _triangles_of[v].push_back(Corner{ (int)s, (int)t });
+                        if (submesh_of[v] >= 0 && submesh_of[v] != (int)s)
+                            _locked[v] = 1;
+                        submesh_of[v] = (int)s;
+                    }
+                }
+            }
+            lock_open_edges();
+        }
+
+        const vector<int>& triangles(size_t submesh) const { return _submeshes[submesh]; }
+
+        /// Collapses edges until each submesh has at most targets[s] triangles (as indices / 3)
+        void simplify(const vector<size_t>& targets) {
+            for (;;) {
+                vector<Edge> edges;
+                for (size_t s = 0; s < _submeshes.size(); ++s)
+                    if (live_triangles(s) > targets[s])
+                        collect_edges(s, edges);
+                if (edges.empty())
+                    return;
+                sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) { return a.cost < b.cost; });
+
+                vector<char> touched(_locked.size(), 0);
+                size_t collapses = 0;
+                for (const auto& e : edges) {
+                    if (touched[e.from] || touched[e.to] || live_triangles(e.submesh) <= targets[e.submesh] || flips(e.from, e.to))
+                        continue;
+                    // The neighbourhood of both ends changes, so nothing around them can collapse again in this pass
+                    for (auto v : { e.from, e.to })
+                        for (const auto& corner : _triangles_of[v])
+                            for (int c = 0; c < 3; ++c)
+                                touched[_submeshes[corner.submesh][corner.triangle + c]] = 1;
+                    collapse(e.from, e.to);
+                    ++collapses;
+                }
+                compact();
+                if (collapses == 0)
+                    return;
+            }
+        }
+
+    private:
+        struct Corner { int submesh; int triangle; };
+        struct Edge { double cost; int from; int to; int submesh; };
+
+        const float* position(int v) const { return _positions + (size_t)v * 3; }
+
+        size_t live_triangles(size_t s) const { return _submeshes[s].size() / 3 - _removed[s]; }
+
+        static bool degenerate(const int* t) { return t[0] == t[1] || t[1] == t[2] || t[2] == t[0]; }
+
+        void lock_open_edges() {
+            // An edge used by a single triangle of the same submesh, counted from the smaller vertex
+            vector<pair<pair<int, int>, int>> edges;
+            for (size_t s = 0; s < _submeshes.size(); ++s) {
+                const auto& triangles = _submeshes[s];
+                for (size_t t = 0; t + 2 < triangles.size(); t += 3)
+                    for (int c = 0; c < 3; ++c) {
+                        auto a = triangles[t + c], b = triangles[t + (c + 1) % 3];
+                        edges.push_back(make_pair(make_pair(min(a, b), max(a, b)), (int)s));
+                    }
+            }
+            sort(edges.begin(), edges.end());
+            for (size_t i = 0; i < edges.size();) {
+                auto j = i;
+                while (j < edges.size() && edges[j] == edges[i])
+                    ++j;
+                if (j - i == 1) {
+                    _locked[edges[i].first.first] = 1;
+                    _locked[edges[i].first.second] = 1;
+                }
+                i = j;
+            }
+        }
+
+        void collect_edges(size_t s, vector<Edge>& edges) const {
+            const auto& triangles = _submeshes[s];
+            for (size_t t = 0; t + 2 < triangles.size(); t += 3) {
+                if (degenerate(&triangles[t]))
+                    continue;
+                for (int c = 0; c < 3; ++c) {
+                    auto a = triangles[t + c], b = triangles[t + (c + 1) % 3];
+                    // Each interior edge is seen from both triangles, so each direction is added once
+                    if (!_locked[a])
+                        edges.push_back(Edge{ cost(a, b), a, b, (int)s });
+                }
+            }
+        }
+
+        double cost(int from, int to) const {
+            auto q = _quadrics[from];
+            q.add(_quadrics[to]);
+            return q.error(position(to));
+        }
+
+        bool flips(int from, int to) const {
+            for (const auto& corner : _triangles_of[from]) {
+                const auto* t = &_submeshes[corner.submesh][corner.triangle];
+                if (degenerate(t) || t[0] == to || t[1] == to || t[2] == to)
+                    continue;
+                const float* before[3];
+                const float* after[3];
+                for (int c = 0; c < 3; ++c) {
+                    before[c] = position(t[c]);
+                    after[c] = position(t[c] == from ? to : t[c]);
+                }
+                double n0[3], n1[3];
+                normal(before, n0);
+                normal(after, n1);
+                if (n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2] <= 0)
+                    return true;
+            }
+            return false;
+        }
+
+        static void normal(const float* const* p, double* n) {
+            double e1[3], e2[3];
+            for (int c = 0; c < 3; ++c) {
+                e1[c] = (double)p[1][c] - p[0][c];
+                e2[c] = (double)p[2][c] - p[0][c];
+            }
+            n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+            n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+            n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+        }
+
+        void collapse(int from, int to) {
+            for (const auto& corner : _triangles_of[from]) {
+                auto* t = &_submeshes[corner.submesh][corner.triangle];
+                if (degenerate(t))
+                    continue;
+                for (int c = 0; c < 3; ++c)
+                    if (t[c] == from)
+                        t[c] = to;
+                if (degenerate(t))
+                    ++_removed[corner.submesh];
+                else
+                    _triangles_of[to].push_back(corner);
+            }
+            _triangles_of[from].clear();
+            _quadrics[to].add(_quadrics[from]);
+        }
+
+        // Drops degenerate triangles and rebuilds the triangle lists of the vertices
+        void compact() {
+            for (auto& list : _triangles_of)
+                list.clear();
+            for (size_t s = 0; s < _submeshes.size(); ++s) {
+                auto& triangles = _submeshes[s];
+                size_t k = 0;
+                for (size_t t = 0; t + 2 < triangles.size(); t += 3) {
+                    if (degenerate(&triangles[t]))
+                        continue;
+                    for (int c = 0; c < 3; ++c) {
+                        triangles[k + c] = triangles[t + c];
+                        _triangles_of[triangles[k + c]].push_back(Corner{ (int)s, (int)k });
+                    }
+                    k += 3;
+                }
+                triangles.resize(k);
+            }
+            _removed.assign(_submeshes.size(), 0);
+        }
+
+        const float* _positions;
+        vector<vector<int>> _submeshes;
+        vector<Quadric> _quadrics;
+        vector<char> _locked;
+        vector<vector<Corner>> _triangles_of;
+        // The triangles of each submesh that became degenerate since the last compact()
+        vector<size_t> _removed;
+    };
+
+    struct LodOptions
+    {
+        /// The number of levels generated after the original geometry (level 0)
+        int levels = 3;
+
+        /// The fraction of the triangles of the previous level that each level keeps
+        float ratio = 0.5f;
+    };
+
+    /// The descriptors of the index buffer and submesh index offsets of a level of detail, level 0 being the original geometry
+    inline string lod_index_descriptor(int level) {
+        return "g3d:corner:index:" + to_string(level) + ":int32:1";
+    }
+
+    inline string lod_submesh_index_offset_descriptor(int level) {
+        return "g3d:submesh:indexoffset:" + to_string(level) + ":int32:1";
+    }
+
+    /// Adds simplified versions of the triangles of every mesh as g3d:corner:index:L and g3d:submesh:indexoffset:L for L from 1 to
+    /// options.levels. Each level indexes the original vertices and has the same submeshes, so materials and mesh offsets still apply.
+    /// Meshes are simplified in parallel, each level starting from the previous one. Returns the number of levels added, which is 0
+    /// if the faces are not triangles. A level whose triangles all collapsed is stored as an empty index buffer. The levels refer to the vertices by index, so weld_vertices, optimize_vertex_cache and
+    /// deduplicate_meshes remove them: run those first.
+    inline int generate_lods(G3d& g3d, const LodOptions& options = LodOptions(), unsigned thread_count = 0)
+    {
+        auto positions = g3d.view<float, 3>(descriptors::Position);
+        auto indices = g3d.view<int, 1>(descriptors::Index);
+        auto face_size = g3d.view<int, 1>(descriptors::ObjectFaceSize);
+        if (options.levels <= 0 || indices.empty() || (!face_size.empty() && face_size[0] != 3))
+            return 0;
+        for (auto i : indices)
+            if (i < 0 || (size_t)i >= positions.size())
+                throw runtime_error("An index is out of the range of the vertices");
+
+        // Submeshes are simplified together with the other submeshes of their mesh, since they can share vertices
+        auto ranges = g3d.submesh_index_ranges();
+        auto num_submeshes = ranges.size() - 1;
+        for (size_t s = 0; s < num_submeshes; ++s)
+            if ((ranges[s + 1] - ranges[s]) % 3 != 0)
+                return 0;
+        auto layout = g3d.mesh_layout(thread_count);
+        vector<size_t> groups = { 0 };
+        for (size_t m = 0; m < layout.num_meshes(); ++m)
+            if ((size_t)layout.submesh_offsets[m] > groups.back() && (size_t)layout.submesh_offsets[m] < num_submeshes)
+                groups.push_back(layout.submesh_offsets[m]);
+        groups.push_back(num_submeshes);
+
+        // The triangles of each submesh at each level
+        vector<vector<vector<int>>> lods(options.levels, vector<vector<int>>(num_submeshes));
+        parallel::for_each(groups.size() - 1, [&](size_t g) {
+            auto first = groups[g], last = groups[g + 1];
+            IndexSpan span(indices.data() + ranges[first], ranges[last] - ranges[first]);
+            vector<vector<int>> submeshes;
+            for (auto s = first; s < last; ++s) {
+                submeshes.emplace_back();
+                for (auto i = ranges[s]; i < ranges[s + 1]; ++i)
+                    submeshes.back().push_back(indices[i] - span.first);
+            }
+            Simplifier simplifier(positions.values() + (size_t)span.first * 3, span.count, move(submeshes));
+            vector<size_t> targets(last - first);
+            for (size_t k = 0; k < targets.size(); ++k)
+                targets[k] = (ranges[first + k + 1] - ranges[first + k]) / 3;
+            for (int level = 0; level < options.levels; ++level) {
+                for (auto& target : targets)
+                    target = (size_t)(target * options.ratio);
+                simplifier.simplify(targets);
+                for (auto s = first; s < last; ++s) {
+                    auto& out = lods[level][s];
+                    for (auto v : simplifier.triangles(s - first))
+                        out.push_back(v + span.first);
+                }
+            }
+        }, thread_count);
+
+        for (int level = 0; level < options.levels; ++level) {
+            vector<int> level_indices, level_offsets;
+            for (size_t s = 0; s < num_submeshes; ++s) {
+                level_offsets.push_back((int)level_indices.size());
+                level_indices.insert(level_indices.end(), lods[level][s].begin(), lods[level][s].end());
+            }
+            // Every level is stored, even one whose triangles all collapsed, so the levels have no gaps. The storage is reserved so
+            // that an empty level still points to memory, which add_attribute requires.
+            auto store = [&](const string& name, const vector<int>& values) {
+                auto data = make_shared<vector<bfast::byte>>();
+                data->reserve(max<size_t>(values.size(), 1) * sizeof(int));
+                data->insert(data->end(), (const bfast::byte*)values.data(), (const bfast::byte*)(values.data() + values.size()));
+                g3d.remove_attribute(name);
+                g3d.add_attribute(name, data->data(), data->data() + data->size(), data);
+            };
+            store(lod_index_descriptor(level + 1), level_indices);
+            if (g3d.find(descriptors::SubmeshIndexOffset) != nullptr)
+                store(lod_submesh_index_offset_descriptor(level + 1), level_offsets);
+        }
+        return options.levels;
+    }
+}
+
+#endif
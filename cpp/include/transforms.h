@@ -0,0 +1,182 @@
+/*
+    Resolves the world transforms of G3D instances from their local transforms and parents
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __TRANSFORMS_H__
+#define __TRANSFORMS_H__
+
+#include <vector>
+#include <stdexcept>
+#include "g3d.h"
+#include "parallel.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+namespace g3d
+{
+    using namespace std;
+
+    /// A 4x4 matrix stored row by row, as in g3d:instance:transform:0:float32:16.
+    /// Points are row vectors (as in System.Numerics), so the translation is in the last row and a * b applies a first.
+    struct Matrix4x4
+    {
+        float m[16];
+
+        static Matrix4x4 identity() {
+            return Matrix4x4{ { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 } };
+        }
+    };
+
+    /// Computes r = a * b. r may not be a or b.
+    inline void multiply(const Matrix4x4& a, const Matrix4x4& b, Matrix4x4& r)
+    {
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        // Each row of the result is a linear combination of the rows of b
+        auto b0 = _mm_loadu_ps(b.m), b1 = _mm_loadu_ps(b.m + 4), b2 = _mm_loadu_ps(b.m + 8), b3 = _mm_loadu_ps(b.m + 12);
+        for (int i = 0; i < 4; ++i) {
+            auto row = a.m + i * 4;
+            auto x = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(row[0]), b0), _mm_mul_ps(_mm_set1_ps(row[1]), b1));
+            auto y = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(row[2]), b2), _mm_mul_ps(_mm_set1_ps(row[3]), b3));
+            _mm_storeu_ps(r.m + i * 4, _mm_add_ps(x, y));
+        }
+#else
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j)
+                r.m[i * 4 + j] = a.m[i * 4] * b.m[j] + a.m[i * 4 + 1] * b.m[4 + j] + a.m[i * 4 + 2] * b.m[8 + j] + a.m[i * 4 + 3] * b.m[12 + j];
+#endif
+    }
+
+    inline Matrix4x4 operator*(const Matrix4x4& a, const Matrix4x4& b)
+    {
+        Matrix4x4 r;
+        multiply(a, b, r);
+        return r;
+    }
+
+    /// The world transforms of a set of instances, where the world transform of an instance is its local transform
+    /// followed by the world transform of its parent. Instances are sorted by depth once, so every level can be
+    /// computed in parallel with one multiply per instance. Changing some local transforms and calling update()
+    /// only recomputes those instances and their descendants.
+    class TransformHierarchy
+    {
+    public:
+        /// Parent indices that are negative or out of range make an instance a root. parents may be null if every instance is a root.
+        TransformHierarchy(const Matrix4x4* locals, const int* parents, size_t count, unsigned thread_count = 0)
+            : _locals(locals, locals + count)
+            , _parents(count, -1)
+            , _worlds(count)
+            , _dirty(count, 1)
+            , _thread_count(thread_count)
+        {
+            if (parents != nullptr)
+                for (size_t i = 0; i < count; ++i)
+                    _parents[i] = parents[i] >= 0 && (size_t)parents[i] < count ? parents[i] : -1;
+            sort_by_depth();
+            update();
+        }
+
+        /// Reads g3d:instance:transform and the optional g3d:instance:parent
+        explicit TransformHierarchy(const G3d& g3d, unsigned thread_count = 0)
+            : TransformHierarchy(g3d.view<float, 16, Matrix4x4>(descriptors::InstanceTransform), g3d.view<int, 1>(descriptors::InstanceParent), thread_count)
+        { }
+
+        size_t size() const { return _locals.size(); }
+
+        const Matrix4x4& local(size_t i) const { return _locals[i]; }
+        const Matrix4x4& world(size_t i) const { return _worlds[i]; }
+        const vector<Matrix4x4>& worlds() const { return _worlds; }
+        int parent(size_t i) const { return _parents[i]; }
+
+        /// The instances sorted by depth: the instances of level l are order()[level_offsets()[l]] up to order()[level_offsets()[l + 1]]
+        const vector<int>& order() const { return _order; }
+        const vector<size_t>& level_offsets() const { return _level_offsets; }
+        size_t num_levels() const { return _level_offsets.size() - 1; }
+
+        /// Changes a local transform. The world transforms are recomputed by the next call to update().
+        void set_local(size_t i, const Matrix4x4& m) {
+            _locals[i] = m;
+            _dirty[i] = 1;
+        }
+
+        /// Recomputes the world transforms of the changed instances and of their descendants
+        void update() {
+            for (size_t level = 0; level < num_levels(); ++level) {
+                auto begin = _level_offsets[level];
+                parallel::for_ranges(_level_offsets[level + 1] - begin, 4096, [&](size_t first, size_t last) {
+                    for (auto k = begin + first; k < begin + last; ++k) {
+                        auto i = _order[k];
+                        auto p = _parents[i];
+                        // Parents are on an earlier level, so their flags are final by now
+                        if (p >= 0 && _dirty[p])
+                            _dirty[i] = 1;
+                        if (!_dirty[i])
+                            continue;
+                        if (p < 0)
+                            _worlds[i] = _locals[i];
+                        else
+                            multiply(_locals[i], _worlds[p], _worlds[i]);
+                    }
+                }, _thread_count);
+            }
+            fill(_dirty.begin(), _dirty.end(), 0);
+        }
+
+    private:
+        TransformHierarchy(AttributeView<float, 16, Matrix4x4> locals, AttributeView<int, 1> parents, unsigned thread_count)
+            : TransformHierarchy(locals.data(), parents.size() == locals.size() ? parents.data() : nullptr, locals.size(), thread_count)
+        {
+            if (!parents.empty() && parents.size() != locals.size())
+                throw runtime_error("The number of instance parents does not match the number of instance transforms");
+        }
+
+        // Computes the depth of every instance, then counting sorts the instances by depth
+        void sort_by_depth() {
+            auto count = _parents.size();
+            const int unknown = -1, visiting = -2;
+            vector<int> depth(count, unknown);
+            vector<int> chain;
+            int max_depth = -1;
+            for (size_t i = 0; i < count; ++i) {
+                // Walks up to the first ancestor with a known depth, then assigns depths on the way back down
+                auto j = (int)i;
+                while (j >= 0 && depth[j] == unknown) {
+                    depth[j] = visiting;
+                    chain.push_back(j);
+                    j = _parents[j];
+                }
+                if (j >= 0 && depth[j] == visiting)
+                    throw runtime_error("The instance parents contain a cycle");
+                auto d = j < 0 ? -1 : depth[j];
+                while (!chain.empty()) {
+                    depth[chain.back()] = ++d;
+                    chain.pop_back();
+                }
+                max_depth = max(max_depth, depth[i]);
+            }
+
+            _level_offsets.assign(max_depth + 2, 0);
+            for (auto d : depth)
+                ++_level_offsets[d + 1];
+            for (size_t l = 1; l < _level_offsets.size(); ++l)
+                _level_offsets[l] += _level_offsets[l - 1];
+            _order.resize(count);
+            auto next = _level_offsets;
+            for (size_t i = 0; i < count; ++i)
+                _order[next[depth[i]]++] = (int)i;
+        }
+
+        vector<Matrix4x4> _locals;
+        vector<int> _parents;
+        vector<Matrix4x4> _worlds;
+        vector<char> _dirty;
+        vector<int> _order;
+        vector<size_t> _level_offsets = { 0 };
+        unsigned _thread_count;
+    };
+}
+
+#endif
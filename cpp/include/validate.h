@@ -0,0 +1,237 @@
+/*
+    Structural validation of G3D geometry: index, submesh, mesh, instance and material consistency
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __VALIDATE_H__
+#define __VALIDATE_H__
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <climits>
+#include "g3d.h"
+#include "parallel.h"
+
+#if !defined(_M_CEE) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define VALIDATE_SSE
+#endif
+
+namespace g3d
+{
+    using namespace std;
+
+    /// The checks of Vim.G3d.Validation. The names are those of the C# G3dErrors, except that SubmeshesIndesxOffsetInvalidIndex is
+    /// spelled SubmeshesIndexOffsetInvalidIndex here, and AttributeInvalidType has no C# counterpart: it reports an attribute whose
+    /// data type cannot be read by a check.
+    enum class G3dErrors
+    {
+        Success = 0,
+        MaterialsCountMismatch,
+        IndicesInvalidCount,
+        IndicesOutOfRange,
+
+        // Submeshes
+        SubmeshesCountMismatch,
+        SubmeshesIndexOffsetInvalidIndex,
+        SubmeshesIndexOffsetOutOfRange,
+        SubmeshesNonPositive,
+        SubmeshesMaterialOutOfRange,
+
+        // Meshes
+        MeshesSubmeshOffsetOutOfRange,
+        MeshesSubmeshCountNonPositive,
+
+        // Instances
+        InstancesCountMismatch,
+        InstancesParentOutOfRange,
+        InstancesMeshOutOfRange,
+
+        // An attribute checked here does not hold one int32 per element
+        AttributeInvalidType,
+    };
+
+    struct ValidationError
+    {
+        G3dErrors error = G3dErrors::Success;
+
+        /// The descriptor of the attribute at fault
+        string attribute;
+
+        /// The first offending element of the attribute, or -1 when the error is about its size
+        int64_t element = -1;
+    };
+
+    namespace validation
+    {
+        const size_t chunk_size = 1 << 16;
+
+        /// Calls find(begin, end) on chunks of [0, count) in parallel and returns the smallest index found, or -1
+        template<typename F>
+        inline int64_t find_first(size_t count, F find, unsigned thread_count)
+        {
+            auto num_chunks = (count + chunk_size - 1) / chunk_size;
+            vector<int64_t> found(num_chunks, -1);
+            parallel::for_each(num_chunks, [&](size_t c) {
+                found[c] = find(c * chunk_size, min(count, (c + 1) * chunk_size));
+            }, thread_count);
+            for (auto f : found)
+                if (f >= 0)
+                    return f;
+            return -1;
+        }
+
+        /// Returns the index of the first value outside [lo, hi], or -1 if there is none.
+        /// The values are scanned 8 at a time with SSE2 compares, and only a chunk with a bad value is searched again for its position.
+        inline int64_t find_out_of_range(const int* values, size_t count, int64_t lo, int64_t hi, unsigned thread_count = 0)
+        {
+            if (hi < lo)
+                return count > 0 ? 0 : -1;
+            auto lo32 = (int)max(lo, (int64_t)INT_MIN), hi32 = (int)min(hi, (int64_t)INT_MAX);
+            return find_first(count, [&](size_t begin, size_t end) -> int64_t {
+                auto i = begin;
+#ifdef VALIDATE_SSE
+                auto below = _mm_set1_epi32(lo32), above = _mm_set1_epi32(hi32);
+                auto bad = _mm_setzero_si128();
+                for (; i + 8 <= end; i += 8) {
+                    auto a = _mm_loadu_si128((const __m128i*)(values + i));
+                    auto b = _mm_loadu_si128((const __m128i*)(values + i + 4));
+                    bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi32(a, below), _mm_cmpgt_epi32(a, above)));
+                    bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi32(b, below), _mm_cmpgt_epi32(b, above)));
+                }
+                if (_mm_movemask_epi8(bad) != 0)
+                    i = begin;
+#endif
+                for (; i < end; ++i)
+                    if (values[i] < lo32 || values[i] > hi32)
+                        return (int64_t)i;
+                return -1;
+            }, thread_count);
+        }
+
+        /// Returns the index of the first value that is not greater than the one before it, or -1 if they strictly increase
+        inline int64_t find_not_increasing(const int* values, size_t count, unsigned thread_count = 0)
+        {
+            return find_first(count, [&](size_t begin, size_t end) -> int64_t {
+                for (auto i = max(begin, (size_t)1); i < end; ++i)
+                    if (values[i] <= values[i - 1])
+                        return (int64_t)i;
+                return -1;
+            }, thread_count);
+        }
+
+        /// Returns the index of the first value that is not a multiple of the divisor, or -1 if there is none
+        inline int64_t find_not_multiple(const int* values, size_t count, int divisor, unsigned thread_count = 0)
+        {
+            return find_first(count, [&](size_t begin, size_t end) -> int64_t {
+                for (auto i = begin; i < end; ++i)
+                    if (values[i] % divisor != 0)
+                        return (int64_t)i;
+                return -1;
+            }, thread_count);
+        }
+    }
+
+    /// Runs the structural checks of Vim.G3d.Validation and returns every failed check with the first offending element.
+    /// Indices must be in range, submeshes and meshes must have ascending, non empty ranges, and submesh materials, instance parents
+    /// and instance meshes must refer to existing elements. Attributes that are missing are not checked, but a count that involves them
+    /// is taken as 0. Large arrays are scanned in parallel over up to thread_count threads (0 uses every core).
+    inline vector<ValidationError> validate(const G3d& g3d, unsigned thread_count = 0)
+    {
+        vector<ValidationError> errors;
+        auto fail = [&](G3dErrors error, const char* attribute, int64_t element) {
+            errors.push_back(ValidationError{ error, attribute, element });
+        };
+
+        // The attributes checked here hold one int32 per element, except the transforms and colors whose element counts are compared
+        auto ints = [&](const char* name) {
+            auto attr = g3d.find(name);
+            if (attr != nullptr && (!attr->is<int, 1>() || reinterpret_cast<uintptr_t>(attr->_begin) % alignof(int) != 0)) {
+                fail(G3dErrors::AttributeInvalidType, name, -1);
+                return AttributeView<int, 1, int>();
+            }
+            return attr == nullptr ? AttributeView<int, 1, int>() : attr->as<int, 1>();
+        };
+
+        // The number of elements of an association, taken from the first attribute present; the others must match it
+        auto count_of = [&](vector<const char*> names, G3dErrors mismatch) {
+            int64_t r = -1;
+            for (auto name : names)
+                if (auto attr = g3d.find(name)) {
+                    auto n = (int64_t)attr->num_elements();
+                    if (r < 0)
+                        r = n;
+                    else if (n != r)
+                        fail(mismatch, name, -1);
+                }
+            return max(r, (int64_t)0);
+        };
+
+        auto num_vertices = (int64_t)g3d.num_vertices();
+        auto num_materials = count_of({ descriptors::MaterialColor, descriptors::MaterialGlossiness, descriptors::MaterialSmoothness },
+            G3dErrors::MaterialsCountMismatch);
+        auto num_submeshes = count_of({ descriptors::SubmeshIndexOffset, descriptors::SubmeshMaterial }, G3dErrors::SubmeshesCountMismatch);
+        auto num_instances = count_of({ descriptors::InstanceTransform, descriptors::InstanceParent, descriptors::InstanceMesh, descriptors::InstanceFlags },
+            G3dErrors::InstancesCountMismatch);
+
+        // Indices
+        auto indices = ints(descriptors::Index);
+        auto has_indices = g3d.find(descriptors::Index) != nullptr;
+        auto num_corners = has_indices ? (int64_t)indices.size() : num_vertices;
+        auto corners_per_face = (int)g3d.corners_per_face();
+        if (num_corners % corners_per_face != 0)
+            fail(G3dErrors::IndicesInvalidCount, descriptors::Index, -1);
+        auto bad_index = validation::find_out_of_range(indices.data(), indices.size(), 0, num_vertices - 1, thread_count);
+        if (bad_index >= 0)
+            fail(G3dErrors::IndicesOutOfRange, descriptors::Index, bad_index);
+
+        // Submeshes
+        auto mesh_submesh_offsets = ints(descriptors::MeshSubmeshOffset);
+        auto num_meshes = (int64_t)mesh_submesh_offsets.size();
+        if (num_submeshes < num_meshes)
+            fail(G3dErrors::SubmeshesCountMismatch, descriptors::SubmeshIndexOffset, -1);
+        auto submesh_offsets = ints(descriptors::SubmeshIndexOffset);
+        auto bad_offset = validation::find_not_multiple(submesh_offsets.data(), submesh_offsets.size(), corners_per_face, thread_count);
+        if (bad_offset >= 0)
+            fail(G3dErrors::SubmeshesIndexOffsetInvalidIndex, descriptors::SubmeshIndexOffset, bad_offset);
+        bad_offset = validation::find_out_of_range(submesh_offsets.data(), submesh_offsets.size(), 0, num_corners - 1, thread_count);
+        if (bad_offset >= 0)
+            fail(G3dErrors::SubmeshesIndexOffsetOutOfRange, descriptors::SubmeshIndexOffset, bad_offset);
+        // A submesh is empty when its offset does not increase, or for the last one when it is at the end of the indices
+        auto empty_submesh = validation::find_not_increasing(submesh_offsets.data(), submesh_offsets.size(), thread_count);
+        if (empty_submesh >= 0)
+            fail(G3dErrors::SubmeshesNonPositive, descriptors::SubmeshIndexOffset, empty_submesh - 1);
+        else if (!submesh_offsets.empty() && submesh_offsets[submesh_offsets.size() - 1] >= num_corners)
+            fail(G3dErrors::SubmeshesNonPositive, descriptors::SubmeshIndexOffset, (int64_t)submesh_offsets.size() - 1);
+        auto submesh_materials = ints(descriptors::SubmeshMaterial);
+        auto bad_material = validation::find_out_of_range(submesh_materials.data(), submesh_materials.size(), INT_MIN, num_materials - 1, thread_count);
+        if (bad_material >= 0)
+            fail(G3dErrors::SubmeshesMaterialOutOfRange, descriptors::SubmeshMaterial, bad_material);
+
+        // Meshes
+        bad_offset = validation::find_out_of_range(mesh_submesh_offsets.data(), mesh_submesh_offsets.size(), 0, num_submeshes - 1, thread_count);
+        if (bad_offset >= 0)
+            fail(G3dErrors::MeshesSubmeshOffsetOutOfRange, descriptors::MeshSubmeshOffset, bad_offset);
+        auto empty_mesh = validation::find_not_increasing(mesh_submesh_offsets.data(), mesh_submesh_offsets.size(), thread_count);
+        if (empty_mesh >= 0)
+            fail(G3dErrors::MeshesSubmeshCountNonPositive, descriptors::MeshSubmeshOffset, empty_mesh - 1);
+        else if (num_meshes > 0 && mesh_submesh_offsets[num_meshes - 1] >= num_submeshes)
+            fail(G3dErrors::MeshesSubmeshCountNonPositive, descriptors::MeshSubmeshOffset, num_meshes - 1);
+
+        // Instances: like materials, a negative parent or mesh means there is none
+        auto parents = ints(descriptors::InstanceParent);
+        auto bad_parent = validation::find_out_of_range(parents.data(), parents.size(), INT_MIN, num_instances - 1, thread_count);
+        if (bad_parent >= 0)
+            fail(G3dErrors::InstancesParentOutOfRange, descriptors::InstanceParent, bad_parent);
+        auto meshes = ints(descriptors::InstanceMesh);
+        auto bad_mesh = validation::find_out_of_range(meshes.data(), meshes.size(), INT_MIN, num_meshes - 1, thread_count);
+        if (bad_mesh >= 0)
+            fail(G3dErrors::InstancesMeshOutOfRange, descriptors::InstanceMesh, bad_mesh);
+
+        return errors;
+    }
+}
+
+#endif
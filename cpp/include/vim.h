@@ -8,12 +8,21 @@
 #define __VIM_H__
 
 #include <vector>
+#include <algorithm>
 #include <sstream>
 #include <unordered_map>
 #include <tuple>
 #include <stdexcept>
+#include <memory>
+#include <cstring>
+#include <string_view>
 
 #include "g3d.h"
+#include "parallel.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace Vim
 {
@@ -36,15 +45,421 @@ namespace Vim
         int mValue;
     };
 
+    /// <summary>
+    /// A read-only typed view of a column stored in a buffer. The view aliases the buffer when it is suitably aligned,
+    /// otherwise it holds its own copy of the values. An aliasing view keeps the buffer alive through the owner it was given;
+    /// without one it is only valid as long as the buffer it was created from.
+    /// </summary>
+    template<typename T>
+    class ColumnView
+    {
+    public:
+        ColumnView() = default;
+
+        ColumnView(const bfast::ByteRange& data, std::shared_ptr<const void> owner = nullptr)
+        {
+            auto count = data.size() / sizeof(T);
+            if (reinterpret_cast<uintptr_t>(data.begin()) % alignof(T) == 0)
+            {
+                mBegin = reinterpret_cast<const T*>(data.begin());
+                mStorage = std::move(owner);
+            }
+            else
+            {
+                auto copy = std::make_shared<std::vector<T>>(count);
+                if (count > 0)
+                    memcpy(copy->data(), data.begin(), count * sizeof(T));
+                mBegin = copy->data();
+                mStorage = std::move(copy);
+                mAliased = false;
+            }
+            mEnd = mBegin + count;
+        }
+
+        ColumnView(const bfast::Buffer& buffer)
+            : ColumnView(buffer.data, buffer.owner)
+        { }
+
+        const T* data() const { return mBegin; }
+        const T* begin() const { return mBegin; }
+        const T* end() const { return mEnd; }
+        size_t size() const { return mEnd - mBegin; }
+        bool empty() const { return mBegin == mEnd; }
+        const T& operator[](size_t i) const { return mBegin[i]; }
+
+        /// <summary>
+        /// True if the view refers directly to the buffer it was created from
+        /// </summary>
+        bool is_aliased() const { return mAliased; }
+
+        /// <summary>
+        /// Keeps the values alive: the owner of the buffer for an aliasing view, otherwise the copy. Null for a buffer without an owner.
+        /// </summary>
+        const std::shared_ptr<const void>& storage() const { return mStorage; }
+
+    private:
+        const T* mBegin = nullptr;
+        const T* mEnd = nullptr;
+        std::shared_ptr<const void> mStorage;
+        bool mAliased = true;
+    };
+
+    /// <summary>
+    /// A compressed sparse row index of properties by one of their fields: the properties whose key is k are
+    /// mItems[mOffsets[k]] to mItems[mOffsets[k + 1] - 1], in their original order. Properties with a negative key are left out.
+    /// </summary>
+    class PropertyIndex
+    {
+    public:
+        ColumnView<int> mOffsets;
+        ColumnView<int> mItems;
+
+        /// <summary>
+        /// True once the index was built or read
+        /// </summary>
+        bool is_loaded() const { return !mOffsets.empty(); }
+
+        size_t num_keys() const { return mOffsets.empty() ? 0 : mOffsets.size() - 1; }
+
+        /// <summary>
+        /// Returns the indices of the properties with the given key
+        /// </summary>
+        ColumnView<int> Get(int key) const
+        {
+            if (key < 0 || (size_t)key >= num_keys())
+                return ColumnView<int>();
+            auto begin = (const bfast::byte*)(mItems.data() + mOffsets[key]);
+            auto end = (const bfast::byte*)(mItems.data() + mOffsets[key + 1]);
+            return ColumnView<int>(bfast::ByteRange{ begin, end }, mItems.storage());
+        }
+
+        /// <summary>
+        /// Builds the index with a stable LSD radix sort of the keys, one byte per pass. Each pass histograms and scatters
+        /// chunks of the properties in parallel, and only as many passes run as the largest key needs.
+        /// Keys are read from the file, so the index has at most numKeys keys: properties with a key outside [0, numKeys) are left out.
+        /// </summary>
+        static PropertyIndex Build(const ColumnView<SerializableProperty>& properties, int SerializableProperty::* key, size_t numKeys, unsigned threadCount = 0)
+        {
+            const size_t chunkSize = 1 << 16;
+            const size_t numBins = 256;
+
+            // The properties with a key, in order
+            std::vector<uint32_t> keys, items;
+            keys.reserve(properties.size());
+            items.reserve(properties.size());
+            uint32_t maxKey = 0;
+            for (size_t i = 0; i < properties.size(); ++i)
+            {
+                auto k = properties[i].*key;
+                if (k < 0 || (size_t)k >= numKeys)
+                    continue;
+                keys.push_back((uint32_t)k);
+                items.push_back((uint32_t)i);
+                maxKey = std::max(maxKey, (uint32_t)k);
+            }
+
+            auto n = keys.size();
+            auto numChunks = (n + chunkSize - 1) / chunkSize;
+            std::vector<uint32_t> keysOut(n), itemsOut(n);
+            std::vector<size_t> histograms(numChunks * numBins);
+            for (unsigned shift = 0; shift < 32 && (shift == 0 || (maxKey >> shift) != 0); shift += 8)
+            {
+                std::fill(histograms.begin(), histograms.end(), 0);
+                parallel::for_each(numChunks, [&](size_t c) {
+                    auto histogram = histograms.data() + c * numBins;
+                    for (size_t i = c * chunkSize, end = std::min(n, i + chunkSize); i < end; ++i)
+                        ++histogram[(keys[i] >> shift) & 0xff];
+                }, threadCount);
+
+                // Turns the counts into the first output position of each digit in each chunk, chunks in order within a digit
+                size_t position = 0;
+                for (size_t d = 0; d < numBins; ++d)
+                    for (size_t c = 0; c < numChunks; ++c)
+                    {
+                        auto count = histograms[c * numBins + d];
+                        histograms[c * numBins + d] = position;
+                        position += count;
+                    }
+
+                parallel::for_each(numChunks, [&](size_t c) {
+                    auto next = histograms.data() + c * numBins;
+                    for (size_t i = c * chunkSize, end = std::min(n, i + chunkSize); i < end; ++i)
+                    {
+                        auto out = next[(keys[i] >> shift) & 0xff]++;
+                        keysOut[out] = keys[i];
+                        itemsOut[out] = items[i];
+                    }
+                }, threadCount);
+                keys.swap(keysOut);
+                items.swap(itemsOut);
+            }
+
+            // The offsets and then the items, in one allocation
+            numKeys = n == 0 ? (size_t)0 : (size_t)maxKey + 1;
+            auto storage = std::make_shared<std::vector<int>>(numKeys + 1 + n, 0);
+            auto offsets = storage->data(), sorted = offsets + numKeys + 1;
+            for (auto k : keys)
+                ++offsets[k + 1];
+            for (size_t k = 0; k < numKeys; ++k)
+                offsets[k + 1] += offsets[k];
+            std::copy(items.begin(), items.end(), sorted);
+
+            PropertyIndex r;
+            r.mOffsets = ColumnView<int>(bfast::ByteRange{ (const bfast::byte*)offsets, (const bfast::byte*)sorted }, storage);
+            r.mItems = ColumnView<int>(bfast::ByteRange{ (const bfast::byte*)sorted, (const bfast::byte*)(sorted + n) }, storage);
+            return r;
+        }
+
+        /// <summary>
+        /// Reads an index stored by Store(). Returns an index that is not loaded if the buffers are missing or do not fit the properties:
+        /// the offsets must go from 0 to the number of items without decreasing, and every item must be the index of a property.
+        /// </summary>
+        static PropertyIndex Read(const bfast::Bfast& bfast, const std::string& name, size_t numProperties)
+        {
+            PropertyIndex r;
+            auto offsets = bfast.find(name + ":offsets");
+            auto items = bfast.find(name + ":items");
+            if (offsets == nullptr || items == nullptr)
+                return r;
+            ColumnView<int> offsetView(*offsets), itemView(*items);
+            if (offsetView.empty() || offsetView[0] != 0 || (size_t)offsetView[offsetView.size() - 1] != itemView.size() || itemView.size() > numProperties)
+                return r;
+            for (size_t k = 1; k < offsetView.size(); ++k)
+                if (offsetView[k] < offsetView[k - 1])
+                    return r;
+            for (auto i : itemView)
+                if (i < 0 || (size_t)i >= numProperties)
+                    return r;
+            r.mOffsets = offsetView;
+            r.mItems = itemView;
+            return r;
+        }
+
+        /// <summary>
+        /// Adds the index to a BFAST as two buffers, so that it is written with it and read back by Read()
+        /// </summary>
+        void Store(bfast::Bfast& bfast, const std::string& name) const
+        {
+            auto add = [&](const std::string& bufferName, const ColumnView<int>& values) {
+                auto begin = (bfast::byte*)values.data();
+                auto index = bfast.index_of(bufferName);
+                if (index >= 0)
+                    bfast.buffers[index] = bfast::Buffer{ bufferName, bfast::ByteRange{ begin, begin + values.size() * sizeof(int) }, values.storage() };
+                else
+                    bfast.add(bufferName, begin, begin + values.size() * sizeof(int), values.storage());
+            };
+            add(name + ":offsets", mOffsets);
+            add(name + ":items", mItems);
+        }
+    };
+
     class EntityTable
     {
     public:
         std::string mName;
 
-        std::unordered_map<std::string, std::vector<int>> mIndexColumns;
-        std::unordered_map<std::string, std::vector<int>> mStringColumns;
-        std::unordered_map<std::string, std::vector<double>> mNumericColumns;
-        std::vector<SerializableProperty> mProperties;
+        std::unordered_map<std::string, ColumnView<int>> mIndexColumns;
+        std::unordered_map<std::string, ColumnView<int>> mStringColumns;
+        std::unordered_map<std::string, ColumnView<double>> mNumericColumns;
+        ColumnView<SerializableProperty> mProperties;
+
+        /// <summary>
+        /// The buffers of the table. Columns which have not been decoded yet are read from here on first access.
+        /// </summary>
+        bfast::Bfast mBfast;
+
+        /// <summary>
+        /// True once mProperties holds the content of the "properties" buffer
+        /// </summary>
+        bool mPropertiesLoaded = false;
+
+        /// <summary>
+        /// The properties of each entity, and the properties with each name. Both are built or read on first access.
+        /// </summary>
+        PropertyIndex mPropertiesByEntity;
+        PropertyIndex mPropertiesByName;
+
+        static constexpr const char* PropertiesByEntityBuffer = "properties:byentity";
+        static constexpr const char* PropertiesByNameBuffer = "properties:byname";
+
+        /// <summary>
+        /// Unpacks an entity table. A lazy table only reads its list of buffers, the columns and properties are decoded on first access.
+        /// The table shares the data of the buffer it is read from.
+        /// </summary>
+        static EntityTable Read(const std::string& name, const bfast::Buffer& buffer, bool lazy)
+        {
+            EntityTable r;
+            r.mName = name;
+            r.mBfast = bfast::Bfast::unpack(buffer);
+            r.mBfast.decompress(1);
+            if (!lazy)
+                r.LoadAll();
+            return r;
+        }
+
+        /// <summary>
+        /// Unpacks an entity table from data which must outlive the table
+        /// </summary>
+        static EntityTable Read(const std::string& name, const bfast::ByteRange& data, bool lazy)
+        {
+            return Read(name, bfast::Buffer{ name, data, nullptr }, lazy);
+        }
+
+        /// <summary>
+        /// Decodes every column and the properties of the table
+        /// </summary>
+        void LoadAll()
+        {
+            for (size_t k = 0; k < mBfast.buffers.size(); ++k)
+            {
+                auto& tableBuffer = mBfast.buffers[k];
+
+                if (tableBuffer.name == "properties")
+                {
+                    mProperties = ColumnView<SerializableProperty>(tableBuffer);
+                    mPropertiesLoaded = true;
+                }
+                else
+                {
+                    size_t index = tableBuffer.name.find_first_of(':');
+                    std::string type = tableBuffer.name.substr(0, index);
+                    std::string name = tableBuffer.name.substr(index + 1);
+
+                    if (type == "numeric")
+                    {
+                        mNumericColumns[name] = ColumnView<double>(tableBuffer);
+                    }
+                    else if (type == "index")
+                    {
+                        mIndexColumns[name] = ColumnView<int>(tableBuffer);
+                    }
+                    else if (type == "string")
+                    {
+                        mStringColumns[name] = ColumnView<int>(tableBuffer);
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// Returns the properties of the table, decoding them on first access
+        /// </summary>
+        const ColumnView<SerializableProperty>& GetProperties()
+        {
+            if (!mPropertiesLoaded)
+            {
+                if (auto buffer = FindBuffer("properties"))
+                    mProperties = ColumnView<SerializableProperty>(*buffer);
+                mPropertiesLoaded = true;
+            }
+            return mProperties;
+        }
+
+        /// <summary>
+        /// Returns the number of entities of the table, which is the length of its columns, or the number of properties if it has no columns
+        /// </summary>
+        size_t GetNumEntities()
+        {
+            for (const auto& buffer : mBfast.buffers)
+            {
+                if (buffer.name.compare(0, 8, "numeric:") == 0)
+                    return buffer.data.size() / sizeof(double);
+                if (buffer.name.compare(0, 6, "index:") == 0 || buffer.name.compare(0, 7, "string:") == 0)
+                    return buffer.data.size() / sizeof(int);
+            }
+            return GetProperties().size();
+        }
+
+        /// <summary>
+        /// Returns the index of the properties by entity id, reading it from the table if it was stored there, otherwise building it
+        /// </summary>
+        const PropertyIndex& GetPropertiesByEntity(unsigned threadCount = 0)
+        {
+            return GetPropertyIndex(mPropertiesByEntity, PropertiesByEntityBuffer, &SerializableProperty::mEntityId, GetNumEntities(), threadCount);
+        }
+
+        /// <summary>
+        /// Returns the index of the properties by the string index of their name. numStrings is the size of the string table of the scene.
+        /// </summary>
+        const PropertyIndex& GetPropertiesByName(size_t numStrings, unsigned threadCount = 0)
+        {
+            return GetPropertyIndex(mPropertiesByName, PropertiesByNameBuffer, &SerializableProperty::mName, numStrings, threadCount);
+        }
+
+        /// <summary>
+        /// Returns the property of the entity with the given name, a string index, or nullptr if the entity does not have it
+        /// </summary>
+        const SerializableProperty* FindProperty(int entityId, int name, unsigned threadCount = 0)
+        {
+            const auto& properties = GetProperties();
+            for (auto i : GetPropertiesByEntity(threadCount).Get(entityId))
+                if (properties[i].mName == name)
+                    return &properties[i];
+            return nullptr;
+        }
+
+        /// <summary>
+        /// Adds both property indices to the buffers of the table, so that Scene::WriteFile saves them and reading the file back skips building them
+        /// </summary>
+        void StorePropertyIndices(size_t numStrings, unsigned threadCount = 0)
+        {
+            GetPropertiesByEntity(threadCount).Store(mBfast, PropertiesByEntityBuffer);
+            GetPropertiesByName(numStrings, threadCount).Store(mBfast, PropertiesByNameBuffer);
+        }
+
+        /// <summary>
+        /// Returns the index column with the given name, or nullptr if there is none
+        /// </summary>
+        const ColumnView<int>* GetIndexColumn(const std::string& name)
+        {
+            return GetColumn(mIndexColumns, "index:", name);
+        }
+
+        /// <summary>
+        /// Returns the string column with the given name, or nullptr if there is none
+        /// </summary>
+        const ColumnView<int>* GetStringColumn(const std::string& name)
+        {
+            return GetColumn(mStringColumns, "string:", name);
+        }
+
+        /// <summary>
+        /// Returns the numeric column with the given name, or nullptr if there is none
+        /// </summary>
+        const ColumnView<double>* GetNumericColumn(const std::string& name)
+        {
+            return GetColumn(mNumericColumns, "numeric:", name);
+        }
+
+    private:
+        const bfast::Buffer* FindBuffer(const std::string& bufferName) const
+        {
+            return mBfast.find(bufferName);
+        }
+
+        const PropertyIndex& GetPropertyIndex(PropertyIndex& index, const char* bufferName, int SerializableProperty::* key, size_t numKeys, unsigned threadCount)
+        {
+            if (!index.is_loaded())
+            {
+                const auto& properties = GetProperties();
+                index = PropertyIndex::Read(mBfast, bufferName, properties.size());
+                if (!index.is_loaded())
+                    index = PropertyIndex::Build(properties, key, numKeys, threadCount);
+            }
+            return index;
+        }
+
+        template<typename T>
+        const ColumnView<T>* GetColumn(std::unordered_map<std::string, ColumnView<T>>& columns, const char* type, const std::string& name)
+        {
+            auto it = columns.find(name);
+            if (it != columns.end())
+                return &it->second;
+            auto buffer = FindBuffer(type + name);
+            if (buffer == nullptr)
+                return nullptr;
+            return &(columns[name] = ColumnView<T>(*buffer));
+        }
     };
 
     inline std::vector<std::string> split(const std::string& str, const std::string& delim)
@@ -71,6 +486,88 @@ namespace Vim
         return tokens;
     }
 
+    /// <summary>
+    /// The strings of a VIM file: a buffer of null terminated strings, addressed by index. Each string is stored as a view into the buffer.
+    /// Copies share the views and the lookup index, and keep the buffer alive through its owner. A buffer without an owner must outlive them all.
+    /// </summary>
+    class StringTable
+    {
+    public:
+        StringTable() = default;
+
+        /// <summary>
+        /// Splits the buffer at its null characters in a single pass. A last string without a terminator ends with the buffer.
+        /// </summary>
+        StringTable(const bfast::Buffer& buffer)
+            : mOwner(buffer.owner)
+        {
+            auto strings = std::make_shared<std::vector<std::string_view>>();
+            auto begin = (const char*)buffer.data.begin();
+            size_t size = buffer.data.size(), start = 0, i = 0;
+            auto add = [&](size_t end) {
+                strings->emplace_back(begin + start, end - start);
+                start = end + 1;
+            };
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+            // Compares 16 bytes at a time against zero, then visits the set bits of the terminators found, lowest first
+            auto zero = _mm_setzero_si128();
+            for (; i + 16 <= size; i += 16)
+            {
+                auto mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(begin + i)), zero));
+                for (; mask != 0; mask &= mask - 1)
+                {
+#ifdef _MSC_VER
+                    unsigned long bit;
+                    _BitScanForward(&bit, mask);
+#else
+                    auto bit = __builtin_ctz(mask);
+#endif
+                    add(i + bit);
+                }
+            }
+#endif
+            for (; i < size; ++i)
+                if (begin[i] == 0)
+                    add(i);
+            if (start < size)
+                strings->emplace_back(begin + start, size - start);
+            mStrings = std::move(strings);
+        }
+
+        size_t size() const { return mStrings ? mStrings->size() : 0; }
+        bool empty() const { return size() == 0; }
+
+        /// <summary>
+        /// Returns the string with the given index, null terminated unless it is the unterminated last one
+        /// </summary>
+        const char* operator[](size_t i) const { return (*mStrings)[i].data(); }
+
+        std::string_view view(size_t i) const { return (*mStrings)[i]; }
+
+        /// <summary>
+        /// Returns the index of the first string equal to the given one, or -1 if there is none.
+        /// The hash index is built on the first call, which like the lazy entity tables must not race with other calls.
+        /// </summary>
+        int find(std::string_view s) const
+        {
+            if (!mIndex)
+            {
+                auto index = std::make_shared<std::unordered_map<std::string_view, int>>();
+                index->reserve(size());
+                for (size_t i = 0; i < size(); ++i)
+                    index->emplace((*mStrings)[i], (int)i);
+                mIndex = std::move(index);
+            }
+            auto it = mIndex->find(s);
+            return it == mIndex->end() ? -1 : it->second;
+        }
+
+    private:
+        std::shared_ptr<const std::vector<std::string_view>> mStrings;
+        std::shared_ptr<const void> mOwner;
+        mutable std::shared_ptr<const std::unordered_map<std::string_view, int>> mIndex;
+    };
+
     enum class VimErrorCodes
     {
         Success = 0,
@@ -82,6 +579,32 @@ namespace Vim
         EntityLoadingException = -6
     };
 
+    /// <summary>
+    /// Controls which parts of a VIM file are decoded by Scene::ReadFile
+    /// </summary>
+    struct SceneLoadOptions
+    {
+        /// <summary>
+        /// Maps the file into memory instead of reading it in full
+        /// </summary>
+        bool mMemoryMapped = false;
+
+        bool mLoadGeometry = true;
+        bool mLoadAssets = true;
+        bool mLoadStrings = true;
+        bool mLoadEntities = true;
+
+        /// <summary>
+        /// Entity tables are only decoded when requested with Scene::GetEntityTable, and their columns on first access
+        /// </summary>
+        bool mLazyEntities = false;
+
+        /// <summary>
+        /// The number of threads used to decode the sections and the entity tables. 1 reads everything on the calling thread, 0 uses every core.
+        /// </summary>
+        unsigned mThreadCount = 1;
+    };
+
     class Scene
     {
     public:
@@ -89,157 +612,257 @@ namespace Vim
         bfast::Bfast mGeometryBFast;
         bfast::Bfast mAssetsBFast;
         bfast::Bfast mEntitiesBFast;
-        std::vector<const bfast::byte*> mStrings;
+        StringTable mStrings;
         g3d::G3d mGeometry;
         std::unordered_map<std::string, EntityTable> mEntityTables;
         std::unordered_map<std::string, std::string> mHeader;
 
+        /// <summary>
+        /// The raw data of the entity tables which have not been decoded yet
+        /// </summary>
+        std::unordered_map<std::string, bfast::Buffer> mPendingEntityTables;
+
         uint32_t mVersionMajor = 0xffffffff;
         uint32_t mVersionMinor = 0xffffffff;
         uint32_t mVersionPatch = 0xffffffff;
 
-        VimErrorCodes ReadFile(std::string fileName)
+        VimErrorCodes ReadFile(std::string fileName, bool memoryMapped = false)
+        {
+            SceneLoadOptions options;
+            options.mMemoryMapped = memoryMapped;
+            return ReadFile(fileName, options);
+        }
+
+        VimErrorCodes ReadFile(std::string fileName, const SceneLoadOptions& options)
         {
             try
             {
-                mBfast = bfast::Bfast::read_file(fileName);
+                mBfast = bfast::Bfast::read_file(fileName, options.mMemoryMapped);
+                mBfast.decompress(options.mThreadCount);
             }
-            catch (std::exception& e)
+            catch (std::exception&)
             {
-                e;
                 return VimErrorCodes::FileNotRecognized;
             }
 
-            for (auto i = 0; i < mBfast.buffers.size(); ++i)
+            // Each section writes to its own members, so they can be decoded concurrently.
+            // The first failure in file order is reported, the same as when reading serially.
+            // When the sections are decoded concurrently, each one is decoded on a single thread, so that no more than mThreadCount threads run.
+            // The entity tables, which are most of the work, are decoded afterwards with all the threads.
+            std::vector<VimErrorCodes> results(mBfast.buffers.size(), VimErrorCodes::Success);
+            auto serial = parallel::resolve_thread_count(options.mThreadCount) <= 1;
+            auto sectionOptions = options;
+            if (!serial)
+                sectionOptions.mThreadCount = 1;
+            auto readSection = [&](size_t i) { results[i] = ReadSection(mBfast.buffers[i], sectionOptions); };
+
+            if (serial)
             {
-                auto& b = mBfast.buffers[i];
-                if (b.name == "header")
+                for (size_t i = 0; i < mBfast.buffers.size(); ++i)
                 {
-                    std::vector<std::string> versionParts;
+                    readSection(i);
+                    if (results[i] != VimErrorCodes::Success)
+                        return results[i];
+                }
+            }
+            else
+            {
+                parallel::for_each(mBfast.buffers.size(), readSection, options.mThreadCount);
+            }
 
-                    std::string header = (const char*)(b.data.begin());
-                    std::vector<std::string> tokens = split(header, "\n");
+            for (auto result : results)
+                if (result != VimErrorCodes::Success)
+                    return result;
+            if (options.mLoadEntities && !options.mLazyEntities)
+                return ReadEntityTables(options.mThreadCount);
+            return VimErrorCodes::Success;
+        }
 
-                    for (size_t i = 0; i < tokens.size(); i ++)
-                    {
-                        std::vector<std::string> keyValue = split(tokens[i], "=");
+        /// <summary>
+        /// Decodes one of the top-level buffers of a VIM file. The entity tables are only listed here:
+        /// lazy tables are decoded on first access, the others by ReadEntityTables.
+        /// </summary>
+        VimErrorCodes ReadSection(const bfast::Buffer& b, const SceneLoadOptions& options)
+        {
+            if (b.name == "header")
+            {
+                std::vector<std::string> versionParts;
 
-                        if (keyValue.size() == 2)
-                        {
-                            mHeader[keyValue[0]] = keyValue[1];
-                        }
-                    }
+                std::string header = (const char*)(b.data.begin());
+                std::vector<std::string> tokens = split(header, "\n");
 
-                    if (mHeader.end() != mHeader.find("vim"))
-                    {
-                        versionParts = split(mHeader["vim"], ".");
-                    }
-                    else
+                for (size_t i = 0; i < tokens.size(); i ++)
+                {
+                    std::vector<std::string> keyValue = split(tokens[i], "=");
+
+                    if (keyValue.size() == 2)
                     {
-                        // No vim version found
-                        return VimErrorCodes::NoVersionInfo;
+                        mHeader[keyValue[0]] = keyValue[1];
                     }
+                }
 
-                    if (versionParts.size() > 0) mVersionMajor = std::stoi(versionParts[0]);
-                    if (versionParts.size() > 1) mVersionMinor = std::stoi(versionParts[1]);
-                    if (versionParts.size() > 2) mVersionPatch = std::stoi(versionParts[2]);
+                if (mHeader.end() != mHeader.find("vim"))
+                {
+                    versionParts = split(mHeader["vim"], ".");
                 }
-                else if (b.name == "geometry")
+                else
                 {
-                    try
-                    {
-                        mGeometryBFast = bfast::Bfast::unpack(b.data);
-                        mGeometry = std::move(g3d::G3d(mGeometryBFast));
-                    }
-                    catch (std::exception& e)
-                    {
-                        e;
-                        return Vim::VimErrorCodes::GeometryLoadingException;
-                    }
+                    // No vim version found
+                    return VimErrorCodes::NoVersionInfo;
                 }
-                else if (b.name == "assets")
+
+                if (versionParts.size() > 0) mVersionMajor = std::stoi(versionParts[0]);
+                if (versionParts.size() > 1) mVersionMinor = std::stoi(versionParts[1]);
+                if (versionParts.size() > 2) mVersionPatch = std::stoi(versionParts[2]);
+            }
+            else if (b.name == "geometry" && options.mLoadGeometry)
+            {
+                try
                 {
-                    try
-                    {
-                        mAssetsBFast = bfast::Bfast::unpack(b.data);
-                    }
-                    catch (std::exception& e)
-                    {
-                        e;
-                        return Vim::VimErrorCodes::AssetLoadingException;
-                    }
+                    mGeometryBFast = bfast::Bfast::unpack(b);
+                    mGeometryBFast.decompress(options.mThreadCount);
+                    mGeometry = g3d::G3d(mGeometryBFast, options.mThreadCount);
                 }
-                else if (b.name == "strings")
+                catch (std::exception&)
                 {
-                    const bfast::byte* data = b.data.begin();
-                    size_t count = 0;
-                    while (data < b.data.end())
-                    {
-                        count++;
-                        data += strlen((const char*)data) + 1;
-                    }
-
-                    mStrings.resize(count);
-                    count = 0;
-                    data = b.data.begin();
-                    while (data < b.data.end())
-                    {
-                        mStrings[count++] = data;
-                        data += strlen((const char*)data) + 1;
-                    }
+                    return Vim::VimErrorCodes::GeometryLoadingException;
+                }
+            }
+            else if (b.name == "assets" && options.mLoadAssets)
+            {
+                try
+                {
+                    mAssetsBFast = bfast::Bfast::unpack(b);
+                    mAssetsBFast.decompress(options.mThreadCount);
                 }
-                else if (b.name == "entities")
+                catch (std::exception&)
                 {
-                    try
-                    {
-                        mEntitiesBFast = bfast::Bfast::unpack(b.data);
-                        for (auto j = 0; j < mEntitiesBFast.buffers.size(); ++j)
-                        {
-                            auto& entityBuffer = mEntitiesBFast.buffers[j];
-                            EntityTable entityTable = { entityBuffer.name };
-                            bfast::Bfast tableBFast = bfast::Bfast::unpack(entityBuffer.data);
-
-                            for (auto k = 0; k < tableBFast.buffers.size(); ++k)
-                            {
-                                auto& tableBuffer = tableBFast.buffers[k];
-
-                                if (tableBuffer.name == "properties")
-                                {
-                                    entityTable.mProperties = std::vector<SerializableProperty>((SerializableProperty*)tableBuffer.data.begin(), (SerializableProperty*)tableBuffer.data.end());
-                                }
-                                else
-                                {
-                                    size_t index = tableBuffer.name.find_first_of(':');
-                                    std::string type = tableBuffer.name.substr(0, index);
-                                    std::string name = tableBuffer.name.substr(index + 1);
-
-                                    if (type == "numeric")
-                                    {
-                                        entityTable.mNumericColumns[name] = std::vector<double>((double*)tableBuffer.data.begin(), (double*)tableBuffer.data.end());
-                                    }
-                                    else if (type == "index")
-                                    {
-                                        entityTable.mIndexColumns[name] = std::vector<int>((int*)tableBuffer.data.begin(), (int*)tableBuffer.data.end());
-                                    }
-                                    else if (type == "string")
-                                    {
-                                        entityTable.mStringColumns[name] = std::vector<int>((int*)tableBuffer.data.begin(), (int*)tableBuffer.data.end());
-                                    }
-                                }
-                            }
-
-                            mEntityTables[entityTable.mName] = entityTable;
-                        }
-                    }
-                    catch (std::exception& e)
+                    return Vim::VimErrorCodes::AssetLoadingException;
+                }
+            }
+            else if (b.name == "strings" && options.mLoadStrings)
+            {
+                mStrings = StringTable(b);
+            }
+            else if (b.name == "entities" && options.mLoadEntities)
+            {
+                try
+                {
+                    mEntitiesBFast = bfast::Bfast::unpack(b);
+                    mEntitiesBFast.decompress(options.mThreadCount);
+                    if (options.mLazyEntities)
                     {
-                        e;
-                        return Vim::VimErrorCodes::EntityLoadingException;
+                        for (auto& entityBuffer : mEntitiesBFast.buffers)
+                            mPendingEntityTables[entityBuffer.name] = entityBuffer;
                     }
                 }
+                catch (std::exception&)
+                {
+                    return Vim::VimErrorCodes::EntityLoadingException;
+                }
+            }
+            return VimErrorCodes::Success;
+        }
+
+        /// <summary>
+        /// Decodes every table of the entities section over up to threadCount threads (0 uses every core)
+        /// </summary>
+        VimErrorCodes ReadEntityTables(unsigned threadCount)
+        {
+            try
+            {
+                // Tables are decoded concurrently and then merged in file order
+                std::vector<EntityTable> entityTables(mEntitiesBFast.buffers.size());
+                parallel::for_each(entityTables.size(), [&](size_t j) {
+                    auto& entityBuffer = mEntitiesBFast.buffers[j];
+                    entityTables[j] = EntityTable::Read(entityBuffer.name, entityBuffer, false);
+                }, threadCount);
+
+                for (auto& entityTable : entityTables)
+                    mEntityTables[entityTable.mName] = std::move(entityTable);
+            }
+            catch (std::exception&)
+            {
+                return Vim::VimErrorCodes::EntityLoadingException;
             }
             return VimErrorCodes::Success;
         }
+
+        /// <summary>
+        /// Returns the entity table with the given name, decoding it on first access. Returns nullptr if there is no such table.
+        /// </summary>
+        EntityTable* GetEntityTable(const std::string& name)
+        {
+            auto it = mEntityTables.find(name);
+            if (it != mEntityTables.end())
+                return &it->second;
+
+            auto pending = mPendingEntityTables.find(name);
+            if (pending == mPendingEntityTables.end())
+                return nullptr;
+
+            EntityTable entityTable = EntityTable::Read(name, pending->second, true);
+            mPendingEntityTables.erase(pending);
+            return &(mEntityTables[name] = std::move(entityTable));
+        }
+
+        /// <summary>
+        /// Returns the index of the given string, or -1 if the file does not contain it. Property names and values, and string columns,
+        /// hold string indices, so a lookup by value compares this index instead of the strings.
+        /// </summary>
+        int FindString(std::string_view value) const
+        {
+            return mStrings.find(value);
+        }
+
+        /// <summary>
+        /// Returns the names of all entity tables, whether they have been decoded or not
+        /// </summary>
+        std::vector<std::string> GetEntityTableNames() const
+        {
+            std::vector<std::string> r;
+            for (auto& kv : mEntityTables)
+                r.push_back(kv.first);
+            for (auto& kv : mPendingEntityTables)
+                r.push_back(kv.first);
+            return r;
+        }
+
+        /// <summary>
+        /// Writes the scene to a VIM file. The entity tables that were decoded are written from their buffers, so buffers added to them,
+        /// such as the property indices of EntityTable::StorePropertyIndices, are saved. Every other section, including the geometry,
+        /// is written as it was read, uncompressed.
+        /// </summary>
+        void WriteFile(const std::string& fileName)
+        {
+            bfast::Bfast entities;
+            for (const auto& b : mEntitiesBFast.buffers)
+            {
+                auto table = mEntityTables.find(b.name);
+                if (table == mEntityTables.end())
+                {
+                    entities.add(b.name, (bfast::byte*)b.data.begin(), (bfast::byte*)b.data.end(), b.owner);
+                    continue;
+                }
+                auto packed = std::make_shared<std::vector<bfast::byte>>(table->second.mBfast.pack());
+                entities.add(b.name, packed->data(), packed->data() + packed->size(), packed);
+            }
+
+            bfast::Bfast out;
+            for (const auto& b : mBfast.buffers)
+            {
+                if (b.name == "entities" && !mEntitiesBFast.buffers.empty())
+                {
+                    auto packed = std::make_shared<std::vector<bfast::byte>>(entities.pack());
+                    out.add(b.name, packed->data(), packed->data() + packed->size(), packed);
+                }
+                else
+                {
+                    out.add(b.name, (bfast::byte*)b.data.begin(), (bfast::byte*)b.data.end(), b.owner);
+                }
+            }
+            out.write_file(fileName);
+        }
     };
 
 }
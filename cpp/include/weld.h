@@ -0,0 +1,204 @@
+/*
+    Merges duplicate G3D vertices and rebuilds the index buffer
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+*/
+
+#ifndef __WELD_H__
+#define __WELD_H__
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "g3d.h"
+#include "dedup.h"
+#include "parallel.h"
+
+namespace g3d
+{
+    using namespace std;
+
+    struct WeldReport
+    {
+        size_t vertices_before = 0;
+        size_t vertices_after = 0;
+    };
+
+    /// Merges vertices of the same mesh that have the same position and the same values for every other vertex attribute, then
+    /// rebuilds g3d:corner:index. With an epsilon, positions are compared after snapping them to a grid of that size, so merged
+    /// vertices are less than epsilon apart on each axis (two vertices on either side of a grid line are not merged however close).
+    /// Vertices keep their order and stay in their mesh, so submesh and mesh offsets stay valid. A G3d without indices is
+    /// treated as a triangle soup with one vertex per corner and gets an index buffer. When vertices are merged, the levels of detail
+    /// and meshlets refer to the old vertices and are removed (see G3d::remove_derived_attributes), so they have to be generated after welding.
+    ///
+    /// Vertices are hashed in parallel and split into shards by hash, then each shard is welded on its own thread.
+    /// Besides the new attributes, memory use is about 16 bytes per vertex.
+    inline WeldReport weld_vertices(G3d& g3d, float epsilon = 0, unsigned thread_count = 0)
+    {
+        WeldReport report;
+        auto position = g3d.find(descriptors::Position);
+        if (position == nullptr || !position->is<float, 3>())
+            return report;
+        auto positions = position->as<float, 3>();
+        auto num_vertices = positions.size();
+        report.vertices_before = report.vertices_after = num_vertices;
+        if (num_vertices == 0)
+            return report;
+
+        auto index_attr = g3d.find(descriptors::Index);
+        if (index_attr == nullptr && num_vertices % 3 != 0)
+            return report;
+        auto indices = g3d.view<int, 1>(descriptors::Index);
+        for (auto i : indices)
+            if (i < 0 || (size_t)i >= num_vertices)
+                throw runtime_error("An index is out of the range of the vertices");
+
+        // Every other vertex attribute has to match
+        vector<const Attribute*> others;
+        for (const auto& attr : g3d.attributes)
+            if (&attr != position && attr.descriptor.association == assoc_vertex && attr.num_elements() == num_vertices)
+                others.push_back(&attr);
+
+        auto layout = g3d.mesh_layout(thread_count);
+        vector<size_t> ranges = { 0, num_vertices };
+        if (layout.num_meshes() > 0) {
+            ranges.assign(layout.vertex_offsets.begin(), layout.vertex_offsets.end());
+            ranges[0] = 0;
+        }
+        auto range_of = [&](size_t v) {
+            return (size_t)(upper_bound(ranges.begin(), ranges.end(), v) - ranges.begin()) - 1;
+        };
+
+        // The key of a position: its grid cell, or its exact bits without epsilon (with -0 made equal to 0)
+        auto key = [&](size_t v, int64_t* r) {
+            for (int c = 0; c < 3; ++c) {
+                auto x = positions[v][c];
+                if (epsilon > 0) {
+                    // Clamped so that huge or NaN coordinates do not overflow the conversion
+                    auto cell = floor((double)x / epsilon);
+                    r[c] = cell != cell ? 0 : (int64_t)max(-9e18, min(9e18, cell));
+                }
+                else {
+                    uint32_t bits;
+                    x = x == 0 ? 0.0f : x;
+                    memcpy(&bits, &x, 4);
+                    r[c] = bits;
+                }
+            }
+        };
+        auto same = [&](size_t a, size_t b) {
+            int64_t ka[3], kb[3];
+            key(a, ka);
+            key(b, kb);
+            if (ka[0] != kb[0] || ka[1] != kb[1] || ka[2] != kb[2] || range_of(a) != range_of(b))
+                return false;
+            for (auto attr : others) {
+                auto size = attr->data_element_size();
+                if (memcmp(attr->_begin + a * size, attr->_begin + b * size, size) != 0)
+                    return false;
+            }
+            return true;
+        };
+
+        vector<uint64_t> hashes(num_vertices);
+        parallel::for_ranges(num_vertices, 1 << 14, [&](size_t begin, size_t end) {
+            auto range = range_of(begin);
+            for (auto v = begin; v < end; ++v) {
+                while (v >= ranges[range + 1])
+                    ++range;
+                int64_t k[3];
+                key(v, k);
+                auto h = hash_bytes(k, sizeof(k), range);
+                for (auto attr : others)
+                    h = hash_bytes(attr->_begin + v * attr->data_element_size(), attr->data_element_size(), h);
+                hashes[v] = h;
+            }
+        }, thread_count);
+
+        // Splits the vertices into shards by the top bits of their hash, keeping them in order within each shard
+        const int shard_bits = 8;
+        const size_t num_shards = (size_t)1 << shard_bits;
+        vector<size_t> shard_offsets(num_shards + 1, 0);
+        for (auto h : hashes)
+            ++shard_offsets[(h >> (64 - shard_bits)) + 1];
+        for (size_t s = 0; s < num_shards; ++s)
+            shard_offsets[s + 1] += shard_offsets[s];
+        vector<int> by_shard(num_vertices);
+        {
+            auto next = shard_offsets;
+            for (size_t v = 0; v < num_vertices; ++v)
+                by_shard[next[hashes[v] >> (64 - shard_bits)]++] = (int)v;
+        }
+
+        // Each vertex maps to the first vertex equal to it, found with an open addressing table per shard
+        vector<int> representative(num_vertices);
+        parallel::for_each(num_shards, [&](size_t s) {
+            auto count = shard_offsets[s + 1] - shard_offsets[s];
+            size_t capacity = 16;
+            while (capacity < count * 2)
+                capacity *= 2;
+            vector<int> slots(capacity, -1);
+            for (auto k = shard_offsets[s]; k < shard_offsets[s + 1]; ++k) {
+                auto v = by_shard[k];
+                auto slot = (size_t)hashes[v] & (capacity - 1);
+                representative[v] = v;
+                for (; slots[slot] >= 0; slot = (slot + 1) & (capacity - 1)) {
+                    auto u = slots[slot];
+                    if (hashes[u] == hashes[v] && same(u, v)) {
+                        representative[v] = u;
+                        break;
+                    }
+                }
+                if (representative[v] == v)
+                    slots[slot] = v;
+            }
+        }, thread_count);
+        vector<uint64_t>().swap(hashes);
+        vector<int>().swap(by_shard);
+
+        // The kept vertices are numbered in order, so each mesh keeps a contiguous range
+        vector<int> kept;
+        vector<int>& new_index = representative;
+        for (size_t v = 0; v < num_vertices; ++v) {
+            if (representative[v] == (int)v) {
+                new_index[v] = (int)kept.size();
+                kept.push_back((int)v);
+            }
+            else
+                new_index[v] = new_index[representative[v]];
+        }
+        report.vertices_after = kept.size();
+
+        auto num_indices = index_attr != nullptr ? indices.size() : num_vertices;
+        auto new_indices = make_shared<vector<bfast::byte>>(num_indices * sizeof(int));
+        auto new_index_values = (int*)new_indices->data();
+        parallel::for_ranges(num_indices, 1 << 16, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i)
+                new_index_values[i] = new_index[index_attr != nullptr ? indices[i] : (int)i];
+        }, thread_count);
+
+        vector<pair<string, shared_ptr<vector<bfast::byte>>>> replaced;
+        for (const auto& attr : g3d.attributes)
+            if (attr.descriptor.association == assoc_vertex && attr.num_elements() == num_vertices)
+                replaced.emplace_back(attr.name, attr.gather(kept.data(), kept.size(), thread_count));
+        if (auto vertex_offsets = g3d.find(descriptors::MeshVertexOffset)) {
+            vector<int> values;
+            for (auto offset : vertex_offsets->as<int, 1>()) {
+                // The first kept vertex at or after the old offset
+                auto v = (size_t)max(0, offset);
+                values.push_back(v < num_vertices ? (int)(lower_bound(kept.begin(), kept.end(), (int)v) - kept.begin()) : (int)kept.size());
+            }
+            auto data = (const bfast::byte*)values.data();
+            replaced.emplace_back(descriptors::MeshVertexOffset, make_shared<vector<bfast::byte>>(data, data + values.size() * sizeof(int)));
+        }
+        replaced.emplace_back(descriptors::Index, new_indices);
+        for (auto& r : replaced)
+            g3d.replace_attribute(r.first, r.second);
+        if (report.vertices_after != report.vertices_before)
+            g3d.remove_derived_attributes();
+        return report;
+    }
+}
+
+#endif
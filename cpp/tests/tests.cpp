@@ -0,0 +1,653 @@
+/*
+    Round trip tests of the BFAST, G3D and VIM headers
+    Copyright 2019, VIMaec LLC
+    Usage licensed under terms of MIT Licenese.
+
+    A standalone program with no test framework, built like the benchmarks:
+        cl /std:c++17 /O2 /EHsc /DNDEBUG /I..\include tests.cpp
+        g++ -std=c++17 -O2 -DNDEBUG -pthread -I../include tests.cpp -o tests
+
+    Usage: tests [name]
+    Runs every test, or the one with the given name, and returns the number of failed tests.
+    The files are written to the current directory and removed afterwards.
+*/
+
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+#include "g3d.h"
+#include "convert.h"
+#include "builder.h"
+#include "validate.h"
+#include "weld.h"
+
+namespace tests
+{
+    using namespace std;
+
+    /// The number of checks that failed in the current test
+    static int failed_checks = 0;
+
+    inline void check(bool condition, const char* expression, int line)
+    {
+        if (condition)
+            return;
+        printf("    line %d: %s\n", line, expression);
+        ++failed_checks;
+    }
+
+    #define CHECK(...) tests::check((__VA_ARGS__), #__VA_ARGS__, __LINE__)
+
+    /// Returns true if f throws
+    template<typename F>
+    bool throws(F f)
+    {
+        try {
+            f();
+        }
+        catch (std::exception&) {
+            return true;
+        }
+        return false;
+    }
+
+    inline bool same_bytes(const bfast::ByteRange& a, const bfast::ByteRange& b)
+    {
+        return a.size() == b.size() && (a.size() == 0 || memcmp(a.begin(), b.begin(), a.size()) == 0);
+    }
+
+    inline bool same_bytes(const g3d::Attribute& a, const g3d::Attribute& b)
+    {
+        return a.name == b.name && same_bytes(bfast::ByteRange{ a._begin, a._end }, bfast::ByteRange{ b._begin, b._end });
+    }
+
+    /// Two meshes of two triangles each in one submesh, and one instance of each
+    struct Quads
+    {
+        vector<float> positions = { 0,0,0, 1,0,0, 0,1,0, 1,1,0,  0,0,1, 2,0,1, 0,2,1, 2,2,1 };
+        vector<int> indices = { 0,1,2, 2,1,3,  4,5,6, 6,5,7 };
+        vector<int> mesh_vertex_offsets = { 0, 4 };
+        vector<int> mesh_submesh_offsets = { 0, 1 };
+        vector<int> submesh_index_offsets = { 0, 6 };
+        vector<int> submesh_materials = { 0, -1 };
+        vector<float> transforms = vector<float>(32, 0.0f);
+        vector<int> instance_meshes = { 0, 1 };
+        vector<int> instance_parents = { -1, 0 };
+        vector<float> material_colors = { 1, 0, 0, 1 };
+
+        Quads()
+        {
+            for (int k = 0; k < 4; ++k)
+                transforms[k * 5] = transforms[16 + k * 5] = 1;
+        }
+
+        g3d::G3d g3d()
+        {
+            g3d::G3d r;
+            r.add_attribute(g3d::descriptors::Position, positions.data(), positions.size() * sizeof(float));
+            r.add_attribute(g3d::descriptors::Index, indices.data(), indices.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::MeshVertexOffset, mesh_vertex_offsets.data(), mesh_vertex_offsets.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::MeshSubmeshOffset, mesh_submesh_offsets.data(), mesh_submesh_offsets.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::SubmeshIndexOffset, submesh_index_offsets.data(), submesh_index_offsets.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::SubmeshMaterial, submesh_materials.data(), submesh_materials.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::InstanceTransform, transforms.data(), transforms.size() * sizeof(float));
+            r.add_attribute(g3d::descriptors::InstanceMesh, instance_meshes.data(), instance_meshes.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::InstanceParent, instance_parents.data(), instance_parents.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::MaterialColor, material_colors.data(), material_colors.size() * sizeof(float));
+            return r;
+        }
+    };
+
+    /// G3d::write_file then read_file, reading the file or mapping it, gives back the same attributes
+    inline void g3d_write_read()
+    {
+        Quads quads;
+        auto g3d = quads.g3d();
+        g3d.write_file("tests_write_read.g3d");
+        for (auto mapped : { false, true }) {
+            g3d::G3d r;
+            r.read_file("tests_write_read.g3d", mapped);
+            CHECK(r.meta == g3d.meta);
+            CHECK(r.attributes.size() == g3d.attributes.size());
+            for (size_t i = 0; i < r.attributes.size() && i < g3d.attributes.size(); ++i)
+                CHECK(same_bytes(r.attributes[i], g3d.attributes[i]));
+            CHECK(r.view<int, 1>(g3d::descriptors::Index)[11] == 7);
+        }
+        remove("tests_write_read.g3d");
+    }
+
+    /// A file written by BfastStreamWriter in chunks reads back the same through Bfast::read_file and BfastFileReader
+    inline void bfast_stream_write_read()
+    {
+        vector<bfast::byte> a(100000), b(5);
+        for (size_t i = 0; i < a.size(); ++i)
+            a[i] = (bfast::byte)(i * 7);
+        for (size_t i = 0; i < b.size(); ++i)
+            b[i] = (bfast::byte)(i + 1);
+        {
+            bfast::BfastStreamWriter writer("tests_stream.bfast", { "a", "b", "empty" });
+            writer.begin_buffer("a");
+            for (size_t i = 0; i < a.size(); i += 30000)
+                writer.append(a.data() + i, min<size_t>(30000, a.size() - i));
+            writer.begin_buffer("b");
+            writer.append(b.data(), b.size());
+            writer.close();
+        }
+        auto read = bfast::Bfast::read_file("tests_stream.bfast");
+        CHECK(read.buffers.size() == 3);
+        if (read.buffers.size() == 3) {
+            CHECK(read.buffers[0].name == "a" && same_bytes(read.buffers[0].data, bfast::ByteRange{ a.data(), a.data() + a.size() }));
+            CHECK(read.buffers[1].name == "b" && same_bytes(read.buffers[1].data, bfast::ByteRange{ b.data(), b.data() + b.size() }));
+            CHECK(read.buffers[2].name == "empty" && read.buffers[2].data.size() == 0);
+        }
+        bfast::BfastFileReader reader("tests_stream.bfast");
+        CHECK(reader.count() == 3 && reader.find("b") == 1);
+        auto buffer = reader.read("a");
+        CHECK(same_bytes(buffer.range(), bfast::ByteRange{ a.data(), a.data() + a.size() }));
+        auto batch = reader.read(vector<string>{ "b", "a" });
+        CHECK(batch.ranges.size() == 2 && same_bytes(batch.ranges[0], bfast::ByteRange{ b.data(), b.data() + b.size() }));
+        CHECK(throws([]() { bfast::BfastStreamWriter writer("tests_stream.bfast", { "a" }); writer.begin_buffer("b"); }));
+        remove("tests_stream.bfast");
+    }
+
+    /// compress_buffer then decompress_buffer gives back the data, for every filter, with one or several chunks,
+    /// and for data that does not compress
+    inline void bfast_compress_decompress()
+    {
+        vector<bfast::byte> smooth(3 * 1000 * 1000 + 5), noise(200000);
+        for (size_t i = 0; i < smooth.size(); ++i)
+            smooth[i] = (bfast::byte)((i / 4) % 251);
+        uint32_t state = 12345;
+        for (auto& b : noise) {
+            state = state * 1664525u + 1013904223u;
+            b = (bfast::byte)(state >> 24);
+        }
+        const bfast::ulong all_filters[] = { bfast::filter_none, bfast::filter_shuffle, bfast::filter_delta, bfast::filter_shuffle | bfast::filter_delta };
+        for (const auto* data : { &smooth, &noise }) {
+            bfast::ByteRange range{ data->data(), data->data() + data->size() };
+            for (auto filters : all_filters)
+                for (size_t chunk_size : { (size_t)65536, bfast::default_chunk_size }) {
+                    auto packed = bfast::compress_buffer(range, bfast::codec_lz4, chunk_size, 2, filters, 4);
+                    bfast::ByteRange packed_range{ packed.data(), packed.data() + packed.size() };
+                    CHECK(bfast::is_compressed(packed_range) && bfast::decompressed_size(packed_range) == data->size());
+                    vector<bfast::byte> unpacked(data->size());
+                    bfast::decompress_buffer(packed_range, unpacked.data(), 2);
+                    CHECK(unpacked == *data);
+                }
+        }
+        auto packed = bfast::compress_buffer(bfast::ByteRange{ smooth.data(), smooth.data() + smooth.size() });
+        CHECK(packed.size() < smooth.size() / 10);
+    }
+
+    /// A compressed Bfast keeps the names and content of its buffers through a file, in memory and with BfastFileReader,
+    /// and only compressed data can carry the compressed suffix
+    inline void bfast_compressed_file()
+    {
+        vector<bfast::byte> large(100000), small(100);
+        for (size_t i = 0; i < large.size(); ++i)
+            large[i] = (bfast::byte)(i % 7);
+        for (size_t i = 0; i < small.size(); ++i)
+            small[i] = (bfast::byte)i;
+        bfast::Bfast b;
+        b.add("large", large.data(), large.data() + large.size());
+        b.add("small", small.data(), small.data() + small.size());
+        b.compress();
+        CHECK(b.buffers[0].name == string("large") + bfast::compressed_suffix && b.buffers[1].name == "small");
+        b.write_file("tests_compressed.bfast");
+
+        auto read = bfast::Bfast::read_file("tests_compressed.bfast");
+        read.decompress(2);
+        CHECK(read.buffers.size() == 2 && read.index_of("large") == 0 && read.index_of("small") == 1);
+        if (read.buffers.size() == 2) {
+            CHECK(same_bytes(read.buffers[0].data, bfast::ByteRange{ large.data(), large.data() + large.size() }));
+            CHECK(same_bytes(read.buffers[1].data, bfast::ByteRange{ small.data(), small.data() + small.size() }));
+        }
+        bfast::BfastFileReader reader("tests_compressed.bfast");
+        CHECK(reader.find("large") == 0 && reader.compressed[0] && !reader.compressed[1] && reader.buffer_size(0) == large.size());
+        CHECK(same_bytes(reader.read("large").range(), bfast::ByteRange{ large.data(), large.data() + large.size() }));
+        remove("tests_compressed.bfast");
+
+        CHECK(throws([&]() { bfast::Bfast c; c.add("raw#lz4", large.data(), large.data() + large.size()); }));
+        bfast::Bfast corrupt;
+        corrupt.buffers.push_back(bfast::Buffer{ "raw#lz4", bfast::ByteRange{ small.data(), small.data() + small.size() }, nullptr });
+        CHECK(throws([&]() { corrupt.decompress(); }));
+    }
+
+    /// PositionQuantizer::quantize then dequantize moves each position by at most half a step of the bounds of its mesh,
+    /// and positions written quantized are read back as float32 within the same error, without their bounds
+    inline void position_quantize_dequantize()
+    {
+        vector<float> positions;
+        // The meshes are defined by their submesh offsets, so the file round trip needs them although there are no submeshes
+        vector<int> mesh_vertex_offsets = { 0, 500, 500, 1000 }, mesh_submesh_offsets = { 0, 0, 0, 0 };
+        for (int v = 0; v < 1000; ++v) {
+            auto scale = v < 500 ? 1.0f : 1000.0f;
+            positions.push_back(scale * sin(v * 0.37f));
+            positions.push_back(scale * cos(v * 0.11f));
+            positions.push_back(v < 500 ? 0.25f : scale * (v % 13));
+        }
+        auto ranges = g3d::PositionQuantizer::ranges(mesh_vertex_offsets.data(), mesh_vertex_offsets.size(), positions.size() / 3);
+        CHECK(ranges == vector<size_t>{ 0, 500, 500, 1000, 1000 });
+
+        // The step of a mesh is its extent divided by the largest quantized value
+        auto max_error = [&](size_t r, int c, double max_value) {
+            auto lo = numeric_limits<float>::max(), hi = -numeric_limits<float>::max();
+            for (auto v = ranges[r]; v < ranges[r + 1]; ++v) {
+                lo = min(lo, positions[v * 3 + c]);
+                hi = max(hi, positions[v * 3 + c]);
+            }
+            return (float)((hi - lo) / max_value * 0.5) + 1e-6f * max(fabs(lo), fabs(hi));
+        };
+        auto check_restored = [&](const float* restored, double max_value) {
+            for (size_t r = 0; r + 1 < ranges.size(); ++r)
+                for (auto v = ranges[r]; v < ranges[r + 1]; ++v)
+                    for (int c = 0; c < 3; ++c)
+                        CHECK(fabs(restored[v * 3 + c] - positions[v * 3 + c]) <= max_error(r, c, max_value));
+            // A flat axis is restored exactly
+            CHECK(restored[2] == 0.25f && restored[499 * 3 + 2] == 0.25f);
+        };
+        auto round_trip = [&](auto quantized_type) {
+            using Q = decltype(quantized_type);
+            vector<Q> quantized(positions.size());
+            vector<float> bounds((ranges.size() - 1) * 6), restored(positions.size());
+            g3d::PositionQuantizer::quantize(positions.data(), ranges, quantized.data(), bounds.data(), 2);
+            g3d::PositionQuantizer::dequantize(quantized.data(), ranges, bounds.data(), restored.data(), 2);
+            check_restored(restored.data(), (double)numeric_limits<Q>::max());
+        };
+        round_trip(uint16_t());
+        round_trip(uint32_t());
+
+        for (auto type : { g3d::dt_uint16, g3d::dt_uint32 }) {
+            g3d::G3d g3d;
+            g3d.add_attribute(g3d::descriptors::Position, positions.data(), positions.size() * sizeof(float));
+            g3d.add_attribute(g3d::descriptors::MeshVertexOffset, mesh_vertex_offsets.data(), mesh_vertex_offsets.size() * sizeof(int));
+            g3d.add_attribute(g3d::descriptors::MeshSubmeshOffset, mesh_submesh_offsets.data(), mesh_submesh_offsets.size() * sizeof(int));
+            g3d::WriteOptions options;
+            options.position_type = type;
+            options.codec = bfast::codec_lz4;
+            g3d.write_file("tests_quantized.g3d", options);
+            g3d::G3d r;
+            r.read_file("tests_quantized.g3d");
+            auto restored = r.view<float, 3>(g3d::descriptors::Position);
+            CHECK(restored.size() * 3 == positions.size());
+            CHECK(r.find(g3d::descriptors::MeshPositionBounds) == nullptr && r.find(g3d::descriptors::PositionBounds) == nullptr);
+            if (restored.size() * 3 == positions.size())
+                check_restored(restored.values(), type == g3d::dt_uint16 ? 65535.0 : 4294967295.0);
+        }
+        remove("tests_quantized.g3d");
+    }
+
+    /// Every half survives widening and narrowing, the whole-buffer conversions give the same bits as the scalar ones,
+    /// and normals written as float16 are read back as float32 within the allowed error
+    inline void float16_round_trip()
+    {
+        vector<convert::half> halves;
+        for (uint32_t bits = 0; bits < 0x10000; ++bits)
+            if ((bits & 0x7c00) != 0x7c00 || (bits & 0x3ff) == 0)
+                halves.push_back(convert::half{ (uint16_t)bits });
+        vector<float> widened(halves.size());
+        convert::half_to_float(halves.data(), widened.data(), halves.size(), 2);
+        vector<convert::half> narrowed(halves.size());
+        convert::float_to_half(widened.data(), narrowed.data(), widened.size(), 2);
+        for (size_t i = 0; i < halves.size(); ++i) {
+            CHECK(convert::float_bits(widened[i]) == convert::float_bits(convert::to_float(halves[i])));
+            CHECK(narrowed[i].bits == halves[i].bits && convert::to_half(widened[i]).bits == halves[i].bits);
+        }
+
+        // Floats spread over every exponent, including the ones that round to subnormal halves, to infinity or to a tie
+        vector<float> floats;
+        for (uint64_t bits = 0; bits <= 0xffffffffull; bits += 4093) {
+            auto f = convert::bits_float((uint32_t)bits);
+            if (f == f)
+                floats.push_back(f);
+        }
+        for (auto f : { 65519.0f, 65520.0f, 1e-8f, -2.98023224e-8f, 1.0009765625f, 1.00048828125f })
+            floats.push_back(f);
+        vector<convert::half> converted(floats.size());
+        convert::float_to_half(floats.data(), converted.data(), floats.size(), 2);
+        for (size_t i = 0; i < floats.size(); ++i)
+            CHECK(converted[i].bits == convert::to_half(floats[i]).bits);
+        CHECK(convert::to_half(65520.0f).bits == 0x7c00 && convert::to_half(1.00048828125f).bits == 0x3c00);
+
+        Quads quads;
+        vector<float> normals, far_positions;
+        for (size_t v = 0; v < quads.positions.size() / 3; ++v) {
+            auto angle = v * 0.7f;
+            float normal[] = { cos(angle) * 0.6f, sin(angle) * 0.6f, 0.8f };
+            normals.insert(normals.end(), normal, normal + 3);
+        }
+        for (auto p : quads.positions)
+            far_positions.push_back(p + 10000.0f);
+        auto g3d = quads.g3d();
+        g3d.add_attribute(g3d::descriptors::VertexNormal, normals.data(), normals.size() * sizeof(float));
+        g3d.replace_attribute(g3d::descriptors::Position, make_shared<vector<bfast::byte>>((bfast::byte*)far_positions.data(), (bfast::byte*)(far_positions.data() + far_positions.size())));
+        g3d::WriteOptions options;
+        options.float16_normals = true;
+        options.position_type = g3d::dt_float16;
+        g3d.write_file("tests_float16.g3d", options);
+
+        bfast::BfastFileReader reader("tests_float16.g3d");
+        CHECK(reader.find("g3d:vertex:normal:0:float16:3") >= 0 && reader.find(g3d::descriptors::Position) >= 0);
+        g3d::G3d r;
+        r.read_file("tests_float16.g3d");
+        auto read_normals = r.view<float, 3>(g3d::descriptors::VertexNormal);
+        CHECK(read_normals.size() * 3 == normals.size());
+        for (size_t i = 0; i < read_normals.num_values() && i < normals.size(); ++i)
+            CHECK(fabs(read_normals.values()[i] - normals[i]) <= options.float16_max_error);
+        // The positions are too far from the origin for float16 to keep them within the error, so they stay float32
+        auto read_positions = r.view<float, 3>(g3d::descriptors::Position);
+        CHECK(read_positions.num_values() == far_positions.size()
+            && memcmp(read_positions.values(), far_positions.data(), far_positions.size() * sizeof(float)) == 0);
+        remove("tests_float16.g3d");
+    }
+
+    /// A G3d made by G3dBuilder is valid before and after a file round trip, and breaking one attribute at a time
+    /// reports the matching error at the right element, past the first chunk of the parallel checks
+    inline void builder_validate()
+    {
+        const int side = 100, num_meshes = 20;
+        vector<float> positions;
+        vector<int> indices;
+        for (int y = 0; y < side; ++y)
+            for (int x = 0; x < side; ++x) {
+                float p[] = { (float)x, (float)y, 0 };
+                positions.insert(positions.end(), p, p + 3);
+            }
+        for (int y = 0; y + 1 < side; ++y)
+            for (int x = 0; x + 1 < side; ++x) {
+                auto v = y * side + x;
+                int quad[] = { v, v + 1, v + side, v + side, v + 1, v + side + 1 };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        int submesh_offsets[] = { 0, (int)indices.size() / 2 }, submesh_materials[] = { 0, 1 };
+        auto num_vertices = positions.size() / 3;
+
+        g3d::G3dBuilder builder;
+        builder.declare_meshes(num_meshes, num_meshes * 2, num_meshes * num_vertices, num_meshes * indices.size());
+        builder.declare_instances(num_meshes);
+        builder.declare_materials(2);
+        builder.allocate();
+        for (int m = 0; m < num_meshes; ++m)
+            CHECK(builder.add_mesh(positions.data(), num_vertices, indices.data(), indices.size(), submesh_offsets, submesh_materials, 2) == m);
+        vector<float> transforms(num_meshes * 16, 0.0f);
+        vector<int> meshes(num_meshes), parents(num_meshes);
+        for (int i = 0; i < num_meshes; ++i) {
+            for (int k = 0; k < 4; ++k)
+                transforms[i * 16 + k * 5] = 1;
+            meshes[i] = i;
+            parents[i] = i - 1;
+        }
+        builder.add_instances(transforms.data(), meshes.data(), num_meshes, parents.data());
+        float colors[] = { 1, 0, 0, 1,  0, 0, 1, 1 };
+        builder.add_materials(colors, 2);
+        CHECK(g3d::validate(builder.finish(), 2).empty());
+
+        builder.write_file("tests_builder.g3d");
+        g3d::G3d read;
+        read.read_file("tests_builder.g3d");
+        CHECK(g3d::validate(read, 2).empty());
+        CHECK(read.mesh_layout().num_meshes() == num_meshes && read.view<int, 1>(g3d::descriptors::Index).size() == num_meshes * indices.size());
+        remove("tests_builder.g3d");
+
+        // Each change is undone before the next one
+        auto expect = [&](g3d::G3dErrors error, const char* attribute, int64_t element) {
+            auto errors = g3d::validate(builder.finish(), 2);
+            CHECK(errors.size() == 1);
+            if (errors.size() == 1)
+                CHECK(errors[0].error == error && errors[0].attribute == attribute && errors[0].element == element);
+        };
+        auto all_indices = builder.span<int, 1>(g3d::descriptors::Index);
+        auto last = (int64_t)all_indices.size() - 2;
+        auto saved = all_indices[last];
+        all_indices[last] = (int)(num_meshes * num_vertices);
+        expect(g3d::G3dErrors::IndicesOutOfRange, g3d::descriptors::Index, last);
+        all_indices[last] = -1;
+        expect(g3d::G3dErrors::IndicesOutOfRange, g3d::descriptors::Index, last);
+        all_indices[last] = saved;
+
+        auto offsets = builder.span<int, 1>(g3d::descriptors::SubmeshIndexOffset);
+        offsets[num_meshes + 1] += 1;
+        expect(g3d::G3dErrors::SubmeshesIndexOffsetInvalidIndex, g3d::descriptors::SubmeshIndexOffset, num_meshes + 1);
+        offsets[num_meshes + 1] -= 1;
+        auto saved_offset = offsets[5];
+        offsets[5] = offsets[4];
+        expect(g3d::G3dErrors::SubmeshesNonPositive, g3d::descriptors::SubmeshIndexOffset, 4);
+        offsets[5] = saved_offset;
+
+        auto materials = builder.span<int, 1>(g3d::descriptors::SubmeshMaterial);
+        materials[7] = 2;
+        expect(g3d::G3dErrors::SubmeshesMaterialOutOfRange, g3d::descriptors::SubmeshMaterial, 7);
+        materials[7] = -1;
+        CHECK(g3d::validate(builder.finish(), 2).empty());
+
+        auto instance_meshes = builder.span<int, 1>(g3d::descriptors::InstanceMesh);
+        instance_meshes[3] = num_meshes;
+        expect(g3d::G3dErrors::InstancesMeshOutOfRange, g3d::descriptors::InstanceMesh, 3);
+        instance_meshes[3] = 3;
+        auto instance_parents = builder.span<int, 1>(g3d::descriptors::InstanceParent);
+        instance_parents[9] = num_meshes;
+        expect(g3d::G3dErrors::InstancesParentOutOfRange, g3d::descriptors::InstanceParent, 9);
+        instance_parents[9] = 8;
+        CHECK(g3d::validate(builder.finish(), 2).empty());
+
+        // With faces of 7 corners, the index count and the offsets of the triangles are no longer whole faces
+        auto heptagons = builder.finish();
+        int face_size[] = { 7 };
+        heptagons.add_attribute(g3d::descriptors::ObjectFaceSize, face_size, sizeof(face_size));
+        auto errors = g3d::validate(heptagons, 2);
+        CHECK(errors.size() == 2);
+        if (errors.size() == 2)
+            CHECK(errors[0].error == g3d::G3dErrors::IndicesInvalidCount && errors[1].error == g3d::G3dErrors::SubmeshesIndexOffsetInvalidIndex
+                && errors[1].element == 1);
+    }
+
+    /// The position and uv of every corner of a G3d
+    inline vector<array<float, 5>> corner_values(const g3d::G3d& g3d)
+    {
+        auto positions = g3d.view<float, 3>(g3d::descriptors::Position);
+        auto uvs = g3d.view<float, 2>(g3d::descriptors::VertexUv);
+        auto indices = g3d.view<int, 1>(g3d::descriptors::Index);
+        vector<array<float, 5>> r;
+        for (auto i : indices)
+            r.push_back({ positions[i][0], positions[i][1], positions[i][2], uvs[i][0], uvs[i][1] });
+        return r;
+    }
+
+    /// weld_vertices keeps what every corner sees, merges exactly the vertices of a mesh with the same values, never merges
+    /// across meshes, and with an epsilon only moves corners by less than the epsilon
+    inline void weld_invariants()
+    {
+        // Three meshes of triangle soups over the same grid, with a uv seam down the middle of the second one
+        const int side = 12, num_meshes = 3;
+        vector<float> positions, uvs;
+        vector<int> indices, mesh_vertex_offsets, mesh_submesh_offsets, submesh_index_offsets;
+        for (int m = 0; m < num_meshes; ++m) {
+            mesh_vertex_offsets.push_back((int)positions.size() / 3);
+            mesh_submesh_offsets.push_back(m);
+            submesh_index_offsets.push_back((int)indices.size());
+            for (int y = 0; y + 1 < side; ++y)
+                for (int x = 0; x + 1 < side; ++x) {
+                    int corners[6][2] = { { x, y }, { x + 1, y }, { x, y + 1 }, { x, y + 1 }, { x + 1, y }, { x + 1, y + 1 } };
+                    for (auto& c : corners) {
+                        indices.push_back((int)positions.size() / 3);
+                        float p[] = { (float)c[0], (float)c[1], 0 };
+                        positions.insert(positions.end(), p, p + 3);
+                        auto seam = m == 1 && c[0] == side / 2 && x < side / 2;
+                        float uv[] = { seam ? 0.0f : c[0] * 0.1f, c[1] * 0.1f };
+                        uvs.insert(uvs.end(), uv, uv + 2);
+                    }
+                }
+        }
+        auto make = [&](const vector<float>& vertex_positions) {
+            g3d::G3d r;
+            r.add_attribute(g3d::descriptors::Position, (void*)vertex_positions.data(), vertex_positions.size() * sizeof(float));
+            r.add_attribute(g3d::descriptors::VertexUv, uvs.data(), uvs.size() * sizeof(float));
+            r.add_attribute(g3d::descriptors::Index, indices.data(), indices.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::MeshVertexOffset, mesh_vertex_offsets.data(), mesh_vertex_offsets.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::MeshSubmeshOffset, mesh_submesh_offsets.data(), mesh_submesh_offsets.size() * sizeof(int));
+            r.add_attribute(g3d::descriptors::SubmeshIndexOffset, submesh_index_offsets.data(), submesh_index_offsets.size() * sizeof(int));
+            return r;
+        };
+
+        auto g3d = make(positions);
+        auto before = corner_values(g3d);
+        auto report = g3d::weld_vertices(g3d, 0, 2);
+        // Each mesh keeps one vertex per grid point, plus one per seam point for the second mesh
+        auto expected = (size_t)(num_meshes * side * side + side);
+        CHECK(report.vertices_before == positions.size() / 3 && report.vertices_after == expected && g3d.num_vertices() == expected);
+        CHECK(corner_values(g3d) == before);
+        CHECK(g3d::validate(g3d, 2).empty());
+        auto layout = g3d.mesh_layout();
+        auto welded = g3d.view<int, 1>(g3d::descriptors::Index);
+        for (size_t m = 0; m < layout.num_meshes(); ++m)
+            for (auto i = layout.index_offsets[m]; i < layout.index_offsets[m + 1]; ++i)
+                CHECK(welded[i] >= layout.vertex_offsets[m] && welded[i] < layout.vertex_offsets[m + 1]);
+        set<array<float, 5>> distinct;
+        auto welded_positions = g3d.view<float, 3>(g3d::descriptors::Position);
+        auto welded_uvs = g3d.view<float, 2>(g3d::descriptors::VertexUv);
+        for (size_t m = 0; m < layout.num_meshes(); ++m) {
+            distinct.clear();
+            for (auto v = layout.vertex_offsets[m]; v < layout.vertex_offsets[m + 1]; ++v)
+                distinct.insert({ welded_positions[v][0], welded_positions[v][1], welded_positions[v][2], welded_uvs[v][0], welded_uvs[v][1] });
+            CHECK(distinct.size() == (size_t)(layout.vertex_offsets[m + 1] - layout.vertex_offsets[m]));
+        }
+        CHECK(g3d::weld_vertices(g3d, 0, 2).vertices_after == expected);
+
+        // Jittered positions are merged with an epsilon, and each corner moves by less than the epsilon
+        auto jittered = positions;
+        for (size_t i = 0; i < jittered.size(); ++i)
+            jittered[i] += ((i * 7919) % 11) * 1e-5f;
+        auto noisy = make(jittered);
+        auto noisy_before = corner_values(noisy);
+        const float epsilon = 0.01f;
+        auto noisy_report = g3d::weld_vertices(noisy, epsilon, 2);
+        CHECK(noisy_report.vertices_after < noisy_report.vertices_before && noisy_report.vertices_after >= expected);
+        auto noisy_after = corner_values(noisy);
+        CHECK(noisy_after.size() == noisy_before.size());
+        for (size_t i = 0; i < noisy_after.size() && i < noisy_before.size(); ++i)
+            for (int c = 0; c < 3; ++c)
+                CHECK(fabs(noisy_after[i][c] - noisy_before[i][c]) < epsilon);
+    }
+
+    /// What each instance draws: the position of each corner of its mesh and the material of its submesh
+    inline vector<vector<array<float, 4>>> drawn_by_instances(const g3d::G3d& g3d)
+    {
+        auto positions = g3d.view<float, 3>(g3d::descriptors::Position);
+        auto indices = g3d.view<int, 1>(g3d::descriptors::Index);
+        auto materials = g3d.view<int, 1>(g3d::descriptors::SubmeshMaterial);
+        auto ranges = g3d.submesh_index_ranges();
+        auto layout = g3d.mesh_layout();
+        vector<vector<array<float, 4>>> r;
+        for (auto mesh : g3d.view<int, 1>(g3d::descriptors::InstanceMesh)) {
+            r.emplace_back();
+            for (auto s = layout.submesh_offsets[mesh]; s < layout.submesh_offsets[mesh + 1]; ++s)
+                for (auto i = ranges[s]; i < ranges[s + 1]; ++i)
+                    r.back().push_back({ positions[indices[i]][0], positions[indices[i]][1], positions[indices[i]][2], (float)materials[s] });
+        }
+        return r;
+    }
+
+    /// deduplicate_meshes keeps what every instance draws, keeps one mesh per group of identical meshes, keeps meshes that
+    /// differ in any attribute apart, and leaves a valid G3d that a second pass does not change
+    inline void dedup_invariants()
+    {
+        // Meshes 0, 2 and 4 are the same quad, 1 has another position, 3 another material, 5 another face attribute
+        vector<float> positions;
+        vector<int> indices, mesh_vertex_offsets, mesh_submesh_offsets, submesh_index_offsets, submesh_materials, face_groups;
+        const int num_meshes = 6;
+        for (int m = 0; m < num_meshes; ++m) {
+            mesh_vertex_offsets.push_back((int)positions.size() / 3);
+            mesh_submesh_offsets.push_back((int)submesh_index_offsets.size());
+            float quad[] = { 0,0,0, 1,0,0, 0,1,0, 1,1,0 };
+            if (m == 1)
+                quad[11] = 0.5f;
+            auto first = (int)positions.size() / 3;
+            positions.insert(positions.end(), quad, quad + 12);
+            int corners[] = { 0, 1, 2, 2, 1, 3 };
+            for (int k = 0; k < 6; ++k) {
+                if (k % 3 == 0)
+                    submesh_index_offsets.push_back((int)indices.size());
+                indices.push_back(first + corners[k]);
+            }
+            submesh_materials.push_back(0);
+            submesh_materials.push_back(m == 3 ? 0 : 1);
+            face_groups.push_back(7);
+            face_groups.push_back(m == 5 ? 8 : 7);
+        }
+        // Two instances of each mesh
+        vector<float> transforms(num_meshes * 2 * 16, 0.0f), colors = { 1, 0, 0, 1,  0, 1, 0, 1 };
+        vector<int> instance_meshes, instance_parents;
+        for (int i = 0; i < num_meshes * 2; ++i) {
+            for (int k = 0; k < 4; ++k)
+                transforms[i * 16 + k * 5] = 1;
+            instance_meshes.push_back(i % num_meshes);
+            instance_parents.push_back(-1);
+        }
+        g3d::G3d g3d;
+        g3d.add_attribute(g3d::descriptors::Position, positions.data(), positions.size() * sizeof(float));
+        g3d.add_attribute(g3d::descriptors::Index, indices.data(), indices.size() * sizeof(int));
+        g3d.add_attribute(g3d::descriptors::MeshVertexOffset, mesh_vertex_offsets.data(), mesh_vertex_offsets.size() * sizeof(int));
+        g3d.add_attribute(g3d::descriptors::MeshSubmeshOffset, mesh_submesh_offsets.data(), mesh_submesh_offsets.size() * sizeof(int));
+        g3d.add_attribute(g3d::descriptors::SubmeshIndexOffset, submesh_index_offsets.data(), submesh_index_offsets.size() * sizeof(int));
+        g3d.add_attribute(g3d::descriptors::SubmeshMaterial, submesh_materials.data(), submesh_materials.size() * sizeof(int));
+        g3d.add_attribute("g3d:face:group:0:int32:1", face_groups.data(), face_groups.size() * sizeof(int));
+        g3d.add_attribute(g3d::descriptors::InstanceTransform, transforms.data(), transforms.size() * sizeof(float));
+        g3d.add_attribute(g3d::descriptors::InstanceMesh, instance_meshes.data(), instance_meshes.size() * sizeof(int));
+        g3d.add_attribute(g3d::descriptors::InstanceParent, instance_parents.data(), instance_parents.size() * sizeof(int));
+        g3d.add_attribute(g3d::descriptors::MaterialColor, colors.data(), colors.size() * sizeof(float));
+        CHECK(g3d::validate(g3d, 2).empty());
+
+        auto layout = g3d.mesh_layout();
+        CHECK(g3d::find_identical_meshes(g3d, layout, 2) == vector<int>{ 0, 1, 0, 3, 0, 5 });
+        auto before = drawn_by_instances(g3d);
+        auto report = g3d::deduplicate_meshes(g3d, 2);
+        CHECK(report.meshes_before == num_meshes && report.meshes_after == 4 && report.instances_remapped == 4);
+        CHECK(g3d.mesh_layout().num_meshes() == 4 && g3d.num_vertices() == 16);
+        CHECK(g3d.view<int, 1>(g3d::descriptors::InstanceMesh).size() == num_meshes * 2);
+        CHECK(drawn_by_instances(g3d) == before);
+        CHECK(g3d::validate(g3d, 2).empty());
+        auto groups = g3d.view<int, 1>("g3d:face:group:0:int32:1");
+        CHECK(vector<int>(groups.begin(), groups.end()) == vector<int>{ 7, 7, 7, 7, 7, 7, 7, 8 });
+
+        auto again = g3d::deduplicate_meshes(g3d, 2);
+        CHECK(again.meshes_after == 4 && again.instances_remapped == 0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace tests;
+    string only = argc > 1 ? argv[1] : "";
+
+    const pair<const char*, void(*)()> all[] = {
+        { "g3d_write_read", g3d_write_read },
+        { "bfast_stream_write_read", bfast_stream_write_read },
+        { "bfast_compress_decompress", bfast_compress_decompress },
+        { "bfast_compressed_file", bfast_compressed_file },
+        { "position_quantize_dequantize", position_quantize_dequantize },
+        { "float16_round_trip", float16_round_trip },
+        { "builder_validate", builder_validate },
+        { "weld_invariants", weld_invariants },
+        { "dedup_invariants", dedup_invariants },
+    };
+    int failed = 0;
+    for (const auto& test : all) {
+        if (!only.empty() && only != test.first)
+            continue;
+        failed_checks = 0;
+        try {
+            test.second();
+        }
+        catch (std::exception& e) {
+            printf("    exception: %s\n", e.what());
+            ++failed_checks;
+        }
+        printf("%s %s\n", failed_checks == 0 ? "passed" : "FAILED", test.first);
+        failed += failed_checks > 0;
+    }
+    return failed;
+}